@@ -0,0 +1,37 @@
+#!/bin/bash
+# Times scripts with an interpreter: bench/run.sh [interpreter] [script...]
+#
+# Each script runs RUNS times (5 unless set) and the best wall clock time is
+# printed, in milliseconds. Output of the scripts is thrown away. Without
+# scripts, every .lox file next to this one runs, followed by bin/scan for the
+# scanner and compiler throughput. The interpreter defaults to bin/bench. make
+# bench builds both, with optimizations and no disassembly.
+
+dir=$(dirname "$0")
+lox=${1:-$dir/../bin/bench}
+shift
+scripts=("$@")
+scan=
+if [ ${#scripts[@]} -eq 0 ]; then
+	scripts=("$dir"/*.lox)
+	scan=$dir/../bin/scan
+fi
+runs=${RUNS:-5}
+
+for script in "${scripts[@]}"; do
+	best=
+	for ((i = 0; i < runs; i++)); do
+		start=$(date +%s%N)
+		"$lox" "$script" > /dev/null || { echo "$script failed" >&2; break; }
+		end=$(date +%s%N)
+		ms=$(((end - start) / 1000000))
+		if [ -z "$best" ] || [ $ms -lt $best ]; then
+			best=$ms
+		fi
+	done
+	printf "%-20s %6s ms\n" "$(basename "$script")" "$best"
+done
+
+if [ -n "$scan" ] && [ -x "$scan" ]; then
+	"$scan"
+fi
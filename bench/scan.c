@@ -0,0 +1,173 @@
+/*
+ * Scanner and compiler throughput on a generated source:
+ *   bin/scan [megabytes]             MB/s for scanning and for compiling
+ *   bin/scan --source [megabytes]    write the generated source out instead
+ *
+ * The source is the same for a given size: one function whose body is made
+ * of blocks with comments, indentation, locals, strings, numbers and short
+ * statements, so it compiles without errors. Literals come from small sets,
+ * which keeps the function under the limit of 256 constants.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/lox.h"
+#include "../include/scanner.h"
+
+#define RUNS 10
+
+static const char *words[] = {
+    "count", "total", "x",     "index",  "value", "left",   "right",
+    "node",  "item",  "offset", "length", "y",    "result", "buffer",
+};
+#define WORD_COUNT (int)(sizeof(words) / sizeof(words[0]))
+
+static const char *comments[] = {
+    "keep the running total below the bound",
+    "the offset is measured from the start of the buffer",
+    "nothing to do here",
+    "walk the items left to right and remember the last one we saw",
+};
+#define COMMENT_COUNT (int)(sizeof(comments) / sizeof(comments[0]))
+
+static unsigned long long seed = 88172645463325252ull;
+
+static int randomBelow(int n) {
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return (int)(seed % (unsigned long long)n);
+}
+
+typedef struct {
+  char *chars;
+  size_t length;
+  size_t capacity;
+} Source;
+
+static void append(Source *source, const char *format, ...) {
+  for (;;) {
+    va_list args;
+    va_start(args, format);
+    size_t room = source->capacity - source->length;
+    int length = vsnprintf(source->chars + source->length, room, format, args);
+    va_end(args);
+    if ((size_t)length < room) {
+      source->length += length;
+      return;
+    }
+    source->capacity *= 2;
+    source->chars = realloc(source->chars, source->capacity);
+    if (source->chars == NULL) {
+      fprintf(stderr, "Out of memory.\n");
+      exit(1);
+    }
+  }
+}
+
+// a local name, unique within its block by the number after it
+static void name(Source *source, int block, int n) {
+  append(source, "%s_%d_%d", words[(block + n * 5) % WORD_COUNT], block % 97,
+         n);
+}
+
+static char *generate(size_t size) {
+  Source source = {malloc(size + 4096), 0, size + 4096};
+  append(&source, "fun generated(alpha, beta) {\n");
+  for (int block = 0; source.length < size; block++) {
+    append(&source, "  // %s\n  {\n", comments[randomBelow(COMMENT_COUNT)]);
+    int locals = 2 + randomBelow(4);
+    for (int i = 0; i < locals; i++) {
+      append(&source, "    var ");
+      name(&source, block, i);
+      switch (randomBelow(3)) {
+      case 0:
+        append(&source, " = alpha * %d + beta;\n", randomBelow(64));
+        break;
+      case 1:
+        append(&source, " = \"%s\";\n", comments[randomBelow(COMMENT_COUNT)]);
+        break;
+      default:
+        append(&source, " = %d.%d;\n", randomBelow(16), randomBelow(8));
+        break;
+      }
+    }
+
+    append(&source, "    if (");
+    name(&source, block, 0);
+    append(&source, " > %d and beta != nil) {\n      ", randomBelow(64));
+    name(&source, block, 0);
+    append(&source, " = ");
+    name(&source, block, 0);
+    append(&source, " - 1;\n    } else {\n      print ");
+    name(&source, block, 1);
+    append(&source, ";\n    }\n    while (false) beta = beta + 1;\n  }\n");
+  }
+  append(&source, "  return alpha;\n}\n");
+  return source.chars;
+}
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// the best of a few runs, in MB/s
+static double scanRate(const char *source, size_t length) {
+  double best = 0;
+  for (int run = 0; run < RUNS; run++) {
+    double start = now();
+    initScanner(source, source + length);
+    while (scanToken().type != TOKEN_EOF)
+      ;
+    double rate = length / 1e6 / (now() - start);
+    if (rate > best)
+      best = rate;
+  }
+  return best;
+}
+
+static double compileRate(const char *source, size_t length) {
+  double best = 0;
+  for (int run = 0; run < RUNS; run++) {
+    LoxVM *lox = loxNewVM();
+    double start = now();
+    ObjFunction *script = loxCompile(lox, source);
+    double rate = length / 1e6 / (now() - start);
+    loxFreeVM(lox);
+    if (script == NULL) {
+      fprintf(stderr, "The generated source didn't compile.\n");
+      exit(1);
+    }
+    if (rate > best)
+      best = rate;
+  }
+  return best;
+}
+
+int main(int argc, char *argv[]) {
+  bool printSource = argc > 1 && strcmp(argv[1], "--source") == 0;
+  int megabytes = 16;
+  if (argc > 1 + printSource)
+    megabytes = atoi(argv[1 + printSource]);
+  if (megabytes < 1) {
+    fprintf(stderr, "Usage: scan [--source] [megabytes]\n");
+    return 64;
+  }
+
+  char *source = generate((size_t)megabytes << 20);
+  size_t length = strlen(source);
+  if (printSource) {
+    fwrite(source, 1, length, stdout);
+  } else {
+    printf("%-20s %6.0f MB/s\n", "scan", scanRate(source, length));
+    printf("%-20s %6.0f MB/s\n", "compile", compileRate(source, length));
+  }
+  free(source);
+  return 0;
+}
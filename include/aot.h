@@ -0,0 +1,80 @@
+/*
+ * Ahead of time translation of compiled Lox to C. translateToC() writes a
+ * program in which every function of a script is a C function with one
+ * straight-line block per instruction. Built against liblox it runs without
+ * scanning, compiling or dispatching anything. The generated code relies on
+ * the rest of this header.
+ */
+
+#ifndef clox_aot_h
+#define clox_aot_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "memo.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+void translateToC(ObjFunction *script, const char *path, FILE *out);
+
+// A translated program carries its functions as data. The bytecode comes
+// along too, it is what error messages take their line numbers from.
+
+typedef enum {
+  AOT_NUMBER,
+  AOT_INTEGER, // kept in number, which holds it exactly
+  AOT_STRING,
+  AOT_FUNCTION,
+} AotConstantType;
+
+typedef struct {
+  AotConstantType type;
+  double number;
+  const char *chars;
+  int length;
+  int function; // index into the program's functions
+} AotConstant;
+
+typedef struct {
+  const char *name; // NULL for the script itself
+  int arity;
+  const uint8_t *code;
+  const int *lines;
+  int count;
+  const AotConstant *constants;
+  int constantCount;
+  int (*body)(CallFrame *frame);
+  const Upvalue *upvalues;
+  int upvalueCount;
+  int memoLimit; // the cache size of a @memo function, 0 for any other
+} AotFunction;
+
+// load the functions into a fresh VM and run the first one, the script
+int aotMain(const AotFunction *functions, int count);
+
+#define AOT_UPVALUES (frame->closure->upvalues)
+
+#define AOT_FALSEY(value) (IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)))
+
+// point the frame at an instruction, so errors report the right line
+#define AOT_AT(offset) (frame->ip = frame->function->chunk.code + (offset))
+
+#define AOT_ERROR(offset, ...)                                                 \
+  do {                                                                         \
+    AOT_AT(offset);                                                            \
+    vm->stackTop = sp;                                                         \
+    runtimeError(__VA_ARGS__);                                                 \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
+
+// the entry for a global, straight from the cache while it is still good
+#define AOT_GLOBAL(cache, name)                                                \
+  ((cache).entry != NULL && (cache).entries == vm->globals.entries &&          \
+           (cache).entry->key == (name)                                        \
+       ? (cache).entry                                                         \
+       : tableFindCached(&vm->globals, (name), &(cache)))
+
+#endif
@@ -0,0 +1,38 @@
+/*
+ * A bump allocator for scratch data that all dies at the same time, such as
+ * the buffers the compiler grows while it emits code.
+ */
+
+#ifndef clox_arena_h
+#define clox_arena_h
+
+#include "common.h"
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct ArenaBlock {
+  struct ArenaBlock *next;
+  size_t capacity;
+  size_t used;
+  uint8_t data[];
+} ArenaBlock;
+
+typedef struct {
+  ArenaBlock *head;  // the block we are currently carving from
+  ArenaBlock *spare; // released blocks, kept around for reuse
+} Arena;
+
+// a position in the arena that can be returned to later
+typedef struct {
+  ArenaBlock *block;
+  size_t used;
+} ArenaMark;
+
+void initArena(Arena *arena);
+void freeArena(Arena *arena);
+void *arenaAllocate(Arena *arena, size_t size);
+void *arenaGrow(Arena *arena, void *pointer, size_t oldSize, size_t newSize);
+ArenaMark arenaMark(Arena *arena);
+void arenaRelease(Arena *arena, ArenaMark mark);
+
+#endif
@@ -38,7 +38,72 @@ typedef enum {
   OP_JUMP_IF_FALSE,
   OP_JUMP,
   OP_LOOP,
-  OP_CALL,
+  OP_CALL, // operands: the argument count, then a u16 call cache
+  OP_BUILD_LIST, // operand: how many items are on the stack
+  OP_GET_INDEX,
+  OP_SET_INDEX,
+
+  // Closures. OP_CLOSURE wraps a function constant that has upvalues, see
+  // Upvalue in object.h. OP_GET_UPVALUE reads one that was copied in, the
+  // _BOXED forms go through an ObjUpvalue. OP_CLOSE_UPVALUES moves every
+  // open upvalue from the given slot up off the stack, and functions whose
+  // locals get boxed return with OP_RETURN_CLOSING, which does the same for
+  // all of their slots.
+  OP_CLOSURE,
+  OP_GET_UPVALUE,
+  OP_GET_BOXED,
+  OP_SET_BOXED,
+  OP_CLOSE_UPVALUES,
+  OP_RETURN_CLOSING,
+
+  // Classes. OP_CLASS, OP_METHOD and OP_GET_SUPER take the name as a
+  // constant. The property instructions also take the index of their cache
+  // in the function, two bytes after the name, see PropertyCache in object.h.
+  OP_CLASS,
+  OP_METHOD,
+  OP_INHERIT,
+  OP_GET_PROPERTY,
+  OP_SET_PROPERTY,
+  OP_GET_SUPER,
+
+  // obj.name(args) and super.name(args), which call the method without
+  // binding it first. They take the name, the argument count and a cache.
+  OP_INVOKE,
+  OP_SUPER_INVOKE,
+
+  // Guards a function body the compiler copied into the caller, see
+  // inlineCall() in compile.c. Takes the argument count, the function as a
+  // constant and a forward jump, taken to an ordinary OP_CALL when the value
+  // below the arguments is some other callee.
+  OP_GUARD_CALLEE,
+
+  // Functions declared with @memo, see memo.h. The body starts with copies
+  // of the arguments and OP_MEMO_LOOKUP, which on a hit pushes the result
+  // for the OP_RETURN after it, and on a miss jumps over that. Every return
+  // goes through OP_MEMO_STORE, which keeps the value on top of the stack
+  // under the copies.
+  OP_MEMO_LOOKUP,
+  OP_MEMO_STORE,
+
+  // Quickened forms. The generic instruction rewrites itself into one of
+  // these once it has seen number operands, and they turn back into the
+  // generic form the first time that guess turns out wrong.
+  OP_ADD_NUM,
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
+  OP_GREATER_NUM,
+  OP_LESS_NUM,
+
+  // Unchecked forms. The compiler emits these where it can prove the
+  // operands are numbers, so they skip the type checks altogether.
+  OP_NEGATE_UNCHECKED,
+  OP_ADD_UNCHECKED,
+  OP_SUBTRACT_UNCHECKED,
+  OP_MULTIPLY_UNCHECKED,
+  OP_DIVIDE_UNCHECKED,
+  OP_GREATER_UNCHECKED,
+  OP_LESS_UNCHECKED,
 } OpCode;
 
 // storage for instructions and data
@@ -48,11 +113,18 @@ typedef struct {
   uint8_t *code;
   ValueArray constants;
   int *lines;
+  Arena *arena; // where the buffers grow while the chunk is being compiled
 } Chunk;
 
 void initChunk(Chunk *chunk);
+void presizeChunk(Chunk *chunk, Arena *arena, int capacity);
+void compactChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 void freeChunk(Chunk *chunk);
 int addConstant(Chunk *chunk, Value value);
+uint8_t genericInstruction(uint8_t instruction);
+bool isUnchecked(uint8_t instruction);
+int instructionLength(uint8_t instruction);
+int stackEffect(const uint8_t* code);
 
 #endif
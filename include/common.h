@@ -5,8 +5,20 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// release builds (the libraries) leave out the debugging output
+#ifndef NDEBUG
 #define DEBUG_PRINT_CODE
+#endif
 //#define DEBUG_TRACE_EXECUTION
+// the JIT only knows how to write x86-64 code for Linux
+#if defined(__x86_64__) && defined(__linux__) && !defined(LOX_NO_JIT)
+#define LOX_JIT
+#endif
+// hot functions get their bytecode rewritten, see optimize.h
+#ifndef LOX_NO_OPTIMIZE
+#define LOX_OPTIMIZE
+#endif
+
 #define UINT8_COUNT (UINT8_MAX + 1) // max number of local variables in scope at
                                     // any moment
 #endif
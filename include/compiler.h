@@ -5,4 +5,6 @@
 #include "vm.h"
 
 ObjFunction* compile(const char* source);
+// compile the body of a function that was left for its first call
+bool compileLazily(ObjFunction* function);
 #endif
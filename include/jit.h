@@ -0,0 +1,46 @@
+/*
+ * A baseline JIT for Linux on x86-64. Hot functions get their bytecode
+ * translated one instruction at a time into machine code that works on the
+ * very same VM stack as the interpreter, so either one can pick up a frame
+ * where the other left off.
+ */
+
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+
+#ifdef LOX_JIT
+
+#include "object.h"
+#include "vm.h"
+
+// a function gets compiled once its calls plus loop iterations reach this
+#define JIT_THRESHOLD 1000
+// a function whose guards keep failing goes back to being interpreted
+#define JIT_MAX_DEOPTS 100
+
+// What running JIT code can end in, besides the InterpretResult of an error.
+// JIT_RETURNED means the frame returned and its result is on the caller's
+// stack. JIT_DEOPT means a type check failed, frame->ip points at the
+// instruction that failed and the interpreter should take it from there.
+#define JIT_RETURNED -1
+#define JIT_DEOPT -2
+
+typedef struct JitCode {
+  uint8_t *code; // executable memory
+  size_t size;
+  uint32_t *offsets; // machine code offset for every bytecode offset
+  int offsetCount;
+  EntryCache *globals;  // one per global access in the function
+  int globalCount;
+  int deopts;
+} JitCode;
+
+bool jitCompile(ObjFunction *function);
+void jitFree(ObjFunction *function);
+int jitExecute(CallFrame *frame);
+
+#endif
+
+#endif
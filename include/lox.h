@@ -0,0 +1,68 @@
+/*
+ * Public embedding interface. Hosts create one or more VMs, compile a script
+ * once, and then call into the functions it defines as often as they like.
+ * Nothing in here calls exit(), every failure is reported as an
+ * InterpretResult and the message can be fetched with loxError().
+ */
+
+#ifndef clox_lox_h
+#define clox_lox_h
+
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+typedef struct VM LoxVM;
+
+LoxVM *loxNewVM();
+void loxFreeVM(LoxVM *lox);
+
+// compile a script without running it, NULL on a compile error
+ObjFunction *loxCompile(LoxVM *lox, const char *source);
+// run a compiled script, which defines its globals in the VM
+InterpretResult loxRun(LoxVM *lox, ObjFunction *script);
+InterpretResult loxInterpret(LoxVM *lox, const char *source);
+
+// call a function value, or a function stored in a global
+InterpretResult loxCall(LoxVM *lox, Value callee, int argCount, Value *args,
+                        Value *result);
+InterpretResult loxCallGlobal(LoxVM *lox, const char *name, int argCount,
+                              Value *args, Value *result);
+
+// arity of -1 lets the native take any number of arguments. The userdata
+// pointer is handed back to the native on every call.
+void loxDefineNative(LoxVM *lox, const char *name, NativeFn function,
+                     int arity, void *userdata);
+
+bool loxGetGlobal(LoxVM *lox, const char *name, Value *value);
+void loxSetGlobal(LoxVM *lox, const char *name, Value value);
+Value loxString(LoxVM *lox, const char *chars, int length);
+
+// the most recent error message, empty if the last call succeeded
+const char *loxError(LoxVM *lox);
+// echo errors to stderr as the command line interpreter does
+void loxPrintErrors(LoxVM *lox, bool enabled);
+// send the output of print statements somewhere other than stdout. Output
+// is buffered, it reaches the file when a call into the VM returns.
+void loxSetOutput(LoxVM *lox, FILE *out);
+
+// Cap the bytes the VM may allocate, 0 for no limit. Going over the cap turns
+// into a runtime error with a report of what the heap holds.
+void loxSetHeapLimit(LoxVM *lox, size_t bytes);
+size_t loxHeapUsed(LoxVM *lox);
+
+// Limit how long each call into the VM may run, either by the number of loop
+// iterations and calls it makes or by wall clock time. 0 turns a limit off.
+// A script that runs over stops with INTERPRET_INTERRUPTED.
+void loxSetBudget(LoxVM *lox, long ticks);
+void loxSetTimeout(LoxVM *lox, long milliseconds);
+// Stop whatever the VM is running, safe to call from any thread. Only the
+// call running at the time stops, an interrupt while the VM is idle is
+// forgotten when the next call starts.
+void loxInterrupt(LoxVM *lox);
+
+// Compile top level function bodies on their first call instead of up front.
+// Errors in a body then show up when it is called, as a runtime error.
+void loxSetLazyCompile(LoxVM *lox, bool enabled);
+
+#endif
@@ -0,0 +1,30 @@
+/*
+ * Maps from any value to any value, the ObjMap behind map() in scripts.
+ * Numbers are keys by value, so 1 and 1.0 are the same key. Strings are
+ * interned, which makes every other key an identity comparison. NaN is never
+ * equal to itself and can't be a key.
+ */
+
+#ifndef clox_map_h
+#define clox_map_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+uint32_t hashValue(Value value);
+
+bool mapGet(ObjMap *map, Value key, Value *value);
+// true when the key is new
+bool mapSet(ObjMap *map, Value key, Value value);
+bool mapDelete(ObjMap *map, Value key);
+
+// Going through a map: the position of the first key after position, -1 to
+// start from the beginning. Returns -1 when there are no more. Keys added
+// along the way come after all the others, and growing doesn't move a thing.
+int mapNext(ObjMap *map, int position);
+
+// where key is among the entries, even if it was deleted, or -1
+int mapPosition(ObjMap *map, Value key);
+
+#endif
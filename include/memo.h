@@ -0,0 +1,54 @@
+/*
+ * Results of functions declared with @memo, kept per function and keyed on
+ * the arguments. The cache holds at most limit results and forgets the one
+ * used longest ago to make room for a new one. Arguments match when they
+ * are the same value: 1 and 1.0 do, 0 and -0 don't, since they divide
+ * differently, and a NaN matches the same NaN.
+ */
+
+#ifndef clox_memo_h
+#define clox_memo_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// results kept by @memo, and the most @memo(n) can ask for
+#define MEMO_DEFAULT_LIMIT 1024
+#define MEMO_MAX_LIMIT (1 << 20)
+
+typedef struct {
+  uint32_t hash;
+  int32_t chain; // the next entry in the same bucket, or -1
+  int32_t newer; // neighbours in the order of use, -1 past either end
+  int32_t older;
+  Value result;
+} MemoEntry;
+
+typedef struct Memo {
+  int limit;
+  int count;
+  int capacity;
+  MemoEntry *entries; // the start of the block the next two are in too
+  Value *keys;        // the arguments of each entry, arity of them apiece
+  int32_t *buckets;   // the first entry of each, a power of two of them
+  int bucketCount;
+  int32_t newest;
+  int32_t oldest;
+
+  // for memoStats()
+  int64_t hits;
+  int64_t misses;
+  int64_t evictions;
+} Memo;
+
+Memo *newMemo(int limit);
+void freeMemo(Memo *memo, int arity);
+
+// Look the arguments of a call to function up, args being its first
+// parameter. True on a hit, with the result, which becomes the newest.
+bool memoLookup(ObjFunction *function, Value *args, Value *result);
+// keep the result of a call, making room if the cache is full
+void memoStore(ObjFunction *function, Value *args, Value result);
+
+#endif
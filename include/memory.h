@@ -7,6 +7,7 @@
 #ifndef clox_memory_h
 #define clox_memory_h
 
+#include "arena.h"
 #include "common.h"
 #include "object.h"
 
@@ -24,6 +25,13 @@
 (type*)reallocate(pointer, sizeof(type) * (oldCount), \
 sizeof(type) * (newCount))
 
+// the same, but inside an arena when one is given
+#define GROW_ARRAY_IN(arena, type, pointer, oldCount, newCount) \
+((arena) != NULL \
+? (type*)arenaGrow(arena, pointer, sizeof(type) * (oldCount), \
+sizeof(type) * (newCount)) \
+: GROW_ARRAY(type, pointer, oldCount, newCount))
+
 #define FREE_ARRAY(type, pointer, oldCount) \
 reallocate(pointer, sizeof(type) * (oldCount), 0)
 
@@ -34,7 +42,49 @@ reallocate(pointer, sizeof(type) * (oldCount), 0)
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
 
+// --------------------------------------------------------------------------
+// Small allocations are carved out of slabs, one pool for each size class,
+// instead of going to malloc one by one.
+
+#define POOL_GRANULE 16
+#define POOL_MAX_SIZE 256
+#define POOL_CLASSES (POOL_MAX_SIZE / POOL_GRANULE)
+#define SLAB_SIZE (16 * 1024)
+
+typedef struct PoolSlab {
+  struct PoolSlab* next;
+} PoolSlab;
+
+typedef struct PoolCell {
+  struct PoolCell* next;
+} PoolCell;
+
+typedef struct {
+  PoolCell* free;   // cells that have been handed back
+  PoolSlab* slabs;  // every slab this pool owns
+  uint8_t* next;    // untouched space in the newest slab
+  uint8_t* limit;
+  int slabCount;
+} Pool;
+
+// what we know about each type of object
+typedef struct {
+  size_t liveBytes;
+  size_t liveCount;
+  size_t allocations;
+  size_t peakBytes;
+} ObjStats;
+
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+// fail up front if this many more bytes won't fit under the heap limit
+void reserveHeap(size_t bytes);
+void initPools(Pool* pools);
+void freePools(Pool* pools);
+void trackObject(ObjType type, long bytes, int count);
+int heapReport(char* buffer, size_t size);
+const char* objTypeName(ObjType type);
+int poolSlabs();
 void freeObjects();
 
 #endif
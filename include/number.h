@@ -0,0 +1,14 @@
+#ifndef clox_number_h
+#define clox_number_h
+
+#include "common.h"
+
+// the most a number can take up as text, "-2.2250738585072014e-308" is 24
+#define NUMBER_TEXT_MAX 32
+
+// Write a number as text into buffer, without a terminator, and return its
+// length. Doubles get the shortest digits that read back as the same double.
+int formatNumber(double number, char *buffer);
+int formatInt(int64_t integer, char *buffer);
+
+#endif
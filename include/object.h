@@ -3,6 +3,7 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "table.h"
 #include "value.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
@@ -11,15 +12,42 @@
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
+#define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
+#define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
+#define AS_UPVALUE(value) ((ObjUpvalue *)AS_OBJ(value))
+#define IS_CLASS(value) isObjType(value, OBJ_CLASS)
+#define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
+#define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
+#define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
+#define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
-#define AS_NATIVE(value) (((ObjNative *)AS_OBJ(value))->function)
+#define AS_NATIVE(value) ((ObjNative *)AS_OBJ(value))
+#define IS_LIST(value) isObjType(value, OBJ_LIST)
+#define AS_LIST(value) ((ObjList *)AS_OBJ(value))
+#define IS_FLOAT_ARRAY(value) isObjType(value, OBJ_FLOAT_ARRAY)
+#define AS_FLOAT_ARRAY(value) ((ObjFloatArray *)AS_OBJ(value))
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
+#define AS_MAP(value) ((ObjMap *)AS_OBJ(value))
 
 typedef enum {
   OBJ_FUNCTION,
   OBJ_NATIVE,
   OBJ_STRING,
+  OBJ_LIST,
+  OBJ_FLOAT_ARRAY,
+  OBJ_MAP,
+  OBJ_CLOSURE,
+  OBJ_UPVALUE,
+  OBJ_CLASS,
+  OBJ_INSTANCE,
+  OBJ_BOUND_METHOD,
+  OBJ_SHAPE,
 } ObjType;
 
+// keep this in step with the last entry above
+#define OBJ_TYPE_COUNT (OBJ_SHAPE + 1)
+
 struct Obj {
   ObjType type;
   struct Obj *next;
@@ -32,29 +60,220 @@ struct ObjString {
   uint32_t hash;
 };
 
+struct CallFrame;
+
+// A hidden class. Instances of a class that had the same fields added in the
+// same order share a shape, which says what slot each field is in. Adding a
+// field moves an instance on to the next shape, and shapes remember where
+// they lead so every instance following the same path ends up sharing them.
+typedef struct ObjShape {
+  Obj obj;
+  struct ObjShape *parent; // the shape before the last field was added
+  ObjString *name;         // that field, NULL for a class's empty shape
+  int count;               // fields, the last one added is in slot count - 1
+  struct ObjShape **transitions; // shapes with one more field than this one
+  int transitionCount;
+  int transitionCapacity;
+} ObjShape;
+
+// One way of a property cache: what a property of instances with the given
+// shape turned out to be, either a field or a method of their class. Stores
+// also remember the shape the instance moves on to when the field is new.
+// The caches of super calls are keyed by the superclass's empty shape.
+typedef struct {
+  ObjShape *shape; // NULL while the way is unused
+  ObjShape *after;
+  int slot;        // -1 for a method
+  int version;     // of the class, when the method was looked up
+  Value method;
+} CacheEntry;
+
+// The inline cache of a property instruction. The first way is the one the
+// fast paths look at, the others make it polymorphic.
+#define CACHE_WAYS 4
+
+typedef struct {
+  CacheEntry entries[CACHE_WAYS];
+} PropertyCache;
+
+// The inline cache of a call instruction: whatever it called last time, as
+// long as that is something it can call again without looking closer. The
+// callee is compared by identity, so a hit knows its type already and that
+// it takes as many arguments as the call site passes.
+typedef enum {
+  CALL_NONE,
+  CALL_FUNCTION,
+  CALL_CLOSURE,
+  CALL_NATIVE,
+} CallKind;
+
+typedef struct {
+  Obj *callee;
+  CallKind kind;
+} CallCache;
+
+// Where a closure gets one of its upvalues from when it is created: a local
+// of the function creating it, or one of that function's own upvalues.
+// Variables that are never assigned after their declaration are copied into
+// the closure, the others are shared through an ObjUpvalue.
+typedef struct {
+  uint8_t index;
+  bool isLocal;
+  bool boxed;
+} Upvalue;
+
 typedef struct {
   Obj obj;
   int arity;
   Chunk chunk;
   ObjString *name;
+
+  // a function with upvalues only ever runs as part of an ObjClosure
+  int upvalueCount;
+  Upvalue *upvalues;
+
+  // one for each property instruction, indexed by its operand
+  int cacheCount;
+  PropertyCache *caches;
+
+  // and one for each call
+  int callCacheCount;
+  CallCache *callCaches;
+
+  // tiering, see jit.h
+  int hotness;           // calls plus loop iterations so far
+  bool jitDisabled;      // can't be compiled, or kept failing its guards
+  bool optimized;        // had its bytecode rewritten, or a go at it, see
+                         // optimize.h
+  struct JitCode *jit;   // machine code, once the function got hot
+
+  // the body as translated to C ahead of time, see aot.h
+  int (*aot)(struct CallFrame *frame);
+
+  // Where the parameter list starts, while the body is still waiting to be
+  // compiled on the first call. NULL once it has been. See compileLazily().
+  const char *lazySource;
+  const char *lazyEnd; // the end of the whole source
+  int lazyLine;
+
+  // the results of earlier calls, for a function declared with @memo, see
+  // memo.h. NULL for any other.
+  struct Memo *memo;
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value *args);
+// A function along with the variables it captured. Each upvalue is either
+// the captured value itself or, for a variable that can change, the
+// ObjUpvalue holding it.
+typedef struct {
+  Obj obj;
+  ObjFunction *function;
+  int upvalueCount;
+  Value upvalues[];
+} ObjClosure;
+
+// A captured variable that may be assigned to. While the function declaring
+// it is running it lives on the stack, and once its scope ends it moves into
+// closed. Open ones are kept in vm->openUpvalues, highest slot first.
+typedef struct ObjUpvalue {
+  Obj obj;
+  Value *location;
+  Value closed;
+  struct ObjUpvalue *next;
+} ObjUpvalue;
+
+typedef struct {
+  Obj obj;
+  ObjString *name;
+  Table methods;
+  Value initializer; // init() from the methods, nil if there is none
+  ObjShape *shape;   // the empty one new instances start with
+  int version;       // bumped whenever methods change, so cached ones go stale
+} ObjClass;
+
+typedef struct {
+  Obj obj;
+  ObjClass *klass;
+  ObjShape *shape;
+  Value *fields; // shape->count of them are in use
+  int capacity;
+} ObjInstance;
+
+// a method taken off an instance without being called straight away
+typedef struct {
+  Obj obj;
+  Value receiver;
+  Value method; // a function or a closure
+} ObjBoundMethod;
+
+// Natives write their return value through result. Returning false signals a
+// runtime error, whose message should be set with nativeError() first.
+typedef bool (*NativeFn)(void *userdata, int argCount, Value *args,
+                         Value *result);
 
 typedef struct {
   Obj obj;
   NativeFn function;
+  int arity; // -1 accepts any number of arguments
+  void *userdata;
 } ObjNative;
 
+// the items sit next to each other, so indexing is a bounds check and a load
+typedef struct {
+  Obj obj;
+  int count;
+  int capacity;
+  Value *items;
+} ObjList;
+
+// A fixed number of plain doubles, for number crunching. The natives that
+// work on a whole array run on the kernels in simd.h.
+typedef struct {
+  Obj obj;
+  int count;
+  double *values;
+} ObjFloatArray;
+
+typedef struct {
+  Value key;
+  Value value;
+  uint32_t hash;
+  bool deleted;
+} MapEntry;
+
+// A map from any value to any value, see map.h. The entries are kept in the
+// order their keys were first added and the hash table only holds positions
+// in them, so growing rebuilds the table without reordering anything.
+typedef struct {
+  Obj obj;
+  int count;         // keys in the map
+  int used;          // entries taken, deleted ones included
+  int capacity;      // of entries, the table has twice as many slots
+  MapEntry *entries;
+  int32_t *slots;    // an entry's position, or -1 for an empty slot
+} ObjMap;
+
+// lists can't grow past this many items
+#define LIST_MAX (INT32_MAX / 2)
+
 ObjFunction *newFunction();
-ObjNative *newNative(NativeFn function);
+ObjClosure *newClosure(ObjFunction *function);
+ObjUpvalue *newUpvalue(Value *slot);
+ObjClass *newClass(ObjString *name);
+ObjInstance *newInstance(ObjClass *klass);
+ObjBoundMethod *newBoundMethod(Value receiver, Value method);
+ObjShape *newShape(ObjShape *parent, ObjString *name);
+ObjNative *newNative(NativeFn function, int arity, void *userdata);
+ObjList *newList(int capacity);
+void appendToList(ObjList *list, Value value);
+ObjFloatArray *newFloatArray(int count);
+ObjMap *newMap();
 
 static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
 ObjString *copyString(const char *chars, int length);
-void printObject(Value value);
+void writeObject(Output *out, Value value);
 
 ObjString *takeString(char *chars, int length);
 
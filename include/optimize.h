@@ -0,0 +1,33 @@
+/*
+ * The optimizing tier. A function that gets hot has its bytecode lifted into
+ * SSA form, where every slot of the frame is a variable, run through constant
+ * propagation, common subexpression elimination, loop invariant code motion
+ * and dead code elimination, and lowered back into bytecode for the same
+ * frame. The new bytecode replaces the old, and the interpreter and the JIT
+ * run it like any other.
+ */
+
+#ifndef clox_optimize_h
+#define clox_optimize_h
+
+#include "common.h"
+
+#ifdef LOX_OPTIMIZE
+
+#include "object.h"
+
+// a function is optimized once its calls plus loop iterations reach this,
+// well before the JIT would compile it
+#define OPTIMIZE_THRESHOLD 500
+
+// Rewrite the function's bytecode, if there's anything to gain. entries are
+// where the frames running the function are in the old bytecode: the start
+// for one just called, a loop header for one that just jumped back, or the
+// instruction after a call for the others. Returns whether the function was
+// rewritten, in which case each entry is moved to the same point in the new
+// bytecode.
+bool optimizeFunction(ObjFunction *function, int *entries, int count);
+
+#endif
+
+#endif
@@ -1,14 +1,18 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
-void initScanner(const char* source);
+// the source runs up to end, where there has to be a '\0'
+void initScanner(const char* source, const char* end);
+// start part way into a source, at the given line
+void initScannerAt(const char* source, const char* end, int line);
 
 typedef enum {
 	// Single-character tokens.
 	TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
 	TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
+	TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
 	TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
-	TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
+	TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR, TOKEN_AT,
 	// One or two character tokens.
 	TOKEN_BANG, TOKEN_BANG_EQUAL,
 	TOKEN_EQUAL, TOKEN_EQUAL_EQUAL,
@@ -35,4 +39,15 @@ typedef struct {
 
 Token scanToken();
 
+typedef struct {
+	const char* start; // start of the lexame
+	const char* current; // current character
+	const char* end; // the '\0' at the end of the source
+	int line; // line for error reporting
+} Scanner;
+
+// for looking ahead, the compiler saves where the scanner is and comes back
+Scanner saveScanner();
+void restoreScanner(Scanner saved);
+
 #endif
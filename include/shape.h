@@ -0,0 +1,35 @@
+/*
+ * Shapes, the hidden classes behind instance fields, and the inline caches
+ * property instructions keep of them. See ObjShape in object.h.
+ */
+
+#ifndef clox_shape_h
+#define clox_shape_h
+
+#include "common.h"
+#include "object.h"
+
+// the slot of a field in instances of the shape, -1 if they don't have it
+int shapeSlot(ObjShape *shape, ObjString *name);
+
+// the shape an instance moves on to when it gets a new field
+ObjShape *shapeWith(ObjShape *shape, ObjString *name);
+
+// Make room for the shape's fields, an instance moving to it with a new
+// field may need more of them.
+void growFields(ObjInstance *instance, ObjShape *shape);
+
+// the way of the cache that knows about the shape, or NULL
+static inline CacheEntry *cacheFind(PropertyCache *cache, ObjShape *shape) {
+  for (int i = 0; i < CACHE_WAYS; i++) {
+    if (cache->entries[i].shape == shape)
+      return &cache->entries[i];
+  }
+  return NULL;
+}
+
+// Make the shape the first way, pushing the others down. The one that
+// falls off the end is the least recently added.
+CacheEntry *cacheAdd(PropertyCache *cache, ObjShape *shape);
+
+#endif
@@ -0,0 +1,29 @@
+/*
+ * Numeric kernels over arrays of doubles, behind the float64 array natives.
+ * Each one comes in a scalar, an SSE2 and an AVX2 version. The best one the
+ * CPU supports is picked the first time any of them runs, unless LOX_SIMD in
+ * the environment asks for a lower level ("scalar" or "sse2").
+ *
+ * Sums and prefix sums add the values up in a different order than a plain
+ * loop would, so the last bits of the result can differ from one.
+ */
+
+#ifndef clox_simd_h
+#define clox_simd_h
+
+#include "common.h"
+
+double simdSum(const double *values, int count);
+double simdDot(const double *a, const double *b, int count);
+void simdScale(double *values, int count, double factor);
+void simdAdd(double *into, const double *from, int count);
+void simdPrefixSum(double *values, int count);
+
+// NaNs are skipped, unless the first value is one. count must be at least 1.
+double simdMin(const double *values, int count);
+double simdMax(const double *values, int count);
+
+// which version is in use, "avx2", "sse2" or "scalar"
+const char *simdLevel();
+
+#endif
@@ -17,11 +17,20 @@ typedef struct {
   Entry* entries;
 } Table;
 
+// Where a key was found the last time it was looked up. It is still there as
+// long as the table hasn't been resized and the entry holds the same key.
+typedef struct {
+  Entry* entries;
+  Entry* entry;
+} EntryCache;
+
 void initTable(Table* table);
 void freeTable(Table* table);
 bool tableSet(Table* table, ObjString* key, Value value);
 void tableAddAll(Table* from, Table* to);
 bool tableGet(Table* table, ObjString* key, Value* value);
+Entry* tableFindEntry(Table* table, ObjString* key);
+Entry* tableFindCached(Table* table, ObjString* key, EntryCache* cache);
 bool tableDelete(Table* table, ObjString* key);
 ObjString* tableFindString(Table* table, const char* chars, int length,
 		uint32_t hash);
@@ -6,7 +6,9 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include "./arena.h"
 #include "./common.h"
+#include <stdio.h>
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
@@ -15,7 +17,8 @@ typedef enum {
 	VAL_BOOL,
 	VAL_NIL,
 	VAL_NUMBER,
-	VAL_OBJ
+	VAL_OBJ,
+	VAL_INT // a number that happens to be a whole one, see FITS_INT
 } ValueType;
 
 // compiler will add padding after the 4 byte tag to align our 8 byte double
@@ -26,6 +29,7 @@ typedef struct {
 	union {
 	  bool boolean;
 	  double number;
+	  int64_t integer;
 	  Obj* obj;
 	} as;
 } Value;
@@ -33,20 +37,83 @@ typedef struct {
 // checks the type of a Value
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_NUMBER(value) ((value).type == VAL_NUMBER || (value).type == VAL_INT)
+#define IS_INT(value) ((value).type == VAL_INT)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
 // handles conversion from clox types to C types
 #define AS_BOOL(value) ((value).as.boolean)
-#define AS_NUMBER(value) ((value).as.number)
+#define AS_NUMBER(value) valueToNumber(value)
+#define AS_INT(value) ((value).as.integer)
 #define AS_OBJ(value) ((value).as.obj)
 
 // handles conversion from C types to clox types
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value) ((Value){VAL_INT, {.integer = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
+// Whole numbers are kept as integers while they stay within 54 bits. Every
+// one of those is exactly a double as well, so an integer result is always
+// the same number double arithmetic would have produced. Anything bigger, or
+// a fraction, or negative zero, is a double like it always was.
+#define FITS_INT(i) ((int64_t)((uint64_t)(i) << 10) >> 10 == (i))
+
+static inline double valueToNumber(Value value) {
+	return value.type == VAL_INT ? (double)value.as.integer : value.as.number;
+}
+
+// Arithmetic on two numbers of either kind, the caller checks they are
+// numbers. Integers stay integers as long as the result is exact.
+
+static inline Value addNumbers(Value a, Value b) {
+	if (IS_INT(a) && IS_INT(b) && FITS_INT(AS_INT(a) + AS_INT(b)))
+		return INT_VAL(AS_INT(a) + AS_INT(b));
+	return NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+}
+
+static inline Value subtractNumbers(Value a, Value b) {
+	if (IS_INT(a) && IS_INT(b) && FITS_INT(AS_INT(a) - AS_INT(b)))
+		return INT_VAL(AS_INT(a) - AS_INT(b));
+	return NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+}
+
+static inline Value multiplyNumbers(Value a, Value b) {
+	int64_t result;
+	// a zero with a negative on the other side has to be -0
+	if (IS_INT(a) && IS_INT(b) &&
+	    !__builtin_mul_overflow(AS_INT(a), AS_INT(b), &result) &&
+	    FITS_INT(result) && (result != 0 || (AS_INT(a) >= 0 && AS_INT(b) >= 0)))
+		return INT_VAL(result);
+	return NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+}
+
+static inline Value divideNumbers(Value a, Value b) {
+	if (IS_INT(a) && IS_INT(b) && AS_INT(b) != 0 &&
+	    AS_INT(a) % AS_INT(b) == 0 && (AS_INT(a) != 0 || AS_INT(b) > 0) &&
+	    FITS_INT(AS_INT(a) / AS_INT(b)))
+		return INT_VAL(AS_INT(a) / AS_INT(b));
+	return NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+}
+
+static inline Value negateNumber(Value a) {
+	if (IS_INT(a) && AS_INT(a) != 0 && FITS_INT(-AS_INT(a)))
+		return INT_VAL(-AS_INT(a));
+	return NUMBER_VAL(-AS_NUMBER(a));
+}
+
+static inline Value greaterNumbers(Value a, Value b) {
+	if (IS_INT(a) && IS_INT(b))
+		return BOOL_VAL(AS_INT(a) > AS_INT(b));
+	return BOOL_VAL(AS_NUMBER(a) > AS_NUMBER(b));
+}
+
+static inline Value lessNumbers(Value a, Value b) {
+	if (IS_INT(a) && IS_INT(b))
+		return BOOL_VAL(AS_INT(a) < AS_INT(b));
+	return BOOL_VAL(AS_NUMBER(a) < AS_NUMBER(b));
+}
 
 
 
@@ -56,12 +123,35 @@ typedef struct {
 	int capacity;
 	int count;
 	Value* values;
+	Arena* arena; // grow inside this arena rather than the heap, if set
 } ValueArray;
 
 void initValueArray(ValueArray* array);
+void compactValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
 void freeValueArray(ValueArray* array);
+
+// Text on its way to a file. Writes pile up in bytes until they fill it or it
+// is flushed, rather than going through stdio a piece at a time.
+#define OUTPUT_BUFFER_SIZE 8192
+
+typedef struct {
+	FILE* file;
+	int length;
+	char bytes[OUTPUT_BUFFER_SIZE];
+} Output;
+
+void writeBytes(Output* output, const char* bytes, int length);
+void flushOutput(Output* output);
+void writeValue(Output* output, Value value);
+
+static inline void writeByte(Output* output, char byte) {
+	if (output->length == OUTPUT_BUFFER_SIZE) flushOutput(output);
+	output->bytes[output->length++] = byte;
+}
+
 void printValue(Value value);
+void fprintValue(FILE* out, Value value);
 bool valuesEqual(Value a, Value b);
 
 
@@ -2,7 +2,11 @@
 #define clox_vm_h
 
 
+#include <setjmp.h>
+#include <stdatomic.h>
+
 #include "chunk.h"
+#include "memory.h"
 #include "table.h"
 #include "object.h"
 
@@ -13,36 +17,124 @@
 void push(Value value);
 Value pop();
 
+// room for the most recent error message, compile or runtime
+#define ERROR_MAX 512
+
 
 
 typedef enum {
 	INTERPRET_OK,
 	INTERPRET_COMPILE_ERROR,
-	INTERPRET_RUNTIME_ERROR
+	INTERPRET_RUNTIME_ERROR,
+	INTERPRET_INTERRUPTED // out of budget, past the deadline, or interrupted
 } InterpretResult;
 
+// Fuel is only burned by loops and calls, since every other instruction moves
+// forward through a finite chunk. The VM checks its budget, deadline and
+// interrupt flag whenever it runs through this many.
+#define FUEL_SLICE 10000
 
-typedef struct {
+
+typedef struct CallFrame {
   ObjFunction* function;
   uint8_t* ip;
   Value* slots;
+  ObjClosure* closure; // only set when the function has upvalues
 } CallFrame;
 
 
 
 InterpretResult interpret(const char* source);
+InterpretResult runFunction(ObjFunction* function);
+InterpretResult callFunction(Value callee, int argCount, Value* args,
+		Value* result);
+
+// a script kept around for its functions that haven't been compiled yet
+typedef struct SourceCopy {
+	struct SourceCopy* next;
+	size_t length;
+	char chars[];
+} SourceCopy;
 
-typedef struct {
+typedef struct VM {
   CallFrame frames[FRAMES_MAX];
   int frameCount;
 	Value stack[STACK_MAX];
 	Value* stackTop;
 	Obj* objects;
+	ObjUpvalue* openUpvalues; // captured variables still on the stack
 	Table strings;
 	Table globals;
+	ObjString* initString; // to spot initializers among the methods
+
+	// the last error is always kept here so embedders can retrieve it; it is
+	// only echoed to stderr when printErrors is set
+	char error[ERROR_MAX];
+	bool printErrors;
+
+	// where print statements go, to stdout unless the output is being
+	// captured. It is flushed whenever a call into the VM returns.
+	Output output;
+
+	// Leave the bodies of top level functions until they are first called.
+	// Their source is copied into sources, since the caller's goes away.
+	bool lazyCompile;
+	struct SourceCopy* sources;
+
+	// memory
+	Pool pools[POOL_CLASSES];
+	ObjStats objStats[OBJ_TYPE_COUNT];
+	bool releasing; // the whole heap is going away, see freeObjects()
+	size_t bytesAllocated;
+	size_t heapLimit; // 0 means no limit
+
+	// where to unwind to when an error can't be returned normally, such as
+	// running out of heap in the middle of an allocation
+	jmp_buf* errorHandler;
+
+	// preemption, all counted per call into the VM
+	long fuel;          // ticks left before the next check
+	long fuelGranted;   // size of the slice fuel was last topped up with
+	long ticksUsed;     // loops and calls run so far
+	long budget;        // most ticks a call may use, 0 for no limit
+	long timeout;       // wall clock milliseconds a call may take, 0 for none
+	long long deadline; // monotonic nanoseconds, derived from the timeout
+	atomic_bool interruptRequested; // may be set from any thread
 } VM; 
 
-void initVM();
-void freeVM();
+// the VM every other module operates on. Embedders switch it through the
+// functions in lox.h, so there is no need to pass it around everywhere. Each
+// thread has its own, so separate threads can run separate VMs.
+extern _Thread_local VM* vm;
+
+void initVM(VM* target);
+void freeVM(VM* target);
+
+void defineNative(const char* name, NativeFn function, int arity,
+		void* userdata);
+void nativeError(const char* format, ...);
+void reportError(const char* format, ...);
+void heapExhausted(size_t requested);
+
+// for compiled code, see jit.h and aot.h
+void runtimeError(const char* format, ...);
+void concatenate();
+bool refuel();
+InterpretResult runCall(int argCount, CallCache* cache);
+InterpretResult finishCall();
+void buildList(int itemCount);
+void pushClosure(CallFrame* frame, ObjFunction* function);
+void closeUpvalues(Value* last);
+InterpretResult getIndex();
+InterpretResult setIndex();
+void pushClass(ObjString* name);
+void defineMethod(ObjString* name);
+InterpretResult inherit();
+InterpretResult getProperty(ObjString* name, PropertyCache* cache);
+InterpretResult setProperty(ObjString* name, PropertyCache* cache);
+InterpretResult getSuper(ObjString* name);
+InterpretResult runInvoke(ObjString* name, int argCount, PropertyCache* cache);
+InterpretResult runSuperInvoke(ObjString* name, int argCount,
+		PropertyCache* cache);
 
 #endif
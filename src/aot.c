@@ -0,0 +1,629 @@
+/*
+ * Translating compiled functions to C, and loading them back in when the
+ * translated program starts.
+ */
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/aot.h"
+
+typedef struct {
+  ObjFunction **functions;
+  int count;
+  int capacity;
+} FunctionList;
+
+static int findFunction(FunctionList *list, ObjFunction *function) {
+  for (int i = 0; i < list->count; i++) {
+    if (list->functions[i] == function)
+      return i;
+  }
+  return -1;
+}
+
+// every function the script defines, directly or nested, the script first
+static void collectFunctions(FunctionList *list, ObjFunction *function) {
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity < 8 ? 8 : list->capacity * 2;
+    list->functions =
+        realloc(list->functions, sizeof(ObjFunction *) * list->capacity);
+  }
+  list->functions[list->count++] = function;
+
+  ValueArray *constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    Value constant = constants->values[i];
+    if (IS_FUNCTION(constant) &&
+        findFunction(list, AS_FUNCTION(constant)) == -1) {
+      collectFunctions(list, AS_FUNCTION(constant));
+    }
+  }
+}
+
+static void writeString(FILE *out, const char *chars, int length) {
+  fputc('"', out);
+  for (int i = 0; i < length; i++) {
+    unsigned char c = chars[i];
+    if (c >= ' ' && c <= '~' && c != '"' && c != '\\' && c != '?') {
+      fputc(c, out);
+    } else {
+      fprintf(out, "\\%03o", c);
+    }
+  }
+  fputc('"', out);
+}
+
+static void writeData(FILE *out, FunctionList *list, int index) {
+  Chunk *chunk = &list->functions[index]->chunk;
+
+  fprintf(out, "static const uint8_t code%d[] = {", index);
+  for (int i = 0; i < chunk->count; i++)
+    fprintf(out, "%s%d,", i % 16 == 0 ? "\n    " : " ", chunk->code[i]);
+  fprintf(out, "};\n");
+
+  fprintf(out, "static const int lines%d[] = {", index);
+  for (int i = 0; i < chunk->count; i++)
+    fprintf(out, "%s%d,", i % 16 == 0 ? "\n    " : " ", chunk->lines[i]);
+  fprintf(out, "};\n");
+
+  fprintf(out, "static const AotConstant constants%d[] = {\n", index);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    if (IS_INT(constant)) {
+      // always exact, integers are small enough
+      fprintf(out, "    {AOT_INTEGER, %a},\n", AS_NUMBER(constant));
+    } else if (IS_NUMBER(constant)) {
+      // %a is exact, but nan and infinity have no literal
+      double number = AS_NUMBER(constant);
+      if (isnan(number)) {
+        fprintf(out, "    {AOT_NUMBER, NAN},\n");
+      } else if (isinf(number)) {
+        fprintf(out, "    {AOT_NUMBER, %sINFINITY},\n", number < 0 ? "-" : "");
+      } else {
+        fprintf(out, "    {AOT_NUMBER, %a},\n", number);
+      }
+    } else if (IS_STRING(constant)) {
+      ObjString *string = AS_STRING(constant);
+      fprintf(out, "    {AOT_STRING, 0, ");
+      writeString(out, string->chars, string->length);
+      fprintf(out, ", %d},\n", string->length);
+    } else if (IS_FUNCTION(constant)) {
+      fprintf(out, "    {AOT_FUNCTION, 0, NULL, 0, %d},\n",
+              findFunction(list, AS_FUNCTION(constant)));
+    }
+  }
+  fprintf(out, "    {0}};\n");
+
+  ObjFunction *function = list->functions[index];
+  fprintf(out, "static const Upvalue upvalues%d[] = {", index);
+  for (int i = 0; i < function->upvalueCount; i++) {
+    Upvalue *upvalue = &function->upvalues[i];
+    fprintf(out, "\n    {%d, %s, %s},", upvalue->index,
+            upvalue->isLocal ? "true" : "false",
+            upvalue->boxed ? "true" : "false");
+  }
+  fprintf(out, "\n    {0}};\n\n");
+}
+
+// the instruction at offset as C, sp being the stack top
+static void writeInstruction(FILE *out, Chunk *chunk, int offset) {
+  uint8_t *code = chunk->code + offset;
+  uint8_t instruction = genericInstruction(code[0]);
+  int next = offset + instructionLength(instruction);
+  int jump = next - offset == 3 ? code[1] << 8 | code[2] : 0;
+
+  switch (instruction) {
+  case OP_CONSTANT: {
+    Value constant = chunk->constants.values[code[1]];
+    if (IS_INT(constant)) {
+      fprintf(out, "  *sp++ = INT_VAL(%" PRId64 ");\n", AS_INT(constant));
+    } else if (IS_NUMBER(constant) && isfinite(AS_NUMBER(constant))) {
+      fprintf(out, "  *sp++ = NUMBER_VAL(%a);\n", AS_NUMBER(constant));
+    } else {
+      fprintf(out, "  *sp++ = constants[%d];\n", code[1]);
+    }
+    break;
+  }
+
+  case OP_NIL:
+    fprintf(out, "  *sp++ = NIL_VAL;\n");
+    break;
+  case OP_TRUE:
+    fprintf(out, "  *sp++ = BOOL_VAL(true);\n");
+    break;
+  case OP_FALSE:
+    fprintf(out, "  *sp++ = BOOL_VAL(false);\n");
+    break;
+  case OP_POP:
+    fprintf(out, "  sp--;\n");
+    break;
+
+  case OP_GET_LOCAL:
+    fprintf(out, "  *sp++ = slots[%d];\n", code[1]);
+    break;
+  case OP_SET_LOCAL:
+    fprintf(out, "  slots[%d] = sp[-1];\n", code[1]);
+    break;
+
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+    // a translated program only ever runs one VM, so the cache can be static
+    fprintf(out,
+            "  {\n"
+            "    static EntryCache cache;\n"
+            "    ObjString *name = AS_STRING(constants[%d]);\n"
+            "    Entry *entry = AOT_GLOBAL(cache, name);\n"
+            "    if (entry == NULL)\n"
+            "      AOT_ERROR(%d, \"Undefined variable '%%s'.\", name->chars);\n"
+            "    %s;\n"
+            "  }\n",
+            code[1], next,
+            instruction == OP_GET_GLOBAL ? "*sp++ = entry->value"
+                                     : "entry->value = sp[-1]");
+    break;
+
+  case OP_DEFINE_GLOBAL:
+    fprintf(out,
+            "  AOT_AT(%d);\n"
+            "  tableSet(&vm->globals, AS_STRING(constants[%d]), sp[-1]);\n"
+            "  sp--;\n",
+            next, code[1]);
+    break;
+
+  case OP_EQUAL:
+    fprintf(out, "  sp[-2] = BOOL_VAL(valuesEqual(sp[-2], sp[-1]));\n"
+                 "  sp--;\n");
+    break;
+
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE: {
+    const char *op = instruction == OP_GREATER    ? "greaterNumbers"
+                     : instruction == OP_LESS     ? "lessNumbers"
+                     : instruction == OP_SUBTRACT ? "subtractNumbers"
+                     : instruction == OP_MULTIPLY ? "multiplyNumbers"
+                                              : "divideNumbers";
+    if (!isUnchecked(code[0]))
+      fprintf(out,
+              "  if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2]))\n"
+              "    AOT_ERROR(%d, \"Operands must be numbers.\");\n",
+              next);
+    fprintf(out,
+            "  sp[-2] = %s(sp[-2], sp[-1]);\n"
+            "  sp--;\n",
+            op);
+    break;
+  }
+
+  case OP_ADD:
+    if (isUnchecked(code[0])) {
+      fprintf(out, "  sp[-2] = addNumbers(sp[-2], sp[-1]);\n"
+                   "  sp--;\n");
+      break;
+    }
+    fprintf(out,
+            "  if (IS_NUMBER(sp[-1]) && IS_NUMBER(sp[-2])) {\n"
+            "    sp[-2] = addNumbers(sp[-2], sp[-1]);\n"
+            "    sp--;\n"
+            "  } else if (IS_STRING(sp[-1]) && IS_STRING(sp[-2])) {\n"
+            "    vm->stackTop = sp;\n"
+            "    concatenate();\n"
+            "    sp = vm->stackTop;\n"
+            "  } else {\n"
+            "    AOT_ERROR(%d, \"Operands must be two numbers or two "
+            "strings.\");\n"
+            "  }\n",
+            next);
+    break;
+
+  case OP_NEGATE:
+    if (isUnchecked(code[0])) {
+      fprintf(out, "  sp[-1] = negateNumber(sp[-1]);\n");
+      break;
+    }
+    fprintf(out,
+            "  if (!IS_NUMBER(sp[-1]))\n"
+            "    AOT_ERROR(%d, \"Operand must be a number.\");\n"
+            "  sp[-1] = negateNumber(sp[-1]);\n",
+            next);
+    break;
+
+  case OP_NOT:
+    fprintf(out, "  sp[-1] = BOOL_VAL(AOT_FALSEY(sp[-1]));\n");
+    break;
+
+  case OP_PRINT:
+    fprintf(out, "  writeValue(&vm->output, *--sp);\n"
+                 "  writeByte(&vm->output, '\\n');\n");
+    break;
+
+  case OP_JUMP_IF_FALSE:
+    fprintf(out, "  if (AOT_FALSEY(sp[-1]))\n    goto at%d;\n", next + jump);
+    break;
+
+  case OP_JUMP:
+    fprintf(out, "  goto at%d;\n", next + jump);
+    break;
+
+  case OP_LOOP:
+    fprintf(out,
+            "  if (--vm->fuel <= 0) {\n"
+            "    AOT_AT(%d);\n"
+            "    if (!refuel())\n"
+            "      return INTERPRET_INTERRUPTED;\n"
+            "  }\n"
+            "  goto at%d;\n",
+            next, next - jump);
+    break;
+
+  case OP_GUARD_CALLEE:
+    fprintf(out,
+            "  if (!IS_OBJ(sp[%d]) || AS_OBJ(sp[%d]) != AS_OBJ(constants[%d]))\n"
+            "    goto at%d;\n",
+            -(code[1] + 1), -(code[1] + 1), code[2],
+            next + (code[3] << 8 | code[4]));
+    break;
+
+  case OP_MEMO_LOOKUP:
+    fprintf(out,
+            "  {\n"
+            "    Value result;\n"
+            "    if (!memoLookup(frame->function, slots + 1, &result))\n"
+            "      goto at%d;\n"
+            "    *sp++ = result;\n"
+            "  }\n",
+            next + jump);
+    break;
+
+  case OP_MEMO_STORE:
+    fprintf(out,
+            "  AOT_AT(%d);\n"
+            "  vm->stackTop = sp;\n"
+            "  memoStore(frame->function,\n"
+            "            slots + 1 + frame->function->arity, sp[-1]);\n",
+            next);
+    break;
+
+  case OP_CALL:
+    fprintf(out,
+            "  {\n"
+            "    static CallCache cache;\n"
+            "    AOT_AT(%d);\n"
+            "    vm->stackTop = sp;\n"
+            "    if ((status = runCall(%d, &cache)) != INTERPRET_OK)\n"
+            "      return status;\n"
+            "    sp = vm->stackTop;\n"
+            "  }\n",
+            next, code[1]);
+    break;
+
+  case OP_BUILD_LIST:
+    fprintf(out,
+            "  AOT_AT(%d);\n"
+            "  vm->stackTop = sp;\n"
+            "  buildList(%d);\n"
+            "  sp = vm->stackTop;\n",
+            next, code[1]);
+    break;
+
+  case OP_GET_INDEX:
+    fprintf(out,
+            "  if (IS_LIST(sp[-2]) && IS_INT(sp[-1]) &&\n"
+            "      (uint64_t)AS_INT(sp[-1]) < (uint64_t)AS_LIST(sp[-2])->count) {\n"
+            "    sp[-2] = AS_LIST(sp[-2])->items[AS_INT(sp[-1])];\n"
+            "    sp--;\n"
+            "  } else {\n"
+            "    AOT_AT(%d);\n"
+            "    vm->stackTop = sp;\n"
+            "    if ((status = getIndex()) != INTERPRET_OK)\n"
+            "      return status;\n"
+            "    sp = vm->stackTop;\n"
+            "  }\n",
+            next);
+    break;
+
+  case OP_SET_INDEX:
+    fprintf(out,
+            "  if (IS_LIST(sp[-3]) && IS_INT(sp[-2]) &&\n"
+            "      (uint64_t)AS_INT(sp[-2]) < (uint64_t)AS_LIST(sp[-3])->count) {\n"
+            "    AS_LIST(sp[-3])->items[AS_INT(sp[-2])] = sp[-1];\n"
+            "    sp[-3] = sp[-1];\n"
+            "    sp -= 2;\n"
+            "  } else {\n"
+            "    AOT_AT(%d);\n"
+            "    vm->stackTop = sp;\n"
+            "    if ((status = setIndex()) != INTERPRET_OK)\n"
+            "      return status;\n"
+            "    sp = vm->stackTop;\n"
+            "  }\n",
+            next);
+    break;
+
+  case OP_CLOSURE:
+    fprintf(out,
+            "  AOT_AT(%d);\n"
+            "  vm->stackTop = sp;\n"
+            "  pushClosure(frame, AS_FUNCTION(constants[%d]));\n"
+            "  sp = vm->stackTop;\n",
+            next, code[1]);
+    break;
+
+  case OP_GET_UPVALUE:
+    fprintf(out, "  *sp++ = AOT_UPVALUES[%d];\n", code[1]);
+    break;
+  case OP_GET_BOXED:
+    fprintf(out, "  *sp++ = *AS_UPVALUE(AOT_UPVALUES[%d])->location;\n",
+            code[1]);
+    break;
+  case OP_SET_BOXED:
+    fprintf(out, "  *AS_UPVALUE(AOT_UPVALUES[%d])->location = sp[-1];\n",
+            code[1]);
+    break;
+
+  case OP_CLOSE_UPVALUES:
+    fprintf(out, "  closeUpvalues(slots + %d);\n", code[1]);
+    break;
+
+  case OP_CLASS:
+  case OP_METHOD:
+    fprintf(out,
+            "  AOT_AT(%d);\n"
+            "  vm->stackTop = sp;\n"
+            "  %s(AS_STRING(constants[%d]));\n"
+            "  sp = vm->stackTop;\n",
+            next, instruction == OP_CLASS ? "pushClass" : "defineMethod",
+            code[1]);
+    break;
+
+  case OP_INHERIT:
+  case OP_GET_SUPER:
+    fprintf(out,
+            "  AOT_AT(%d);\n"
+            "  vm->stackTop = sp;\n",
+            next);
+    if (instruction == OP_INHERIT) {
+      fprintf(out, "  if ((status = inherit()) != INTERPRET_OK)\n");
+    } else {
+      fprintf(out,
+              "  if ((status = getSuper(AS_STRING(constants[%d]))) != "
+              "INTERPRET_OK)\n",
+              code[1]);
+    }
+    fprintf(out, "    return status;\n"
+                 "  sp = vm->stackTop;\n");
+    break;
+
+  case OP_INVOKE:
+  case OP_SUPER_INVOKE:
+    fprintf(out,
+            "  {\n"
+            "    static PropertyCache cache;\n"
+            "    AOT_AT(%d);\n"
+            "    vm->stackTop = sp;\n"
+            "    if ((status = %s(AS_STRING(constants[%d]), %d, &cache)) !=\n"
+            "        INTERPRET_OK)\n"
+            "      return status;\n"
+            "    sp = vm->stackTop;\n"
+            "  }\n",
+            next, instruction == OP_INVOKE ? "runInvoke" : "runSuperInvoke",
+            code[1], code[2]);
+    break;
+
+  case OP_GET_PROPERTY:
+    // like the globals, each site's cache can be static
+    fprintf(out,
+            "  {\n"
+            "    static PropertyCache cache;\n"
+            "    ObjInstance *instance =\n"
+            "        IS_INSTANCE(sp[-1]) ? AS_INSTANCE(sp[-1]) : NULL;\n"
+            "    if (instance != NULL && cache.entries[0].shape == "
+            "instance->shape &&\n"
+            "        cache.entries[0].slot >= 0) {\n"
+            "      sp[-1] = instance->fields[cache.entries[0].slot];\n"
+            "    } else {\n"
+            "      AOT_AT(%d);\n"
+            "      vm->stackTop = sp;\n"
+            "      if ((status = getProperty(AS_STRING(constants[%d]), "
+            "&cache)) !=\n"
+            "          INTERPRET_OK)\n"
+            "        return status;\n"
+            "      sp = vm->stackTop;\n"
+            "    }\n"
+            "  }\n",
+            next, code[1]);
+    break;
+
+  case OP_SET_PROPERTY:
+    fprintf(out,
+            "  {\n"
+            "    static PropertyCache cache;\n"
+            "    ObjInstance *instance =\n"
+            "        IS_INSTANCE(sp[-2]) ? AS_INSTANCE(sp[-2]) : NULL;\n"
+            "    if (instance != NULL && cache.entries[0].shape == "
+            "instance->shape &&\n"
+            "        cache.entries[0].after->count <= instance->capacity) {\n"
+            "      instance->shape = cache.entries[0].after;\n"
+            "      instance->fields[cache.entries[0].slot] = sp[-1];\n"
+            "      sp[-2] = sp[-1];\n"
+            "      sp--;\n"
+            "    } else {\n"
+            "      AOT_AT(%d);\n"
+            "      vm->stackTop = sp;\n"
+            "      if ((status = setProperty(AS_STRING(constants[%d]), "
+            "&cache)) !=\n"
+            "          INTERPRET_OK)\n"
+            "        return status;\n"
+            "      sp = vm->stackTop;\n"
+            "    }\n"
+            "  }\n",
+            next, code[1]);
+    break;
+
+  case OP_RETURN_CLOSING:
+    fprintf(out, "  closeUpvalues(slots);\n");
+    // fall through
+  case OP_RETURN:
+    fprintf(out, "  slots[0] = sp[-1];\n"
+                 "  vm->stackTop = slots + 1;\n"
+                 "  vm->frameCount--;\n"
+                 "  return INTERPRET_OK;\n");
+    break;
+
+  default:
+    fprintf(out, "  return INTERPRET_RUNTIME_ERROR;\n");
+    break;
+  }
+}
+
+static void writeFunction(FILE *out, FunctionList *list, int index) {
+  ObjFunction *function = list->functions[index];
+  Chunk *chunk = &function->chunk;
+
+  // only jump targets get a label, anything else would go unused
+  bool *targets = calloc(chunk->count + 1, sizeof(bool));
+  for (int offset = 0; offset < chunk->count;) {
+    uint8_t *code = chunk->code + offset;
+    int next = offset + instructionLength(code[0]);
+    if (code[0] == OP_LOOP) {
+      targets[next - (code[1] << 8 | code[2])] = true;
+    } else if (code[0] == OP_JUMP || code[0] == OP_JUMP_IF_FALSE ||
+               code[0] == OP_MEMO_LOOKUP) {
+      targets[next + (code[1] << 8 | code[2])] = true;
+    } else if (code[0] == OP_GUARD_CALLEE) {
+      targets[next + (code[3] << 8 | code[4])] = true;
+    }
+    offset = next;
+  }
+
+  fprintf(out, "// %s\n",
+          function->name != NULL ? function->name->chars : "<script>");
+  fprintf(out,
+          "static int body%d(CallFrame *frame) {\n"
+          "  Value *slots = frame->slots;\n"
+          "  Value *constants = frame->function->chunk.constants.values;\n"
+          "  Value *sp = vm->stackTop;\n"
+          "  InterpretResult status;\n"
+          "  (void)constants;\n"
+          "  (void)status;\n",
+          index);
+
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    if (targets[offset])
+      fprintf(out, "at%d:\n", offset);
+    writeInstruction(out, chunk, offset);
+  }
+  fprintf(out, "}\n\n");
+  free(targets);
+}
+
+void translateToC(ObjFunction *script, const char *path, FILE *out) {
+  FunctionList list = {NULL, 0, 0};
+  collectFunctions(&list, script);
+
+  fprintf(out,
+          "// Translated from %s, build it with\n"
+          "//   gcc -O2 -I<lox>/include <this file> <lox>/bin/liblox.a "
+          "-pthread\n\n"
+          "#include <math.h>\n\n"
+          "#include \"aot.h\"\n\n",
+          path);
+
+  for (int i = 0; i < list.count; i++)
+    fprintf(out, "static int body%d(CallFrame *frame);\n", i);
+  fprintf(out, "\n");
+
+  for (int i = 0; i < list.count; i++)
+    writeData(out, &list, i);
+  for (int i = 0; i < list.count; i++)
+    writeFunction(out, &list, i);
+
+  fprintf(out, "static const AotFunction functions[] = {\n");
+  for (int i = 0; i < list.count; i++) {
+    ObjFunction *function = list.functions[i];
+    fprintf(out, "    {");
+    if (function->name != NULL) {
+      writeString(out, function->name->chars, function->name->length);
+    } else {
+      fprintf(out, "NULL");
+    }
+    fprintf(out,
+            ", %d, code%d, lines%d, %d, constants%d, %d, body%d, upvalues%d, "
+            "%d, %d},\n",
+            function->arity, i, i, function->chunk.count, i,
+            function->chunk.constants.count, i, i, function->upvalueCount,
+            function->memo != NULL ? function->memo->limit : 0);
+  }
+  fprintf(out, "};\n\n"
+               "int main() {\n"
+               "  return aotMain(functions, %d);\n"
+               "}\n",
+          list.count);
+
+  free(list.functions);
+}
+
+int aotMain(const AotFunction *functions, int count) {
+  static VM machine;
+  initVM(&machine);
+
+  // create all the functions before filling in constants that refer to them
+  ObjFunction **objects = malloc(sizeof(ObjFunction *) * count);
+  for (int i = 0; i < count; i++) {
+    const AotFunction *source = &functions[i];
+    ObjFunction *function = newFunction();
+    function->arity = source->arity;
+    if (source->name != NULL)
+      function->name = copyString(source->name, (int)strlen(source->name));
+    for (int j = 0; j < source->count; j++)
+      writeChunk(&function->chunk, source->code[j], source->lines[j]);
+    function->aot = source->body;
+    if (source->upvalueCount > 0) {
+      function->upvalueCount = source->upvalueCount;
+      function->upvalues = ALLOCATE(Upvalue, source->upvalueCount);
+      memcpy(function->upvalues, source->upvalues,
+             sizeof(Upvalue) * source->upvalueCount);
+    }
+    if (source->memoLimit > 0)
+      function->memo = newMemo(source->memoLimit);
+    objects[i] = function;
+  }
+
+  for (int i = 0; i < count; i++) {
+    const AotFunction *source = &functions[i];
+    for (int j = 0; j < source->constantCount; j++) {
+      const AotConstant *constant = &source->constants[j];
+      Value value = NIL_VAL;
+      switch (constant->type) {
+      case AOT_NUMBER:
+        value = NUMBER_VAL(constant->number);
+        break;
+      case AOT_INTEGER:
+        value = INT_VAL((int64_t)constant->number);
+        break;
+      case AOT_STRING:
+        value = OBJ_VAL(copyString(constant->chars, constant->length));
+        break;
+      case AOT_FUNCTION:
+        value = OBJ_VAL(objects[constant->function]);
+        break;
+      }
+      addConstant(&objects[i]->chunk, value);
+    }
+  }
+
+  InterpretResult result = runFunction(objects[0]);
+  free(objects);
+  freeVM(&machine);
+
+  if (result == INTERPRET_RUNTIME_ERROR)
+    return 70;
+  if (result == INTERPRET_INTERRUPTED)
+    return 75;
+  return 0;
+}
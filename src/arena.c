@@ -0,0 +1,109 @@
+/*
+ * Arena allocation. Memory is handed out by bumping a pointer through large
+ * blocks and is only released in bulk, either all at once or back to a mark,
+ * so there is no per allocation bookkeeping and nothing is left scattered
+ * around the heap afterwards.
+ */
+
+#include <string.h>
+
+#include "../include/arena.h"
+#include "../include/memory.h"
+
+// keep every allocation aligned well enough for doubles and pointers
+#define ARENA_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+void initArena(Arena *arena) {
+  arena->head = NULL;
+  arena->spare = NULL;
+}
+
+static void freeBlocks(ArenaBlock *block) {
+  while (block != NULL) {
+    ArenaBlock *next = block->next;
+    reallocate(block, sizeof(ArenaBlock) + block->capacity, 0);
+    block = next;
+  }
+}
+
+void freeArena(Arena *arena) {
+  freeBlocks(arena->head);
+  freeBlocks(arena->spare);
+  initArena(arena);
+}
+
+// find room for a new block, preferring one that was released earlier
+static ArenaBlock *newBlock(Arena *arena, size_t size) {
+  ArenaBlock **link = &arena->spare;
+  while (*link != NULL) {
+    if ((*link)->capacity >= size) {
+      ArenaBlock *block = *link;
+      *link = block->next;
+      return block;
+    }
+    link = &(*link)->next;
+  }
+
+  // oversized requests get a block of their own
+  size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+  ArenaBlock *block =
+      (ArenaBlock *)reallocate(NULL, 0, sizeof(ArenaBlock) + capacity);
+  block->capacity = capacity;
+  return block;
+}
+
+void *arenaAllocate(Arena *arena, size_t size) {
+  size = ARENA_ALIGN(size);
+
+  if (arena->head == NULL || arena->head->used + size > arena->head->capacity) {
+    ArenaBlock *block = newBlock(arena, size);
+    block->used = 0;
+    block->next = arena->head;
+    arena->head = block;
+  }
+
+  void *result = arena->head->data + arena->head->used;
+  arena->head->used += size;
+  return result;
+}
+
+// Growing the most recent allocation happens in place, anything else gets
+// copied into fresh space. The old space is simply abandoned until the arena
+// is released.
+void *arenaGrow(Arena *arena, void *pointer, size_t oldSize, size_t newSize) {
+  ArenaBlock *block = arena->head;
+  if (pointer != NULL && block != NULL &&
+      (uint8_t *)pointer + ARENA_ALIGN(oldSize) == block->data + block->used &&
+      (uint8_t *)pointer - block->data + ARENA_ALIGN(newSize) <=
+          block->capacity) {
+    block->used = (uint8_t *)pointer - block->data + ARENA_ALIGN(newSize);
+    return pointer;
+  }
+
+  void *result = arenaAllocate(arena, newSize);
+  if (pointer != NULL) {
+    memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+  }
+  return result;
+}
+
+ArenaMark arenaMark(Arena *arena) {
+  ArenaMark mark;
+  mark.block = arena->head;
+  mark.used = arena->head != NULL ? arena->head->used : 0;
+  return mark;
+}
+
+// Throw away everything allocated since the mark was taken. The blocks are
+// kept as spares, so whatever comes next reuses memory that is already warm.
+void arenaRelease(Arena *arena, ArenaMark mark) {
+  while (arena->head != mark.block) {
+    ArenaBlock *block = arena->head;
+    arena->head = block->next;
+    block->next = arena->spare;
+    arena->spare = block;
+  }
+  if (arena->head != NULL) {
+    arena->head->used = mark.used;
+  }
+}
@@ -4,6 +4,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include "../include/chunk.h"
 #include "../include/memory.h"
@@ -17,6 +18,38 @@ void initChunk(Chunk* chunk) {
 	chunk->code = NULL;
 	initValueArray(&chunk->constants);
 	chunk->lines = NULL;
+	chunk->arena = NULL;
+}
+
+// Have the chunk grow inside an arena, starting with room for capacity bytes
+// so that most chunks never need to grow at all.
+void presizeChunk(Chunk* chunk, Arena* arena, int capacity) {
+	chunk->arena = arena;
+	chunk->constants.arena = arena;
+	chunk->code = GROW_ARRAY_IN(arena, uint8_t, chunk->code, chunk->capacity,
+			capacity);
+	chunk->lines = GROW_ARRAY_IN(arena, int, chunk->lines, chunk->capacity,
+			capacity);
+	chunk->capacity = capacity;
+}
+
+// Copy a finished chunk out of the arena into heap buffers that are exactly
+// as large as they need to be.
+void compactChunk(Chunk* chunk) {
+	if (chunk->arena == NULL) return;
+
+	reserveHeap((sizeof(uint8_t) + sizeof(int)) * chunk->count);
+	uint8_t* code = ALLOCATE(uint8_t, chunk->count);
+	int* lines = ALLOCATE(int, chunk->count);
+	if (chunk->count > 0) {
+		memcpy(code, chunk->code, chunk->count);
+		memcpy(lines, chunk->lines, sizeof(int) * chunk->count);
+	}
+	chunk->code = code;
+	chunk->lines = lines;
+	chunk->capacity = chunk->count;
+	chunk->arena = NULL;
+	compactValueArray(&chunk->constants);
 }
 
 // write a byte to our chunk
@@ -25,11 +58,16 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
 	// not enough room for the new byte, must allocate a new array
 	if (chunk->capacity < chunk->count + 1) {
 		int oldCapacity = chunk->capacity;
-		chunk->capacity = GROW_CAPACITY(oldCapacity);
-		chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity,
-				chunk->capacity);
-		chunk->lines = GROW_ARRAY(int, chunk->lines,
-			oldCapacity, chunk->capacity);
+		int capacity = GROW_CAPACITY(oldCapacity);
+		// an arena is thrown away whole if it runs out
+		if (chunk->arena == NULL)
+			reserveHeap((sizeof(uint8_t) + sizeof(int)) *
+					(capacity - oldCapacity));
+		chunk->code = GROW_ARRAY_IN(chunk->arena, uint8_t, chunk->code,
+				oldCapacity, capacity);
+		chunk->lines = GROW_ARRAY_IN(chunk->arena, int, chunk->lines,
+			oldCapacity, capacity);
+		chunk->capacity = capacity;
 	}
 
 
@@ -44,12 +82,128 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
 
 // free our chunk
 void freeChunk(Chunk* chunk) {
-	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+	// arena memory is released along with the arena
+	if (chunk->arena == NULL) {
+		FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+		FREE_ARRAY(int, chunk->lines, chunk->capacity);
+	}
 	freeValueArray(&chunk->constants);
-	FREE_ARRAY(int, chunk->lines, chunk->capacity);
 	initChunk(chunk);
 }
 
+// what a quickened instruction was before it got specialized
+uint8_t genericInstruction(uint8_t instruction) {
+	switch (instruction) {
+		case OP_ADD_NUM: return OP_ADD;
+		case OP_SUBTRACT_NUM: return OP_SUBTRACT;
+		case OP_MULTIPLY_NUM: return OP_MULTIPLY;
+		case OP_DIVIDE_NUM: return OP_DIVIDE;
+		case OP_GREATER_NUM: return OP_GREATER;
+		case OP_LESS_NUM: return OP_LESS;
+		case OP_NEGATE_UNCHECKED: return OP_NEGATE;
+		case OP_ADD_UNCHECKED: return OP_ADD;
+		case OP_SUBTRACT_UNCHECKED: return OP_SUBTRACT;
+		case OP_MULTIPLY_UNCHECKED: return OP_MULTIPLY;
+		case OP_DIVIDE_UNCHECKED: return OP_DIVIDE;
+		case OP_GREATER_UNCHECKED: return OP_GREATER;
+		case OP_LESS_UNCHECKED: return OP_LESS;
+		default: return instruction;
+	}
+}
+
+// whether the compiler already proved the operands are numbers
+bool isUnchecked(uint8_t instruction) {
+	return instruction >= OP_NEGATE_UNCHECKED &&
+	       instruction <= OP_LESS_UNCHECKED;
+}
+
+// how many bytes the instruction takes up, operands included
+int instructionLength(uint8_t instruction) {
+	switch (genericInstruction(instruction)) {
+		case OP_CONSTANT:
+		case OP_GET_LOCAL:
+		case OP_SET_LOCAL:
+		case OP_GET_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_DEFINE_GLOBAL:
+		case OP_BUILD_LIST:
+		case OP_CLOSURE:
+		case OP_GET_UPVALUE:
+		case OP_GET_BOXED:
+		case OP_SET_BOXED:
+		case OP_CLOSE_UPVALUES:
+		case OP_CLASS:
+		case OP_METHOD:
+		case OP_GET_SUPER:
+			return 2;
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_LOOP:
+		case OP_MEMO_LOOKUP:
+			return 3;
+		case OP_CALL:
+		case OP_GET_PROPERTY:
+		case OP_SET_PROPERTY:
+			return 4;
+		case OP_INVOKE:
+		case OP_SUPER_INVOKE:
+		case OP_GUARD_CALLEE:
+			return 5;
+		default:
+			return 1;
+	}
+}
+
+// how many values the instruction leaves on the stack, less how many it takes
+int stackEffect(const uint8_t* code) {
+	switch (genericInstruction(code[0])) {
+		case OP_CONSTANT:
+		case OP_NIL:
+		case OP_TRUE:
+		case OP_FALSE:
+		case OP_GET_GLOBAL:
+		case OP_GET_LOCAL:
+		case OP_CLOSURE:
+		case OP_GET_UPVALUE:
+		case OP_GET_BOXED:
+		case OP_CLASS:
+			return 1;
+		case OP_ADD:
+		case OP_SUBTRACT:
+		case OP_MULTIPLY:
+		case OP_DIVIDE:
+		case OP_EQUAL:
+		case OP_GREATER:
+		case OP_NOT_EQUAL:
+		case OP_GREATER_EQUAL:
+		case OP_LESS_EQUAL:
+		case OP_LESS:
+		case OP_PRINT:
+		case OP_POP:
+		case OP_DEFINE_GLOBAL:
+		case OP_GET_INDEX:
+		case OP_METHOD:
+		case OP_INHERIT:
+		case OP_SET_PROPERTY:
+		case OP_GET_SUPER:
+		case OP_RETURN:
+		case OP_RETURN_CLOSING:
+			return -1;
+		case OP_SET_INDEX:
+			return -2;
+		case OP_CALL:
+			return -code[1];
+		case OP_BUILD_LIST:
+			return 1 - code[1];
+		case OP_INVOKE:
+			return -code[2];
+		case OP_SUPER_INVOKE:
+			return -code[2] - 1; // the superclass goes too
+		default:
+			return 0;
+	}
+}
+
 // add a constant to our value array
 int addConstant(Chunk* chunk, Value value) {
 	writeValueArray(&chunk->constants, value);
@@ -5,6 +5,7 @@
 #include "../include/common.h"
 #include "../include/compiler.h"
 #include "../include/debug.h"
+#include "../include/memo.h"
 #include "../include/scanner.h"
 
 // Our Parser emits the correct token types for our source code.
@@ -16,6 +17,7 @@ typedef struct {
   Token previous;
   bool hadError;
   bool panicMode;
+  bool number; // the expression just compiled is known to produce a number
 } Parser;
 
 // since enum options are assigned inccrementing values, we have our full
@@ -50,20 +52,44 @@ typedef struct {
 typedef struct {
   Token name;
   int depth; // 0 = global , 1 = 1 level down, 2 = 2 levels down...
+  bool number; // only ever assigned numbers, so far as we have seen
+  bool captured; // used by a function nested inside this one
+  bool boxed;    // captured, and assigned somewhere, so shared by reference
 } Local;
 
-typedef enum { TYPE_FUNCTION, TYPE_SCRIPT } FunctionType;
+typedef enum {
+  TYPE_FUNCTION,
+  TYPE_INITIALIZER,
+  TYPE_METHOD,
+  TYPE_SCRIPT
+} FunctionType;
 
 typedef struct {
   struct Compiler *enclosing; // linked list for enclosing functions
   ObjFunction *function;
   FunctionType type;
+  ArenaMark scratch; // arena position from before this function's buffers
 
   Local locals[UINT8_COUNT];
   int localCount;
+  Upvalue upvalues[UINT8_COUNT]; // function->upvalueCount of them
   int scopeDepth;
+  bool typesWrong; // a local we took for a number turned out not to be one
+  bool boxes;      // some of the locals are boxed, returns have to close them
+
+  // where the statement being compiled starts, and how deep the stack is
+  // there, for working out where a callee sits, see calleeSlot()
+  int statementStart;
+  int statementDepth;
+  int globalRead; // offset of the last OP_GET_GLOBAL, or -1
 } Compiler;
 
+// the class whose methods are being compiled, if any, and the ones around it
+typedef struct ClassCompiler {
+  struct ClassCompiler *enclosing;
+  bool hasSuperclass;
+} ClassCompiler;
+
 // some definitions that use recursion
 static void expression();
 static ParseRule *getRule(TokenType type);
@@ -74,9 +100,36 @@ static void advance();
 
 // Global Declarations that we'll use. We could make these local, but we would
 // have to pass them around every time.
-Parser parser;
-Compiler *current = NULL;
-Chunk *compilingChunk;
+// They are per thread so that separate threads can compile at the same time.
+_Thread_local Parser parser;
+_Thread_local Compiler *current = NULL;
+_Thread_local ClassCompiler *currentClass = NULL;
+_Thread_local Chunk *compilingChunk;
+
+// Chunks grow inside this arena while they are being compiled, and are copied
+// out into tight heap buffers once each function is done. Functions are
+// compiled in a nested fashion, so a finished function's scratch space is
+// released straight away and reused by the next one.
+_Thread_local Arena compileArena;
+_Thread_local int scriptEstimate; // expected size of the script's bytecode
+
+// the source being compiled, and the VM's copy of it once a function body is
+// left for later
+_Thread_local const char *compilingSource;
+_Thread_local const char *sourceCopy;
+
+// the top level functions compiled so far, by name, for inlineCall()
+_Thread_local Table knownFunctions;
+
+// the cache size asked for by a @memo in front of the function about to be
+// compiled, 0 for none
+_Thread_local int memoLimit;
+
+// starting size for function chunks, most small functions fit without growing
+#define FUNCTION_CHUNK_ESTIMATE 256
+// most of a large source tends to be function bodies rather than top level
+// code, so don't reserve more than a block's worth up front
+#define MAX_SCRIPT_ESTIMATE (ARENA_BLOCK_SIZE / 8)
 
 // Once user functions are defined, currentChunk may be a function chunk. We
 // use current chunk to abstract away the details so the rest of the code
@@ -92,6 +145,7 @@ static void synchronize() {
     switch (parser.current.type) {
     case TOKEN_CLASS:
     case TOKEN_FUN:
+    case TOKEN_AT:
     case TOKEN_VAR:
     case TOKEN_FOR:
     case TOKEN_IF:
@@ -112,19 +166,19 @@ static void errorAt(Token *token, const char *message) {
   if (parser.panicMode)
     synchronize();
   parser.panicMode = true;
-  fprintf(stderr, "[line %d] Error", token->line);
+  reportError("[line %d] Error", token->line);
 
   // go to the end when we shouldn't have
   if (token->type == TOKEN_EOF) {
-    fprintf(stderr, " at end");
+    reportError(" at end");
   } else if (token->type == TOKEN_ERROR) {
     // Nothing.
   } else {
-    fprintf(stderr, " at '%.*s'", token->length, token->start);
+    reportError(" at '%.*s'", token->length, token->start);
   }
 
   // print our helpful message
-  fprintf(stderr, ": %s\n", message);
+  reportError(": %s\n", message);
   parser.hadError = true;
 }
 
@@ -174,6 +228,12 @@ static void emitByte(uint8_t byte) {
   writeChunk(currentChunk(), byte, parser.previous.line);
 }
 
+// many tokens will require us to push 2 values on our chunk stack.
+static void emitBytes(uint8_t byte1, uint8_t byte2) {
+  emitByte(byte1);
+  emitByte(byte2);
+}
+
 static void emitLoop(int loopStart) {
   emitByte(OP_LOOP);
 
@@ -185,8 +245,15 @@ static void emitLoop(int loopStart) {
   emitByte(offset & 0xff);
 }
 
+// an initializer always gives back the instance, which sits in slot 0
 static void emitReturn() {
-  emitByte(OP_NIL);
+  if (current->type == TYPE_INITIALIZER) {
+    emitBytes(OP_GET_LOCAL, 0);
+  } else {
+    emitByte(OP_NIL);
+  }
+  if (current->function->memo != NULL)
+    emitByte(OP_MEMO_STORE);
   emitByte(OP_RETURN);
 }
 
@@ -195,6 +262,32 @@ static ObjFunction *endCompiler() {
   emitReturn();
   ObjFunction *function = current->function;
 
+  // only known now, a return may run after a closure made further down
+  if (current->boxes) {
+    Chunk *chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk->code[offset])) {
+      if (chunk->code[offset] == OP_RETURN)
+        chunk->code[offset] = OP_RETURN_CLOSING;
+    }
+  }
+  if (function->upvalueCount > 0) {
+    function->upvalues = ALLOCATE(Upvalue, function->upvalueCount);
+    memcpy(function->upvalues, current->upvalues,
+           sizeof(Upvalue) * function->upvalueCount);
+  }
+  if (function->cacheCount > 0) {
+    function->caches = ALLOCATE(PropertyCache, function->cacheCount);
+    memset(function->caches, 0, sizeof(PropertyCache) * function->cacheCount);
+  }
+  if (function->callCacheCount > 0) {
+    function->callCaches = ALLOCATE(CallCache, function->callCacheCount);
+    memset(function->callCaches, 0,
+           sizeof(CallCache) * function->callCacheCount);
+  }
+  compactChunk(&function->chunk);
+  arenaRelease(&compileArena, current->scratch);
+
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
     disassembleChunk(currentChunk(), function->name != NULL
@@ -213,21 +306,38 @@ static void endScope() {
 
   current->scopeDepth--;
 
-  while (current->localCount > 0 &&
-         current->locals[current->localCount - 1].depth > current->scopeDepth) {
+  int count = current->localCount;
+  while (count > 0 && current->locals[count - 1].depth > current->scopeDepth)
+    count--;
+
+  // one instruction closes every boxed variable going out of scope
+  for (int i = count; i < current->localCount; i++) {
+    if (current->locals[i].boxed) {
+      emitBytes(OP_CLOSE_UPVALUES, (uint8_t)i);
+      break;
+    }
+  }
+
+  while (current->localCount > count) {
     emitByte(OP_POP);
     current->localCount--; // most recent locals are always stored at the end of
                            // the array
   }
 }
-// many tokens will require us to push 2 values on our chunk stack.
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-  emitByte(byte1);
-  emitByte(byte2);
-}
 
-// Add a constant to the value array in the current chunk
+// Add a constant to the value array in the current chunk. Numbers and strings
+// that are already there get reused, identifiers in particular show up over
+// and over again.
 static uint8_t makeConstant(Value value) {
+  if (!IS_OBJ(value) || IS_STRING(value)) {
+    ValueArray *constants = &currentChunk()->constants;
+    for (int i = 0; i < constants->count; i++) {
+      if (constants->values[i].type == value.type &&
+          valuesEqual(constants->values[i], value))
+        return (uint8_t)i;
+    }
+  }
+
   int constant = addConstant(currentChunk(), value);
   if (constant > UINT8_MAX) {
     error("Too many constants in one chunk.");
@@ -242,26 +352,51 @@ static void emitConstant(Value value) {
   emitBytes(OP_CONSTANT, makeConstant(value));
 }
 
-static void initCompiler(Compiler *compiler, FunctionType type) {
+// a statement starts here, with nothing on the stack above the locals
+static void markStatement() {
+  current->statementStart = currentChunk()->count;
+  current->statementDepth = current->localCount;
+}
+
+// function is NULL for a new one, or one whose body was left for later
+static void initCompiler(Compiler *compiler, FunctionType type,
+                         ObjFunction *function) {
   compiler->enclosing = current;
   compiler->function = NULL;
   compiler->type = type;
 
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
-
-  compiler->function = newFunction();
+  compiler->typesWrong = false;
+  compiler->boxes = false;
+  compiler->statementStart = 0;
+  compiler->statementDepth = 1;
+  compiler->globalRead = -1;
+
+  compiler->function = function != NULL ? function : newFunction();
+  compiler->scratch = arenaMark(&compileArena);
+  presizeChunk(&compiler->function->chunk, &compileArena,
+               type == TYPE_SCRIPT ? scriptEstimate : FUNCTION_CHUNK_ESTIMATE);
   current = compiler;
 
-  if (type != TYPE_SCRIPT) {
+  if (type != TYPE_SCRIPT && function == NULL) {
     current->function->name =
         copyString(parser.previous.start, parser.previous.length);
   }
 
   Local *local = &current->locals[current->localCount++];
   local->depth = 0;
-  local->name.start = "";
-  local->name.length = 0;
+  local->number = false;
+  local->captured = false;
+  local->boxed = false;
+  // methods find their receiver in slot 0, under the name this
+  if (type == TYPE_METHOD || type == TYPE_INITIALIZER) {
+    local->name.start = "this";
+    local->name.length = 4;
+  } else {
+    local->name.start = "";
+    local->name.length = 0;
+  }
 }
 
 // Parse tokens until we find a token with a lower precedence. Use the correct
@@ -270,6 +405,7 @@ static void parsePrecedence(Precedence precedence) {
   advance();
   ParseFn prefixRule = getRule(parser.previous.type)->prefix;
   if (prefixRule == NULL) {
+    parser.number = false;
     error("Expect expression.");
     return;
   }
@@ -311,6 +447,9 @@ static void addLocal(Token name) {
   local->name = name;
   local->depth = -1;
   local->depth = current->scopeDepth;
+  local->number = false;
+  local->captured = false;
+  local->boxed = false;
 }
 
 static void declareVariable() {
@@ -395,6 +534,7 @@ static void and_(bool canAssign) {
   parsePrecedence(PREC_AND);
 
   patchJump(endJump);
+  parser.number = false; // could be the left operand
 }
 
 // parse a single expression
@@ -408,11 +548,7 @@ static void block() {
   consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type) {
-  Compiler compiler;
-  initCompiler(&compiler, type);
-  beginScope();
-
+static void parameters() {
   consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
 
   if (!check(TOKEN_RIGHT_PAREN)) {
@@ -428,19 +564,203 @@ static void function(FunctionType type) {
 
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
   consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+}
+
+static Token syntheticToken(const char *text) {
+  Token token;
+  token.type = TOKEN_IDENTIFIER;
+  token.start = text;
+  token.length = (int)strlen(text);
+  token.line = parser.previous.line;
+  return token;
+}
+
+// A @memo function looks its arguments up first thing, and returns the
+// result straight away on a hit. Otherwise copies of the arguments stay
+// behind as hidden locals, so the result is stored under the arguments of
+// the call even if the body assigns to its parameters.
+static void memoPrologue() {
+  if (current->function->memo == NULL)
+    return;
+  for (int i = 1; i <= current->function->arity; i++) {
+    emitBytes(OP_GET_LOCAL, (uint8_t)i);
+    addLocal(syntheticToken(""));
+  }
+  int miss = emitJump(OP_MEMO_LOOKUP);
+  emitByte(OP_RETURN);
+  patchJump(miss);
+}
+
+// Step over a body by its braces, the scanner still catches bad tokens.
+static void skipBody() {
+  int depth = 1;
+  while (depth > 0 && !check(TOKEN_EOF)) {
+    if (check(TOKEN_LEFT_BRACE))
+      depth++;
+    else if (check(TOKEN_RIGHT_BRACE))
+      depth--;
+    advance();
+  }
+  if (depth > 0)
+    errorAtCurrent("Expect '}' after block.");
+}
+
+// Only top level functions are left for later. They see nothing but globals,
+// so their bodies compile the same whenever that happens.
+static bool compileLater() {
+  return vm->lazyCompile && current->type == TYPE_FUNCTION &&
+         current->enclosing != NULL &&
+         ((Compiler *)current->enclosing)->type == TYPE_SCRIPT &&
+         ((Compiler *)current->enclosing)->scopeDepth == 0;
+}
+
+static ObjFunction *function(FunctionType type) {
+  Compiler compiler;
+  initCompiler(&compiler, type, NULL);
+  beginScope();
+  if (memoLimit > 0) {
+    current->function->memo = newMemo(memoLimit);
+    memoLimit = 0;
+  }
+
+  if (compileLater()) {
+    // the parameters are parsed now for the arity, and to catch errors early
+    if (sourceCopy == NULL) {
+      size_t length = strlen(compilingSource);
+      SourceCopy *copy =
+          (SourceCopy *)reallocate(NULL, 0, sizeof(SourceCopy) + length + 1);
+      copy->length = length;
+      memcpy(copy->chars, compilingSource, length + 1);
+      copy->next = vm->sources;
+      vm->sources = copy;
+      sourceCopy = copy->chars;
+    }
+    ObjFunction *function = current->function;
+    function->lazySource =
+        sourceCopy + (parser.current.start - compilingSource);
+    function->lazyEnd = sourceCopy + (saveScanner().end - compilingSource);
+    function->lazyLine = parser.current.line;
+    parameters();
+    skipBody();
+
+    // nothing went into the chunk, drop the space it was given
+    initChunk(&function->chunk);
+    arenaRelease(&compileArena, current->scratch);
+    current = (Compiler *)current->enclosing;
+    emitBytes(OP_CONSTANT, makeConstant(OBJ_VAL(function)));
+    return function;
+  }
+
+  Token name = parser.previous;
+  parameters();
+  memoPrologue();
   block();
 
+  // the cache belongs to the function, which every closure of it shares
+  if (current->function->memo != NULL && current->function->upvalueCount > 0)
+    errorAt(&name, "Can't memoize a function that captures variables.");
+
+  // a function that captures nothing is just a constant, no closure needed
   ObjFunction *function = endCompiler();
-  emitBytes(OP_CONSTANT, makeConstant(OBJ_VAL(function)));
+  emitBytes(function->upvalueCount > 0 ? OP_CLOSURE : OP_CONSTANT,
+            makeConstant(OBJ_VAL(function)));
+  return function;
+}
+
+static void method() {
+  consume(TOKEN_IDENTIFIER, "Expect method name.");
+  uint8_t constant = identifierConstant(&parser.previous);
+  FunctionType type = TYPE_METHOD;
+  if (parser.previous.length == 4 &&
+      memcmp(parser.previous.start, "init", 4) == 0)
+    type = TYPE_INITIALIZER;
+  function(type);
+  emitBytes(OP_METHOD, constant);
+}
+
+static void namedVariable(Token name, bool canAssign);
+static void variable(bool canAssign);
+
+// The class goes into its variable first, so methods can refer to it. A
+// superclass is kept in a local named super, which methods capture.
+static void classDeclaration() {
+  consume(TOKEN_IDENTIFIER, "Expect class name.");
+  Token className = parser.previous;
+  uint8_t nameConstant = identifierConstant(&parser.previous);
+  declareVariable();
+
+  emitBytes(OP_CLASS, nameConstant);
+  defineVariable(nameConstant);
+
+  ClassCompiler classCompiler;
+  classCompiler.hasSuperclass = false;
+  classCompiler.enclosing = currentClass;
+  currentClass = &classCompiler;
+
+  if (match(TOKEN_LESS)) {
+    consume(TOKEN_IDENTIFIER, "Expect superclass name.");
+    variable(false);
+    if (identifiersEqual(&className, &parser.previous))
+      error("A class can't inherit from itself.");
+
+    beginScope();
+    addLocal(syntheticToken("super"));
+    defineVariable(0);
+
+    namedVariable(className, false);
+    emitByte(OP_INHERIT);
+    classCompiler.hasSuperclass = true;
+  }
+
+  namedVariable(className, false);
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+    method();
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+  emitByte(OP_POP);
+
+  if (classCompiler.hasSuperclass)
+    endScope();
+  currentClass = currentClass->enclosing;
 }
 
 static void funDeclaration() {
   uint8_t global = parseVariable("Expect function name.");
   markInitialized(); // we mark the function as initialized to enable recursion
-  function(TYPE_FUNCTION);
+  ObjFunction *declared = function(TYPE_FUNCTION);
+  if (current->type == TYPE_SCRIPT && current->scopeDepth == 0)
+    tableSet(&knownFunctions,
+             AS_STRING(currentChunk()->constants.values[global]),
+             OBJ_VAL(declared));
   defineVariable(global);
 }
 
+// @memo or @memo(limit) in front of a function declaration, see memo.h
+static void memoDeclaration() {
+  consume(TOKEN_IDENTIFIER, "Expect annotation name after '@'.");
+  if (parser.previous.length != 4 ||
+      memcmp(parser.previous.start, "memo", 4) != 0)
+    error("Unknown annotation.");
+
+  int limit = MEMO_DEFAULT_LIMIT;
+  if (match(TOKEN_LEFT_PAREN)) {
+    consume(TOKEN_NUMBER, "Expect cache size.");
+    double size = strtod(parser.previous.start, NULL);
+    if (size < 1 || size > MEMO_MAX_LIMIT || size != (int)size)
+      error("Cache size must be a whole number from 1 to 1048576.");
+    else
+      limit = (int)size;
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after cache size.");
+  }
+
+  if (!match(TOKEN_FUN)) {
+    errorAtCurrent("Expect 'fun' after annotation.");
+    return;
+  }
+  memoLimit = limit;
+  funDeclaration();
+}
+
 static void printStatement() {
   expression();
   consume(TOKEN_SEMICOLON, "Expect ';' after value.");
@@ -458,8 +778,12 @@ static void returnStatement() {
   if (match(TOKEN_SEMICOLON)) {
     emitReturn();
   } else {
+    if (current->type == TYPE_INITIALIZER)
+      error("Can't return a value from an initializer.");
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+    if (current->function->memo != NULL)
+      emitByte(OP_MEMO_STORE);
     emitByte(OP_RETURN);
   }
 }
@@ -482,7 +806,12 @@ static void whileStatement() {
 // convert the 'number' to a usable value for clox
 static void number(bool canAssign) {
   double value = strtod(parser.previous.start, NULL);
-  emitConstant(NUMBER_VAL(value));
+  // literals are never negative, the minus is a separate instruction
+  if (value < 9007199254740992.0 && value == (double)(int64_t)value)
+    emitConstant(INT_VAL((int64_t)value));
+  else
+    emitConstant(NUMBER_VAL(value));
+  parser.number = true;
 }
 
 static void or_(bool canAssign) {
@@ -494,6 +823,7 @@ static void or_(bool canAssign) {
 
   parsePrecedence(PREC_OR);
   patchJump(endJump);
+  parser.number = false;
 }
 
 // only a single operand
@@ -506,10 +836,11 @@ static void unary(bool canAssign) {
   // Emit the operator instruction.
   switch (operatorType) {
   case TOKEN_MINUS:
-    emitByte(OP_NEGATE);
+    emitByte(parser.number ? OP_NEGATE_UNCHECKED : OP_NEGATE);
     break;
   case TOKEN_BANG:
     emitByte(OP_NOT);
+    parser.number = false;
     break;
   default:
     return; // Unreachable.
@@ -528,26 +859,36 @@ static void grouping(bool canAssign) {
 static void binary(bool canAssign) {
   TokenType operatorType = parser.previous.type;
   ParseRule *rule = getRule(operatorType);
+  bool leftNumber = parser.number;
 
   // +1 since we are using left associativity, i.e
   // 1 + 2 + 3 = ((1 + 2) + 3) , so we need a precedence level 1 higher than
   // the current operation
   parsePrecedence((Precedence)(rule->precedence + 1));
 
+  // with numbers on both sides arithmetic gives a number again, and nothing
+  // needs checking at runtime
+  bool numbers = leftNumber && parser.number;
+  parser.number = false;
+
   // we can represent >= , != , and <= as negations of the remaining
   // operators
   switch (operatorType) {
   case TOKEN_PLUS:
-    emitByte(OP_ADD);
+    emitByte(numbers ? OP_ADD_UNCHECKED : OP_ADD);
+    parser.number = numbers;
     break;
   case TOKEN_MINUS:
-    emitByte(OP_SUBTRACT);
+    emitByte(numbers ? OP_SUBTRACT_UNCHECKED : OP_SUBTRACT);
+    parser.number = numbers;
     break;
   case TOKEN_STAR:
-    emitByte(OP_MULTIPLY);
+    emitByte(numbers ? OP_MULTIPLY_UNCHECKED : OP_MULTIPLY);
+    parser.number = numbers;
     break;
   case TOKEN_SLASH:
-    emitByte(OP_DIVIDE);
+    emitByte(numbers ? OP_DIVIDE_UNCHECKED : OP_DIVIDE);
+    parser.number = numbers;
     break;
   case TOKEN_BANG_EQUAL:
     emitBytes(OP_EQUAL, OP_NOT);
@@ -556,29 +897,340 @@ static void binary(bool canAssign) {
     emitByte(OP_EQUAL);
     break;
   case TOKEN_GREATER:
-    emitByte(OP_GREATER);
+    emitByte(numbers ? OP_GREATER_UNCHECKED : OP_GREATER);
     break;
   case TOKEN_GREATER_EQUAL:
-    emitBytes(OP_LESS, OP_NOT);
+    emitBytes(numbers ? OP_LESS_UNCHECKED : OP_LESS, OP_NOT);
     break;
   case TOKEN_LESS:
-    emitByte(OP_LESS);
+    emitByte(numbers ? OP_LESS_UNCHECKED : OP_LESS);
     break;
   case TOKEN_LESS_EQUAL:
-    emitBytes(OP_GREATER, OP_NOT);
+    emitBytes(numbers ? OP_GREATER_UNCHECKED : OP_GREATER, OP_NOT);
     break;
   default:
     return;
   }
 }
 
+// [a, b, c]
+static void list(bool canAssign) {
+  int itemCount = 0;
+  if (!check(TOKEN_RIGHT_BRACKET)) {
+    do {
+      if (check(TOKEN_RIGHT_BRACKET))
+        break; // a trailing comma
+      expression();
+      if (itemCount == 255)
+        error("Can't have more than 255 items in a list literal.");
+      itemCount++;
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list items.");
+  emitBytes(OP_BUILD_LIST, (uint8_t)itemCount);
+  parser.number = false;
+}
+
+// list[index], or list[index] = value
+static void subscript(bool canAssign) {
+  expression();
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expression();
+    emitByte(OP_SET_INDEX);
+  } else {
+    emitByte(OP_GET_INDEX);
+  }
+  parser.number = false;
+}
+
+// Property instructions end with the index of their own cache in the
+// function, which endCompiler() allocates once the count is known.
+static void emitCache() {
+  int cache = current->function->cacheCount++;
+  if (cache > UINT16_MAX)
+    error("Too many property accesses in one function.");
+  emitBytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
+static void emitProperty(uint8_t instruction, uint8_t name) {
+  emitBytes(instruction, name);
+  emitCache();
+}
+
+static void dot(bool canAssign) {
+  consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+  uint8_t name = identifierConstant(&parser.previous);
+
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expression();
+    emitProperty(OP_SET_PROPERTY, name);
+  } else if (match(TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList();
+    emitBytes(OP_INVOKE, name);
+    emitByte(argCount);
+    emitCache();
+  } else {
+    emitProperty(OP_GET_PROPERTY, name);
+  }
+  parser.number = false;
+}
+
+static void emitCall(uint8_t argCount) {
+  int cache = current->function->callCacheCount++;
+  if (cache > UINT16_MAX)
+    error("Too many calls in one function.");
+  emitBytes(OP_CALL, argCount);
+  emitBytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
+// Inlining. A call to a small top level function compiled earlier in the
+// script gets a copy of the function's body in place of the call, with the
+// function's slots moved up to where the callee and arguments already are on
+// the caller's stack. The global may hold something else by the time the
+// call runs, so the copy sits behind OP_GUARD_CALLEE, with an ordinary call
+// after it for when the guard fails.
+
+// bigger functions are called as usual
+#define INLINE_MAX_CODE 32
+// how much of a statement we look through to find the stack depth
+#define STATEMENT_MAX_CODE 512
+
+// where a forward jump lands, -1 if the instruction isn't one
+static int jumpTarget(const uint8_t *code, int offset) {
+  const uint8_t *at = code + offset;
+  switch (at[0]) {
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+    return offset + 3 + (uint16_t)(at[1] << 8 | at[2]);
+  case OP_GUARD_CALLEE:
+    return offset + 5 + (uint16_t)(at[3] << 8 | at[4]);
+  default:
+    return -1;
+  }
+}
+
+// Fill depths[offset - start] with how many values are on the stack when the
+// instruction at offset runs, from start up to and including end, given depth
+// at start. It stays -1 between instructions and where nothing gets to.
+// Jumps still waiting to be patched point past end and are left out.
+static void stackDepths(Chunk *chunk, int start, int end, int depth,
+                        int *depths) {
+  for (int i = 0; i <= end - start; i++)
+    depths[i] = -1;
+  depths[0] = depth;
+
+  // only forward jumps are followed, so one pass in order sees everything
+  for (int offset = start; offset < end;
+       offset += instructionLength(chunk->code[offset])) {
+    int here = depths[offset - start];
+    if (here == -1)
+      continue;
+    uint8_t instruction = chunk->code[offset];
+    int after = here + stackEffect(chunk->code + offset);
+
+    int target = jumpTarget(chunk->code, offset);
+    if (target != -1 && target <= end && depths[target - start] == -1)
+      depths[target - start] = after;
+
+    int next = offset + instructionLength(instruction);
+    bool fallsThrough = instruction != OP_JUMP && instruction != OP_LOOP &&
+                        instruction != OP_RETURN &&
+                        instruction != OP_RETURN_CLOSING;
+    if (fallsThrough && next <= end && depths[next - start] == -1)
+      depths[next - start] = after;
+  }
+}
+
+// the slot of the callee for a call being compiled, or -1 if we can't tell
+static int calleeSlot() {
+  int start = current->statementStart;
+  int end = currentChunk()->count;
+  if (end - start > STATEMENT_MAX_CODE)
+    return -1;
+
+  int depths[STATEMENT_MAX_CODE + 1];
+  stackDepths(currentChunk(), start, end, current->statementDepth, depths);
+  return depths[end - start] > 0 ? depths[end - start] - 1 : -1;
+}
+
+// straight line code that touches nothing outside its own frame but globals
+// and what it is handed, and calls nothing
+static bool inlinable(uint8_t instruction) {
+  switch (genericInstruction(instruction)) {
+  case OP_RETURN:
+  case OP_CONSTANT:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_NEGATE:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_NOT:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_NOT_EQUAL:
+  case OP_GREATER_EQUAL:
+  case OP_LESS_EQUAL:
+  case OP_LESS:
+  case OP_PRINT:
+  case OP_POP:
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP:
+  case OP_BUILD_LIST:
+  case OP_GET_INDEX:
+  case OP_SET_INDEX:
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void emitAtLine(uint8_t byte, int line) {
+  writeChunk(currentChunk(), byte, line);
+}
+
+// Copy the body of function in for a call with argCount arguments, whose
+// callee is in slot base. Returns false, having emitted nothing, for a
+// function that doesn't qualify.
+static bool inlineCall(ObjFunction *function, int argCount, int base) {
+  Chunk *body = &function->chunk;
+  if (function->lazySource != NULL || function->upvalueCount > 0 ||
+      function->memo != NULL || function->arity != argCount || body->count > INLINE_MAX_CODE ||
+      currentChunk()->constants.count + body->constants.count >= UINT8_COUNT ||
+      current->function->cacheCount + function->cacheCount > UINT16_MAX)
+    return false;
+
+  int depths[INLINE_MAX_CODE + 1];
+  stackDepths(body, 0, body->count, argCount + 1, depths);
+
+  // Where each instruction goes in the copy. A return becomes a store into
+  // the callee's slot, pops down to it and a jump past the fallback call.
+  int moved[INLINE_MAX_CODE + 1];
+  int size = 0;
+  for (int offset = 0; offset < body->count;
+       offset += instructionLength(body->code[offset])) {
+    moved[offset] = size;
+    if (depths[offset] == -1)
+      continue; // never runs, like the return after a return
+    if (!inlinable(body->code[offset]) ||
+        base + depths[offset] + 1 > UINT8_COUNT)
+      return false;
+    size += body->code[offset] == OP_RETURN
+                ? 2 + (depths[offset] - 1) + 3
+                : instructionLength(body->code[offset]);
+  }
+  moved[body->count] = size;
+
+  // one constant for the function however many times it is copied in
+  int constant = -1;
+  ValueArray *constants = &currentChunk()->constants;
+  for (int i = 0; i < constants->count && constant == -1; i++) {
+    if (IS_OBJ(constants->values[i]) &&
+        AS_OBJ(constants->values[i]) == (Obj *)function)
+      constant = i;
+  }
+  if (constant == -1)
+    constant = makeConstant(OBJ_VAL(function));
+
+  emitBytes(OP_GUARD_CALLEE, (uint8_t)argCount);
+  emitByte((uint8_t)constant);
+  emitBytes((size >> 8) & 0xff, size & 0xff);
+
+  int start = currentChunk()->count;
+  for (int offset = 0; offset < body->count;
+       offset += instructionLength(body->code[offset])) {
+    if (depths[offset] == -1)
+      continue;
+    const uint8_t *code = body->code + offset;
+    int line = body->lines[offset];
+    int here = currentChunk()->count - start;
+
+    switch (genericInstruction(code[0])) {
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+      emitAtLine(code[0], line);
+      emitAtLine((uint8_t)(base + code[1]), line);
+      break;
+    case OP_CONSTANT:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+      emitAtLine(code[0], line);
+      emitAtLine(makeConstant(body->constants.values[code[1]]), line);
+      break;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY: {
+      // a cache of its own, the function's caches belong to its calls
+      int cache = current->function->cacheCount++;
+      emitAtLine(code[0], line);
+      emitAtLine(makeConstant(body->constants.values[code[1]]), line);
+      emitAtLine((cache >> 8) & 0xff, line);
+      emitAtLine(cache & 0xff, line);
+      break;
+    }
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE: {
+      int jump = moved[jumpTarget(body->code, offset)] - (here + 3);
+      emitAtLine(code[0], line);
+      emitAtLine((jump >> 8) & 0xff, line);
+      emitAtLine(jump & 0xff, line);
+      break;
+    }
+    case OP_RETURN: {
+      emitAtLine(OP_SET_LOCAL, line);
+      emitAtLine((uint8_t)base, line);
+      for (int i = 1; i < depths[offset]; i++)
+        emitAtLine(OP_POP, line);
+      // over the rest of the copy and the four bytes of the OP_CALL
+      int jump = size + 4 - (currentChunk()->count - start + 3);
+      emitAtLine(OP_JUMP, line);
+      emitAtLine((jump >> 8) & 0xff, line);
+      emitAtLine(jump & 0xff, line);
+      break;
+    }
+    default:
+      for (int i = 0; i < instructionLength(code[0]); i++)
+        emitAtLine(code[i], line);
+      break;
+    }
+  }
+
+  emitCall((uint8_t)argCount);
+  return true;
+}
+
 static void call(bool canAssign) {
+  // a global read just before is the callee, which may be one we know
+  ObjFunction *known = NULL;
+  int base = -1;
+  Chunk *chunk = currentChunk();
+  if (current->globalRead == chunk->count - 2) {
+    Value name = chunk->constants.values[chunk->code[chunk->count - 1]];
+    Value value;
+    if (tableGet(&knownFunctions, AS_STRING(name), &value)) {
+      known = AS_FUNCTION(value);
+      base = calleeSlot();
+    }
+  }
+
   uint8_t argCount = argumentList();
-  emitBytes(OP_CALL, argCount);
+  if (known == NULL || base == -1 || !inlineCall(known, argCount, base))
+    emitCall(argCount);
+  parser.number = false; // we know nothing about what functions return
 }
 
 // handles generating bytecode for true, false, and nil
 static void literal(bool canAssign) {
+  parser.number = false;
   switch (parser.previous.type) {
   case TOKEN_FALSE:
     emitByte(OP_FALSE);
@@ -625,9 +1277,13 @@ static void varDeclaration() {
     expression();
   } else {
     emitByte(OP_NIL);
+    parser.number = false;
   }
   consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
+  if (current->scopeDepth > 0)
+    current->locals[current->localCount - 1].number = parser.number;
+
   defineVariable(global);
 }
 
@@ -662,6 +1318,7 @@ static void forStatement() {
   if (!match(TOKEN_RIGHT_PAREN)) {
     int bodyJump = emitJump(OP_JUMP);
     int incrementStart = currentChunk()->count;
+    markStatement();
     expression();
     emitByte(OP_POP);
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
@@ -682,6 +1339,7 @@ static void forStatement() {
 }
 
 static void statement() {
+  markStatement();
   if (match(TOKEN_PRINT)) {
     printStatement();
   } else if (match(TOKEN_LEFT_BRACE)) {
@@ -702,8 +1360,13 @@ static void statement() {
 }
 
 static void declaration() {
-  if (match(TOKEN_FUN)) {
+  markStatement();
+  if (match(TOKEN_CLASS)) {
+    classDeclaration();
+  } else if (match(TOKEN_FUN)) {
     funDeclaration();
+  } else if (match(TOKEN_AT)) {
+    memoDeclaration();
   } else if (match(TOKEN_VAR)) {
     varDeclaration();
   } else {
@@ -719,6 +1382,7 @@ static void declaration() {
 static void string(bool canAssign) {
   emitConstant(OBJ_VAL(
       copyString(parser.previous.start + 1, parser.previous.length - 2)));
+  parser.number = false;
 }
 
 // we walk backwards to repect any shadowing done
@@ -736,12 +1400,122 @@ static int resolveLocal(Compiler *compiler, Token *name) {
   return -1;
 }
 
+// Everything proven about a function's locals assumed that the ones that
+// started out as numbers stay numbers. One of them just got something else,
+// so put the checks back everywhere and stop trusting locals from here on.
+static void distrustTypes(Compiler *compiler) {
+  Chunk *chunk = &compiler->function->chunk;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    if (isUnchecked(chunk->code[offset]))
+      chunk->code[offset] = genericInstruction(chunk->code[offset]);
+  }
+  compiler->typesWrong = true;
+}
+
+// Whether a local is assigned to anywhere in its scope, found by scanning
+// ahead to the end of it. Anything that looks like an assignment to the name
+// counts, even one to another variable shadowing it, which only costs a box.
+static bool assignedInScope(Compiler *compiler, int slot) {
+  Local *local = &compiler->locals[slot];
+  Scanner saved = saveScanner();
+  // this, super and the hidden locals aren't in the source, and can't be
+  // assigned to anyway
+  if (local->name.start < compilingSource || local->name.start >= saved.end)
+    return false;
+  initScannerAt(local->name.start + local->name.length, saved.end,
+                local->name.line);
+
+  // a parameter's scope is the body, which hasn't started yet
+  int depth = slot <= compiler->function->arity ? -1 : 0;
+  bool assigned = false;
+  TokenType before = TOKEN_EOF;
+  Token token = scanToken();
+  while (token.type != TOKEN_EOF && !assigned) {
+    Token next = scanToken();
+    if (token.type == TOKEN_LEFT_BRACE) {
+      depth++;
+    } else if (token.type == TOKEN_RIGHT_BRACE) {
+      if (--depth < 0)
+        break;
+    } else if (token.type == TOKEN_IDENTIFIER && next.type == TOKEN_EQUAL &&
+               before != TOKEN_VAR && before != TOKEN_DOT) {
+      assigned = identifiersEqual(&token, &local->name);
+    }
+    before = token.type;
+    token = next;
+  }
+
+  restoreScanner(saved);
+  return assigned;
+}
+
+static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal,
+                      bool boxed) {
+  int upvalueCount = compiler->function->upvalueCount;
+  for (int i = 0; i < upvalueCount; i++) {
+    Upvalue *upvalue = &compiler->upvalues[i];
+    if (upvalue->index == index && upvalue->isLocal == isLocal)
+      return i;
+  }
+
+  if (upvalueCount == UINT8_COUNT) {
+    error("Too many closure variables in function.");
+    return 0;
+  }
+
+  compiler->upvalues[upvalueCount] = (Upvalue){index, isLocal, boxed};
+  return compiler->function->upvalueCount++;
+}
+
+// A variable of some function this one is nested in. Every function in
+// between gets an upvalue for it too, so closures only ever copy from the
+// function creating them.
+static int resolveUpvalue(Compiler *compiler, Token *name) {
+  Compiler *enclosing = (Compiler *)compiler->enclosing;
+  if (enclosing == NULL)
+    return -1;
+
+  int slot = resolveLocal(enclosing, name);
+  if (slot != -1) {
+    Local *local = &enclosing->locals[slot];
+    if (!local->captured) {
+      local->captured = true;
+      local->boxed = assignedInScope(enclosing, slot);
+      enclosing->boxes |= local->boxed;
+    }
+    return addUpvalue(compiler, (uint8_t)slot, true, local->boxed);
+  }
+
+  int upvalue = resolveUpvalue(enclosing, name);
+  if (upvalue != -1)
+    return addUpvalue(compiler, (uint8_t)upvalue, false,
+                      enclosing->upvalues[upvalue].boxed);
+  return -1;
+}
+
+// A closure assigned something other than a number to a boxed variable. The
+// function declaring it may have taken it for a number.
+static void upvalueAssigned(Compiler *compiler, int index) {
+  Compiler *enclosing = (Compiler *)compiler->enclosing;
+  Upvalue *upvalue = &compiler->upvalues[index];
+  if (!upvalue->isLocal) {
+    upvalueAssigned(enclosing, upvalue->index);
+  } else if (enclosing->locals[upvalue->index].number) {
+    distrustTypes(enclosing);
+  }
+}
+
 static void namedVariable(Token name, bool canAssign) {
   uint8_t getOp, setOp;
   int arg = resolveLocal(current, &name);
   if (arg != -1) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
+  } else if ((arg = resolveUpvalue(current, &name)) != -1) {
+    // captured variables are never known to be numbers in here
+    getOp = current->upvalues[arg].boxed ? OP_GET_BOXED : OP_GET_UPVALUE;
+    setOp = OP_SET_BOXED;
   } else {
     arg = identifierConstant(&name);
     getOp = OP_GET_GLOBAL;
@@ -751,8 +1525,18 @@ static void namedVariable(Token name, bool canAssign) {
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
     emitBytes(setOp, (uint8_t)arg);
+    if (setOp == OP_SET_LOCAL && !parser.number &&
+        current->locals[arg].number)
+      distrustTypes(current);
+    else if (setOp == OP_SET_BOXED && !parser.number)
+      upvalueAssigned(current, arg);
   } else {
+    if (getOp == OP_GET_GLOBAL)
+      current->globalRead = currentChunk()->count;
     emitBytes(getOp, (uint8_t)arg);
+    // globals can be changed from anywhere, so only locals are ever known
+    parser.number = setOp == OP_SET_LOCAL && current->locals[arg].number &&
+                    !current->typesWrong;
   }
 }
 
@@ -760,6 +1544,40 @@ static void variable(bool canAssign) {
   namedVariable(parser.previous, canAssign);
 }
 
+static void this_(bool canAssign) {
+  if (currentClass == NULL) {
+    error("Can't use 'this' outside of a class.");
+    return;
+  }
+  variable(false);
+}
+
+// super.name binds the superclass's method to this
+static void super_(bool canAssign) {
+  if (currentClass == NULL) {
+    error("Can't use 'super' outside of a class.");
+  } else if (!currentClass->hasSuperclass) {
+    error("Can't use 'super' in a class with no superclass.");
+  }
+
+  consume(TOKEN_DOT, "Expect '.' after 'super'.");
+  consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
+  uint8_t name = identifierConstant(&parser.previous);
+
+  namedVariable(syntheticToken("this"), false);
+  if (match(TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList();
+    namedVariable(syntheticToken("super"), false);
+    emitBytes(OP_SUPER_INVOKE, name);
+    emitByte(argCount);
+    emitCache();
+  } else {
+    namedVariable(syntheticToken("super"), false);
+    emitBytes(OP_GET_SUPER, name);
+  }
+  parser.number = false;
+}
+
 // specify which rules we use for each token
 // columns: prefix rule | infix rules | precedence
 ParseRule rules[] = {
@@ -767,13 +1585,16 @@ ParseRule rules[] = {
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
     [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {list, subscript, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
-    [TOKEN_DOT] = {NULL, NULL, PREC_NONE},
+    [TOKEN_DOT] = {NULL, dot, PREC_CALL},
     [TOKEN_MINUS] = {unary, binary, PREC_TERM},
     [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
     [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE},
     [TOKEN_SLASH] = {NULL, binary, PREC_FACTOR},
     [TOKEN_STAR] = {NULL, binary, PREC_FACTOR},
+    [TOKEN_AT] = {NULL, NULL, PREC_NONE},
     [TOKEN_BANG] = {unary, NULL, PREC_NONE},
     [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_EQUALITY},
     [TOKEN_EQUAL] = {NULL, NULL, PREC_NONE},
@@ -796,8 +1617,8 @@ ParseRule rules[] = {
     [TOKEN_OR] = {NULL, or_, PREC_OR},
     [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
     [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_SUPER] = {NULL, NULL, PREC_NONE},
-    [TOKEN_THIS] = {NULL, NULL, PREC_NONE},
+    [TOKEN_SUPER] = {super_, NULL, PREC_NONE},
+    [TOKEN_THIS] = {this_, NULL, PREC_NONE},
     [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
     [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
     [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
@@ -810,9 +1631,34 @@ static ParseRule *getRule(TokenType type) { return &rules[type]; }
 
 // driver function for our compiler
 ObjFunction *compile(const char *source) {
-  initScanner(source);
+  // running out of heap part way through abandons the whole compilation
+  jmp_buf handler;
+  jmp_buf *enclosing = vm->errorHandler;
+  vm->errorHandler = &handler;
+  if (setjmp(handler) != 0) {
+    vm->errorHandler = enclosing;
+    current = NULL;
+    freeArena(&compileArena);
+    freeTable(&knownFunctions);
+    return NULL;
+  }
+
+  size_t length = strlen(source);
+  initScanner(source, source + length);
+  initTable(&knownFunctions);
+  currentClass = NULL;
+  compilingSource = source;
+  sourceCopy = NULL;
+
+  // roughly one token for every four characters of source, and about a byte
+  // of bytecode for every token
+  initArena(&compileArena);
+  scriptEstimate = (int)(length / 4) + 16;
+  if (scriptEstimate > MAX_SCRIPT_ESTIMATE)
+    scriptEstimate = MAX_SCRIPT_ESTIMATE;
+
   Compiler compiler;
-  initCompiler(&compiler, TYPE_SCRIPT);
+  initCompiler(&compiler, TYPE_SCRIPT, NULL);
 
   parser.hadError = false;
   parser.panicMode = false;
@@ -823,8 +1669,52 @@ ObjFunction *compile(const char *source) {
   }
 
   ObjFunction *function = endCompiler();
+  freeArena(&compileArena);
+  freeTable(&knownFunctions);
+  vm->errorHandler = enclosing;
   return parser.hadError ? NULL : function;
 
   endCompiler();
   return !parser.hadError;
 }
+
+bool compileLazily(ObjFunction *function) {
+  jmp_buf handler;
+  jmp_buf *enclosing = vm->errorHandler;
+  vm->errorHandler = &handler;
+  if (setjmp(handler) != 0) {
+    vm->errorHandler = enclosing;
+    current = NULL;
+    freeArena(&compileArena);
+    return false;
+  }
+
+  // compiled the ordinary way now, the source is the VM's copy
+  initScannerAt(function->lazySource, function->lazyEnd, function->lazyLine);
+  currentClass = NULL;
+  compilingSource = function->lazySource;
+  sourceCopy = function->lazySource;
+  initArena(&compileArena);
+  parser.hadError = false;
+  parser.panicMode = false;
+
+  Compiler compiler;
+  initCompiler(&compiler, TYPE_FUNCTION, function);
+  beginScope();
+  function->arity = 0;
+  advance();
+  parameters();
+  memoPrologue();
+  block();
+  endCompiler();
+  freeArena(&compileArena);
+  vm->errorHandler = enclosing;
+
+  if (parser.hadError) {
+    freeChunk(&function->chunk);
+    return false;
+  }
+  function->lazySource = NULL;
+  function->lazyEnd = NULL;
+  return true;
+}
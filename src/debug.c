@@ -3,6 +3,7 @@
  */
 
 #include "../include/debug.h"
+#include "../include/object.h"
 #include <stdio.h>
 
 // analyze a chunk of code
@@ -48,6 +49,61 @@ static int jumpInstruction(const char *name, int sign, Chunk *chunk,
   return offset + 3;
 }
 
+// the function, then where each of its upvalues comes from
+static int closureInstruction(Chunk *chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  printf("%-16s %4d ", "OP_CLOSURE", constant);
+  printValue(chunk->constants.values[constant]);
+  printf("\n");
+
+  ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+  for (int i = 0; i < function->upvalueCount; i++) {
+    Upvalue *upvalue = &function->upvalues[i];
+    printf("          |                     %s %d, %s\n",
+           upvalue->isLocal ? "local" : "upvalue", upvalue->index,
+           upvalue->boxed ? "boxed" : "copied");
+  }
+  return offset + 2;
+}
+
+// the name, then which of the function's caches the instruction uses
+static int propertyInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  int cache = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' cache %d\n", cache);
+  return offset + 4;
+}
+
+static int callInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t argCount = chunk->code[offset + 1];
+  int cache = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+  printf("%-16s (%d args) cache %d\n", name, argCount, cache);
+  return offset + 4;
+}
+
+static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint8_t argCount = chunk->code[offset + 2];
+  int cache = (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' cache %d\n", cache);
+  return offset + 5;
+}
+
+// the function the inlined code came from, then where the real call is
+static int guardInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t argCount = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  int jump = (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' -> %d\n", offset + 5 + jump);
+  return offset + 5;
+}
+
 // disassemble the instruction to make debugging easier
 int disassembleInstruction(Chunk *chunk, int offset) {
   printf("%04d ", offset);
@@ -129,7 +185,75 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return jumpInstruction("OP_LOOP", -1, chunk, offset);
 
   case OP_CALL:
-    return byteInstruction("OP_CALL", chunk, offset);
+    return callInstruction("OP_CALL", chunk, offset);
+  case OP_BUILD_LIST:
+    return byteInstruction("OP_BUILD_LIST", chunk, offset);
+  case OP_GET_INDEX:
+    return simpleInstruction("OP_GET_INDEX", offset);
+  case OP_CLOSURE:
+    return closureInstruction(chunk, offset);
+  case OP_GET_UPVALUE:
+    return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+  case OP_GET_BOXED:
+    return byteInstruction("OP_GET_BOXED", chunk, offset);
+  case OP_SET_BOXED:
+    return byteInstruction("OP_SET_BOXED", chunk, offset);
+  case OP_CLOSE_UPVALUES:
+    return byteInstruction("OP_CLOSE_UPVALUES", chunk, offset);
+  case OP_RETURN_CLOSING:
+    return simpleInstruction("OP_RETURN_CLOSING", offset);
+  case OP_SET_INDEX:
+    return simpleInstruction("OP_SET_INDEX", offset);
+  case OP_CLASS:
+    return constantInstruction("OP_CLASS", chunk, offset);
+  case OP_METHOD:
+    return constantInstruction("OP_METHOD", chunk, offset);
+  case OP_INHERIT:
+    return simpleInstruction("OP_INHERIT", offset);
+  case OP_GET_PROPERTY:
+    return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
+  case OP_SET_PROPERTY:
+    return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
+  case OP_GET_SUPER:
+    return constantInstruction("OP_GET_SUPER", chunk, offset);
+  case OP_INVOKE:
+    return invokeInstruction("OP_INVOKE", chunk, offset);
+  case OP_SUPER_INVOKE:
+    return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+  case OP_GUARD_CALLEE:
+    return guardInstruction("OP_GUARD_CALLEE", chunk, offset);
+
+  case OP_MEMO_LOOKUP:
+    return jumpInstruction("OP_MEMO_LOOKUP", 1, chunk, offset);
+  case OP_MEMO_STORE:
+    return simpleInstruction("OP_MEMO_STORE", offset);
+
+  case OP_ADD_NUM:
+    return simpleInstruction("OP_ADD_NUM", offset);
+  case OP_SUBTRACT_NUM:
+    return simpleInstruction("OP_SUBTRACT_NUM", offset);
+  case OP_MULTIPLY_NUM:
+    return simpleInstruction("OP_MULTIPLY_NUM", offset);
+  case OP_DIVIDE_NUM:
+    return simpleInstruction("OP_DIVIDE_NUM", offset);
+  case OP_GREATER_NUM:
+    return simpleInstruction("OP_GREATER_NUM", offset);
+  case OP_LESS_NUM:
+    return simpleInstruction("OP_LESS_NUM", offset);
+  case OP_NEGATE_UNCHECKED:
+    return simpleInstruction("OP_NEGATE_UNCHECKED", offset);
+  case OP_ADD_UNCHECKED:
+    return simpleInstruction("OP_ADD_UNCHECKED", offset);
+  case OP_SUBTRACT_UNCHECKED:
+    return simpleInstruction("OP_SUBTRACT_UNCHECKED", offset);
+  case OP_MULTIPLY_UNCHECKED:
+    return simpleInstruction("OP_MULTIPLY_UNCHECKED", offset);
+  case OP_DIVIDE_UNCHECKED:
+    return simpleInstruction("OP_DIVIDE_UNCHECKED", offset);
+  case OP_GREATER_UNCHECKED:
+    return simpleInstruction("OP_GREATER_UNCHECKED", offset);
+  case OP_LESS_UNCHECKED:
+    return simpleInstruction("OP_LESS_UNCHECKED", offset);
 
   default:
     printf("Unknown opcode %d\n", instruction);
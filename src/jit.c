@@ -0,0 +1,1240 @@
+/*
+ * Baseline JIT. Each bytecode instruction becomes a short, fixed sequence of
+ * x86-64 that does what run() would have done, minus the dispatch. Values
+ * stay on the VM stack, so there is no register allocation to speak of and
+ * the interpreter can take over a frame at any instruction boundary.
+ *
+ * While compiled code runs, these registers hold the interpreter's state:
+ *
+ *   rbx  vm->stackTop     r12  frame->slots     r13  frame
+ *   r14  the constants    r15  vm
+ *
+ * Only the stack top is ever out of date in memory, it gets written back
+ * before calling into C and whenever the code exits.
+ */
+
+#include "../include/jit.h"
+
+#ifdef LOX_JIT
+
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "../include/memory.h"
+#include "../include/table.h"
+
+enum {
+  RAX = 0,
+  RCX = 1,
+  RDX = 2,
+  RBX = 3,
+  RSP = 4,
+  RBP = 5,
+  RSI = 6,
+  RDI = 7,
+  R8 = 8,
+  R12 = 12,
+  R13 = 13,
+  R14 = 14,
+  R15 = 15,
+};
+
+// condition codes, added to 0x0f 0x80 for jcc and 0x0f 0x90 for setcc
+enum {
+  CC_O = 0x0,
+  CC_AE = 0x3,
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_A = 0x7,
+  CC_S = 0x8,
+  CC_L = 0xc,
+  CC_GE = 0xd,
+  CC_LE = 0xe,
+  CC_G = 0xf,
+};
+#define ALWAYS -1
+
+typedef enum {
+  FIX_JUMP,   // jump to another instruction
+  FIX_DEOPT,  // guard failed, hand the instruction back to the interpreter
+  FIX_REFUEL, // out of fuel at a loop
+  FIX_SLOW,   // the general case of an instruction with a fast path
+  FIX_SLOW_REFUEL, // a call that ran out of fuel
+  FIX_RESUME, // a called function didn't return normally
+} FixupKind;
+
+// a rel32 that can only be filled in once the whole function has been laid out
+typedef struct {
+  FixupKind kind;
+  size_t at;  // where the rel32 lives in the code
+  int offset; // the bytecode offset it is about
+} Fixup;
+
+typedef struct {
+  uint8_t *code;
+  size_t count;
+  size_t capacity;
+
+  Fixup *fixups;
+  int fixupCount;
+  int fixupCapacity;
+
+  ObjFunction *function;
+  JitCode *jit;
+  uint32_t *offsets;
+  int globalCount;
+  size_t epilogue;
+} Assembler;
+
+static void emit8(Assembler *as, uint8_t byte) {
+  if (as->count == as->capacity) {
+    size_t capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+    as->code = GROW_ARRAY(uint8_t, as->code, as->capacity, capacity);
+    as->capacity = capacity;
+  }
+  as->code[as->count++] = byte;
+}
+
+static void emit32(Assembler *as, uint32_t value) {
+  for (int i = 0; i < 4; i++)
+    emit8(as, (value >> (i * 8)) & 0xff);
+}
+
+static void emit64(Assembler *as, uint64_t value) {
+  for (int i = 0; i < 8; i++)
+    emit8(as, (value >> (i * 8)) & 0xff);
+}
+
+static void patch32(Assembler *as, size_t at, uint32_t value) {
+  for (int i = 0; i < 4; i++)
+    as->code[at + i] = (value >> (i * 8)) & 0xff;
+}
+
+// REX prefix, left out when it would carry no information
+static void rex(Assembler *as, bool wide, int reg, int base) {
+  uint8_t prefix = 0x40 | (wide ? 8 : 0) | ((reg >> 3) << 2) | (base >> 3);
+  if (prefix != 0x40)
+    emit8(as, prefix);
+}
+
+// ModRM for [base + disp32], rsp and r12 need the extra SIB byte
+static void memory(Assembler *as, int reg, int base, int32_t disp) {
+  emit8(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP)
+    emit8(as, 0x24);
+  emit32(as, (uint32_t)disp);
+}
+
+// op reg, [base + disp], with an optional mandatory prefix (f2, 66...)
+static void op(Assembler *as, uint8_t prefix, bool wide, uint8_t escape,
+               uint8_t opcode, int reg, int base, int32_t disp) {
+  if (prefix)
+    emit8(as, prefix);
+  rex(as, wide, reg, base);
+  if (escape)
+    emit8(as, escape);
+  emit8(as, opcode);
+  memory(as, reg, base, disp);
+}
+
+#define LOAD(as, reg, base, disp) op(as, 0, true, 0, 0x8b, reg, base, disp)
+#define STORE(as, base, disp, reg) op(as, 0, true, 0, 0x89, reg, base, disp)
+#define MOVSD_LOAD(as, xmm, base, disp)                                        \
+  op(as, 0xf2, false, 0x0f, 0x10, xmm, base, disp)
+#define MOVSD_STORE(as, base, disp, xmm)                                       \
+  op(as, 0xf2, false, 0x0f, 0x11, xmm, base, disp)
+
+// mov qword [base + disp], imm32 (sign extended)
+static void storeImmediate(Assembler *as, int base, int32_t disp,
+                           int32_t value) {
+  op(as, 0, true, 0, 0xc7, 0, base, disp);
+  emit32(as, (uint32_t)value);
+}
+
+static void moveImmediate64(Assembler *as, int reg, uint64_t value) {
+  rex(as, true, 0, reg);
+  emit8(as, 0xb8 + (reg & 7));
+  emit64(as, value);
+}
+
+static void moveImmediate32(Assembler *as, int reg, uint32_t value) {
+  rex(as, false, 0, reg);
+  emit8(as, 0xb8 + (reg & 7));
+  emit32(as, value);
+}
+
+// Copy a whole Value as two quadwords. One 16 byte move would be shorter, but
+// values are often written half at a time, and a wide load straddling two
+// narrow stores can't be forwarded from the store buffer.
+static void copyValue(Assembler *as, int to, int32_t toDisp, int from,
+                      int32_t fromDisp) {
+  LOAD(as, RCX, from, fromDisp);
+  LOAD(as, RDX, from, fromDisp + 8);
+  STORE(as, to, toDisp, RCX);
+  STORE(as, to, toDisp + 8, RDX);
+}
+
+// add or subtract a small constant from rbx
+static void adjustStack(Assembler *as, int bytes) {
+  emit8(as, 0x48);
+  emit8(as, 0x83);
+  emit8(as, bytes > 0 ? 0xc3 : 0xeb);
+  emit8(as, (uint8_t)(bytes > 0 ? bytes : -bytes));
+}
+
+static void addFixup(Assembler *as, FixupKind kind, int offset) {
+  if (as->fixupCount == as->fixupCapacity) {
+    int capacity = as->fixupCapacity < 16 ? 16 : as->fixupCapacity * 2;
+    as->fixups = GROW_ARRAY(Fixup, as->fixups, as->fixupCapacity, capacity);
+    as->fixupCapacity = capacity;
+  }
+  as->fixups[as->fixupCount++] = (Fixup){kind, as->count, offset};
+  emit32(as, 0);
+}
+
+static void jumpTo(Assembler *as, size_t target) {
+  emit8(as, 0xe9);
+  emit32(as, (uint32_t)(target - (as->count + 4)));
+}
+
+static void jumpIf(Assembler *as, int condition, FixupKind kind, int offset) {
+  emit8(as, 0x0f);
+  emit8(as, 0x80 + condition);
+  addFixup(as, kind, offset);
+}
+
+// A jump to somewhere later in the same instruction, land() fills it in once
+// the code in between has been emitted.
+static size_t jumpForward(Assembler *as, int condition) {
+  if (condition == ALWAYS) {
+    emit8(as, 0xe9);
+  } else {
+    emit8(as, 0x0f);
+    emit8(as, 0x80 + condition);
+  }
+  emit32(as, 0);
+  return as->count - 4;
+}
+
+static void land(Assembler *as, size_t at) {
+  patch32(as, at, (uint32_t)(as->count - (at + 4)));
+}
+
+// where the value "distance" slots down from the top lives
+static int32_t slot(int distance) {
+  return -(distance + 1) * (int32_t)sizeof(Value);
+}
+
+// jump somewhere unless the value "distance" slots down has the given type
+static size_t unlessType(Assembler *as, int distance, ValueType type) {
+  op(as, 0, false, 0, 0x83, 7, RBX, slot(distance) + offsetof(Value, type));
+  emit8(as, type);
+  return jumpForward(as, CC_NE);
+}
+
+// Load a number of either kind into an xmm register as a double. Anything
+// else bails out to the interpreter at this instruction, unless the compiler
+// already proved it is a number.
+static void loadNumber(Assembler *as, int xmm, int distance, bool checked,
+                       int offset) {
+  int32_t payload = slot(distance) + offsetof(Value, as);
+  size_t notInt = unlessType(as, distance, VAL_INT);
+  op(as, 0xf2, true, 0x0f, 0x2a, xmm, RBX, payload); // cvtsi2sd
+  size_t done = jumpForward(as, ALWAYS);
+  land(as, notInt);
+  if (checked) {
+    op(as, 0, false, 0, 0x83, 7, RBX, slot(distance) + offsetof(Value, type));
+    emit8(as, VAL_NUMBER);
+    jumpIf(as, CC_NE, FIX_DEOPT, offset);
+  }
+  MOVSD_LOAD(as, xmm, RBX, payload);
+  land(as, done);
+}
+
+// jump somewhere unless rax still fits in an integer value, see FITS_INT
+static size_t unlessFitsInt(Assembler *as) {
+  emit8(as, 0x48); // mov rcx, rax
+  emit8(as, 0x89);
+  emit8(as, 0xc1);
+  emit8(as, 0x48); // shl rcx, 10
+  emit8(as, 0xc1);
+  emit8(as, 0xe1);
+  emit8(as, 10);
+  emit8(as, 0x48); // sar rcx, 10
+  emit8(as, 0xc1);
+  emit8(as, 0xf9);
+  emit8(as, 10);
+  emit8(as, 0x48); // cmp rcx, rax
+  emit8(as, 0x39);
+  emit8(as, 0xc1);
+  return jumpForward(as, CC_NE);
+}
+
+// Point rax at the item a list is being indexed for, with the list "distance"
+// slots down and the index right above it. Anything that isn't a list and an
+// integer in range takes the slow path.
+static void indexList(Assembler *as, int distance, int offset) {
+  int32_t list = slot(distance);
+  int32_t index = slot(distance - 1);
+  op(as, 0, false, 0, 0x83, 7, RBX, list + offsetof(Value, type));
+  emit8(as, VAL_OBJ);
+  jumpIf(as, CC_NE, FIX_SLOW, offset);
+  op(as, 0, false, 0, 0x83, 7, RBX, index + offsetof(Value, type));
+  emit8(as, VAL_INT);
+  jumpIf(as, CC_NE, FIX_SLOW, offset);
+  LOAD(as, RAX, RBX, list + offsetof(Value, as));
+  op(as, 0, false, 0, 0x83, 7, RAX, offsetof(Obj, type));
+  emit8(as, OBJ_LIST);
+  jumpIf(as, CC_NE, FIX_SLOW, offset);
+  LOAD(as, RCX, RBX, index + offsetof(Value, as));
+  op(as, 0, false, 0, 0x8b, RDX, RAX, offsetof(ObjList, count)); // mov edx
+  emit8(as, 0x48); // cmp rcx, rdx, unsigned so negative indexes fail too
+  emit8(as, 0x39);
+  emit8(as, 0xd1);
+  jumpIf(as, CC_AE, FIX_SLOW, offset);
+  LOAD(as, RAX, RAX, offsetof(ObjList, items));
+  emit8(as, 0x48); // shl rcx, 4
+  emit8(as, 0xc1);
+  emit8(as, 0xe1);
+  emit8(as, 4);
+  emit8(as, 0x48); // add rax, rcx
+  emit8(as, 0x01);
+  emit8(as, 0xc8);
+}
+
+// store the double in xmm0 over the value "distance" slots down
+static void storeDouble(Assembler *as, int distance) {
+  MOVSD_STORE(as, RBX, slot(distance) + offsetof(Value, as), 0);
+  storeImmediate(as, RBX, slot(distance) + offsetof(Value, type), VAL_NUMBER);
+}
+
+static uint8_t *bytecodeAt(Assembler *as, int offset) {
+  return as->function->chunk.code + offset;
+}
+
+static ObjString *globalName(Assembler *as, int offset) {
+  return AS_STRING(as->function->chunk.constants.values[bytecodeAt(as, offset)[1]]);
+}
+
+// the inline cache of a property instruction, its last two operand bytes
+static PropertyCache *propertyCache(Assembler *as, int offset) {
+  uint8_t *code = bytecodeAt(as, offset);
+  int end = instructionLength(code[0]);
+  return &as->function->caches[code[end - 2] << 8 | code[end - 1]];
+}
+
+static CallCache *callCache(Assembler *as, int offset) {
+  uint8_t *code = bytecodeAt(as, offset);
+  return &as->function->callCaches[code[2] << 8 | code[3]];
+}
+
+// Point rax at the instance "distance" slots down, and rsi at the cache.
+// Anything but an instance with the shape in the cache's first way takes the
+// slow path, with rcx left holding the shape.
+static void checkShape(Assembler *as, int distance, int offset) {
+  op(as, 0, false, 0, 0x83, 7, RBX, slot(distance) + offsetof(Value, type));
+  emit8(as, VAL_OBJ);
+  jumpIf(as, CC_NE, FIX_SLOW, offset);
+  LOAD(as, RAX, RBX, slot(distance) + offsetof(Value, as));
+  op(as, 0, false, 0, 0x83, 7, RAX, offsetof(Obj, type));
+  emit8(as, OBJ_INSTANCE);
+  jumpIf(as, CC_NE, FIX_SLOW, offset);
+  LOAD(as, RCX, RAX, offsetof(ObjInstance, shape));
+  moveImmediate64(as, RSI, (uint64_t)(uintptr_t)propertyCache(as, offset));
+  op(as, 0, true, 0, 0x3b, RCX, RSI,
+     offsetof(PropertyCache, entries) + offsetof(CacheEntry, shape)); // cmp
+  jumpIf(as, CC_NE, FIX_SLOW, offset);
+}
+
+// with rax at an instance and rcx the cached slot, point rax at the field
+static void fieldAddress(Assembler *as) {
+  emit8(as, 0x48); // shl rcx, 4
+  emit8(as, 0xc1);
+  emit8(as, 0xe1);
+  emit8(as, 4);
+  LOAD(as, RAX, RAX, offsetof(ObjInstance, fields));
+  emit8(as, 0x48); // add rax, rcx
+  emit8(as, 0x01);
+  emit8(as, 0xc8);
+}
+
+// make the frame's ip point at the given bytecode offset
+static void storeIp(Assembler *as, int offset) {
+  moveImmediate64(as, RAX, (uint64_t)(uintptr_t)bytecodeAt(as, offset));
+  STORE(as, R13, offsetof(CallFrame, ip), RAX);
+}
+
+// Call a C function that works on the VM stack. The stack top goes out to
+// memory and comes back afterwards, and the ip is set past the instruction so
+// any error message points at the right line.
+static void callHelper(Assembler *as, void *helper, int next) {
+  STORE(as, R15, offsetof(VM, stackTop), RBX);
+  storeIp(as, next);
+  moveImmediate64(as, RAX, (uint64_t)(uintptr_t)helper);
+  emit8(as, 0xff); // call rax
+  emit8(as, 0xd0);
+  LOAD(as, RBX, R15, offsetof(VM, stackTop));
+}
+
+// al = 1 if the value on top of the stack is nil or false
+static void emitFalsey(Assembler *as) {
+  // mov ecx, [rbx - 16 + type]
+  op(as, 0, false, 0, 0x8b, RCX, RBX,
+     -(int32_t)sizeof(Value) + (int32_t)offsetof(Value, type));
+  emit8(as, 0x83); // cmp ecx, VAL_NIL
+  emit8(as, 0xf9);
+  emit8(as, VAL_NIL);
+  emit8(as, 0x0f); // sete al
+  emit8(as, 0x94);
+  emit8(as, 0xc0);
+  emit8(as, 0x83); // cmp ecx, VAL_BOOL
+  emit8(as, 0xf9);
+  emit8(as, VAL_BOOL);
+  emit8(as, 0x0f); // sete dl
+  emit8(as, 0x94);
+  emit8(as, 0xc2);
+  // cmp byte [rbx - 16 + as], 0
+  op(as, 0, false, 0, 0x80, 7, RBX,
+     -(int32_t)sizeof(Value) + (int32_t)offsetof(Value, as));
+  emit8(as, 0);
+  emit8(as, 0x0f); // sete cl
+  emit8(as, 0x94);
+  emit8(as, 0xc1);
+  emit8(as, 0x20); // and dl, cl
+  emit8(as, 0xca);
+  emit8(as, 0x08); // or al, dl
+  emit8(as, 0xd0);
+}
+
+// overwrite the value "distance" slots down with a bool held in al
+static void storeBool(Assembler *as, int distance) {
+  int32_t slot = -(distance + 1) * (int32_t)sizeof(Value);
+  emit8(as, 0x0f); // movzx eax, al
+  emit8(as, 0xb6);
+  emit8(as, 0xc0);
+  storeImmediate(as, RBX, slot + offsetof(Value, type), VAL_BOOL);
+  STORE(as, RBX, slot + offsetof(Value, as), RAX);
+}
+
+// leave with the status in eax unless it is zero, which is INTERPRET_OK
+static void exitOnError(Assembler *as) {
+  emit8(as, 0x85); // test eax, eax
+  emit8(as, 0xc0);
+  emit8(as, 0x0f);
+  emit8(as, 0x85); // jnz epilogue
+  emit32(as, (uint32_t)(as->epilogue - (as->count + 4)));
+}
+
+// the helpers compiled code calls for anything too big to inline
+
+static bool jitGetGlobal(ObjString *name, EntryCache *cache) {
+  Entry *entry = tableFindCached(&vm->globals, name, cache);
+  if (entry == NULL)
+    return false; // the interpreter reports the error
+  push(entry->value);
+  return true;
+}
+
+static bool jitSetGlobal(ObjString *name, EntryCache *cache) {
+  Entry *entry = tableFindCached(&vm->globals, name, cache);
+  if (entry == NULL)
+    return false;
+  entry->value = vm->stackTop[-1];
+  return true;
+}
+
+static void jitDefineGlobal(ObjString *name) {
+  tableSet(&vm->globals, name, vm->stackTop[-1]);
+  pop();
+}
+
+static void jitEqual() {
+  Value b = pop();
+  Value a = pop();
+  push(BOOL_VAL(valuesEqual(a, b)));
+}
+
+static void jitPrint() {
+  writeValue(&vm->output, pop());
+  writeByte(&vm->output, '\n');
+}
+
+static void noteDeopt(ObjFunction *function) {
+  if (++function->jit->deopts > JIT_MAX_DEOPTS) {
+    // the code has to stay around, outer calls may still be running in it
+    function->jitDisabled = true;
+  }
+}
+
+// a function called straight from compiled code bailed out, the interpreter
+// finishes it
+static InterpretResult jitResume() {
+  noteDeopt(vm->frames[vm->frameCount - 1].function);
+  return finishCall();
+}
+
+// whether the JIT knows how to compile the instruction
+static bool jitSupports(uint8_t instruction) {
+  switch (genericInstruction(instruction)) {
+  case OP_CONSTANT:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+  case OP_BUILD_LIST:
+  case OP_CLOSURE:
+  case OP_GET_UPVALUE:
+  case OP_GET_BOXED:
+  case OP_SET_BOXED:
+  case OP_CLOSE_UPVALUES:
+  case OP_CLASS:
+  case OP_METHOD:
+  case OP_GET_SUPER:
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+  case OP_CALL:
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+  case OP_INVOKE:
+  case OP_SUPER_INVOKE:
+  case OP_GUARD_CALLEE:
+  case OP_RETURN:
+  case OP_RETURN_CLOSING:
+  case OP_NEGATE:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_NOT:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_PRINT:
+  case OP_POP:
+  case OP_GET_INDEX:
+  case OP_SET_INDEX:
+  case OP_INHERIT:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// With rdi at the function being called from the callee slot, push its frame
+// and run it in compiled code. Functions that aren't compiled, or don't take
+// this many arguments, take the slow path, and so does running out of fuel.
+static void callCompiled(Assembler *as, int argCount, int next, int offset) {
+  const int32_t size = sizeof(Value);
+  int32_t callee = -(argCount + 1) * size;
+  op(as, 0, false, 0, 0x83, 7, RDI, offsetof(Obj, type));
+  emit8(as, OBJ_FUNCTION);
+  jumpIf(as, CC_NE, FIX_SLOW, offset);
+  op(as, 0, false, 0, 0x81, 7, RDI, offsetof(ObjFunction, arity));
+  emit32(as, argCount);
+  jumpIf(as, CC_NE, FIX_SLOW, offset);
+  LOAD(as, RSI, RDI, offsetof(ObjFunction, jit));
+  emit8(as, 0x48); // test rsi, rsi
+  emit8(as, 0x85);
+  emit8(as, 0xf6);
+  jumpIf(as, CC_E, FIX_SLOW, offset);
+  op(as, 0, false, 0, 0x80, 7, RDI, offsetof(ObjFunction, jitDisabled));
+  emit8(as, 0);
+  jumpIf(as, CC_NE, FIX_SLOW, offset);
+  op(as, 0, false, 0, 0x81, 7, R15, offsetof(VM, frameCount));
+  emit32(as, FRAMES_MAX);
+  jumpIf(as, CC_GE, FIX_SLOW, offset);
+  op(as, 0, true, 0, 0xff, 1, R15, offsetof(VM, fuel)); // dec qword
+  jumpIf(as, CC_LE, FIX_SLOW_REFUEL, offset);
+
+  // push the new frame, the way call() does
+  STORE(as, R15, offsetof(VM, stackTop), RBX);
+  storeIp(as, next);
+  op(as, 0, false, 0, 0x8b, RAX, R15, offsetof(VM, frameCount));
+  op(as, 0, false, 0, 0xff, 0, R15, offsetof(VM, frameCount)); // inc dword
+  emit8(as, 0x69); // imul eax, eax, sizeof(CallFrame)
+  emit8(as, 0xc0);
+  emit32(as, sizeof(CallFrame));
+  emit8(as, 0x4c); // add rax, r15
+  emit8(as, 0x01);
+  emit8(as, 0xf8);
+  op(as, 0, true, 0, 0x8d, R8, RAX, offsetof(VM, frames)); // lea
+  STORE(as, R8, offsetof(CallFrame, function), RDI);
+  op(as, 0, true, 0, 0x8d, RCX, RBX, callee); // lea rcx, [rbx + callee]
+  STORE(as, R8, offsetof(CallFrame, slots), RCX);
+  LOAD(as, RCX, RDI,
+       offsetof(ObjFunction, chunk) + offsetof(Chunk, code));
+  STORE(as, R8, offsetof(CallFrame, ip), RCX);
+
+  // and enter it at the top
+  LOAD(as, RCX, RSI, offsetof(JitCode, offsets));
+  op(as, 0, false, 0, 0x8b, RDX, RCX, 0); // mov edx, [rcx]
+  LOAD(as, RAX, RSI, offsetof(JitCode, code));
+  emit8(as, 0x48); // add rdx, rax
+  emit8(as, 0x01);
+  emit8(as, 0xc2);
+  emit8(as, 0x4c); // mov rdi, r8
+  emit8(as, 0x89);
+  emit8(as, 0xc7);
+  emit8(as, 0x4c); // mov rsi, r15
+  emit8(as, 0x89);
+  emit8(as, 0xfe);
+  emit8(as, 0xff); // call rax
+  emit8(as, 0xd0);
+  emit8(as, 0x83); // cmp eax, JIT_RETURNED
+  emit8(as, 0xf8);
+  emit8(as, (uint8_t)JIT_RETURNED);
+  jumpIf(as, CC_NE, FIX_RESUME, offset);
+  LOAD(as, RBX, R15, offsetof(VM, stackTop));
+}
+
+// returns false if the instruction can't be compiled
+static bool compileInstruction(Assembler *as, int offset) {
+  uint8_t *code = bytecodeAt(as, offset);
+  int next = offset + instructionLength(code[0]);
+  uint8_t instruction = genericInstruction(code[0]);
+  bool checked = !isUnchecked(code[0]);
+  const int32_t size = sizeof(Value);
+  const int32_t type = offsetof(Value, type);
+  const int32_t payload = offsetof(Value, as);
+
+  switch (instruction) {
+  case OP_CONSTANT:
+    copyValue(as, RBX, 0, R14, code[1] * size);
+    adjustStack(as, size);
+    break;
+
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+    storeImmediate(as, RBX, type, instruction == OP_NIL ? VAL_NIL : VAL_BOOL);
+    storeImmediate(as, RBX, payload, instruction == OP_TRUE);
+    adjustStack(as, size);
+    break;
+
+  case OP_POP:
+    adjustStack(as, -size);
+    break;
+
+  case OP_GET_LOCAL:
+    copyValue(as, RBX, 0, R12, code[1] * size);
+    adjustStack(as, size);
+    break;
+
+  case OP_SET_LOCAL:
+    copyValue(as, R12, code[1] * size, RBX, -size);
+    break;
+
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE: {
+    // Two integers are added, subtracted or multiplied as integers. Anything
+    // that doesn't come out exact, and every division, is done in doubles.
+    // Strings and type errors are left to the interpreter.
+    static const uint8_t doubleOps[] = {
+        [OP_ADD] = 0x58, [OP_SUBTRACT] = 0x5c,
+        [OP_MULTIPLY] = 0x59, [OP_DIVIDE] = 0x5e};
+    size_t toDouble[5];
+    int count = 0;
+    size_t done = 0;
+    if (instruction != OP_DIVIDE) {
+      toDouble[count++] = unlessType(as, 1, VAL_INT);
+      toDouble[count++] = unlessType(as, 0, VAL_INT);
+      LOAD(as, RAX, RBX, -2 * size + payload);
+      if (instruction == OP_MULTIPLY) {
+        op(as, 0, true, 0x0f, 0xaf, RAX, RBX, -size + payload); // imul
+        toDouble[count++] = jumpForward(as, CC_O);
+        // a zero might have to be -0
+        emit8(as, 0x48); // test rax, rax
+        emit8(as, 0x85);
+        emit8(as, 0xc0);
+        toDouble[count++] = jumpForward(as, CC_E);
+      } else {
+        op(as, 0, true, 0, instruction == OP_ADD ? 0x03 : 0x2b, RAX, RBX,
+           -size + payload);
+      }
+      toDouble[count++] = unlessFitsInt(as);
+      STORE(as, RBX, -2 * size + payload, RAX);
+      done = jumpForward(as, ALWAYS);
+    }
+    for (int i = 0; i < count; i++)
+      land(as, toDouble[i]);
+    loadNumber(as, 0, 1, checked, offset);
+    loadNumber(as, 1, 0, checked, offset);
+    emit8(as, 0xf2); // addsd/subsd/mulsd/divsd xmm0, xmm1
+    emit8(as, 0x0f);
+    emit8(as, doubleOps[instruction]);
+    emit8(as, 0xc1);
+    storeDouble(as, 1);
+    if (instruction != OP_DIVIDE)
+      land(as, done);
+    adjustStack(as, -size);
+    break;
+  }
+
+  case OP_NEGATE: {
+    size_t toDouble[3];
+    toDouble[0] = unlessType(as, 0, VAL_INT);
+    LOAD(as, RAX, RBX, -size + payload);
+    emit8(as, 0x48); // neg rax
+    emit8(as, 0xf7);
+    emit8(as, 0xd8);
+    toDouble[1] = jumpForward(as, CC_E); // -0 is a double
+    toDouble[2] = unlessFitsInt(as);
+    STORE(as, RBX, -size + payload, RAX);
+    size_t done = jumpForward(as, ALWAYS);
+    for (int i = 0; i < 3; i++)
+      land(as, toDouble[i]);
+    loadNumber(as, 0, 0, checked, offset);
+    emit8(as, 0x66); // movq rax, xmm0
+    emit8(as, 0x48);
+    emit8(as, 0x0f);
+    emit8(as, 0x7e);
+    emit8(as, 0xc0);
+    emit8(as, 0x48); // btc rax, 63
+    emit8(as, 0x0f);
+    emit8(as, 0xba);
+    emit8(as, 0xf8);
+    emit8(as, 63);
+    STORE(as, RBX, -size + payload, RAX);
+    storeImmediate(as, RBX, -size + type, VAL_NUMBER);
+    land(as, done);
+    break;
+  }
+
+  case OP_GREATER:
+  case OP_LESS: {
+    size_t notInts[2];
+    notInts[0] = unlessType(as, 1, VAL_INT);
+    notInts[1] = unlessType(as, 0, VAL_INT);
+    LOAD(as, RAX, RBX, -2 * size + payload);
+    op(as, 0, true, 0, 0x3b, RAX, RBX, -size + payload); // cmp rax, b
+    emit8(as, 0x0f); // setg/setl al
+    emit8(as, 0x90 + (instruction == OP_GREATER ? CC_G : CC_L));
+    emit8(as, 0xc0);
+    size_t done = jumpForward(as, ALWAYS);
+    land(as, notInts[0]);
+    land(as, notInts[1]);
+    loadNumber(as, 0, 1, checked, offset); // a
+    loadNumber(as, 1, 0, checked, offset); // b
+    // ucomisd, "above" is false when either side is NaN just like in C
+    emit8(as, 0x66);
+    emit8(as, 0x0f);
+    emit8(as, 0x2e);
+    emit8(as, instruction == OP_GREATER ? 0xc1 : 0xc8);
+    emit8(as, 0x0f); // seta al
+    emit8(as, 0x90 + CC_A);
+    emit8(as, 0xc0);
+    land(as, done);
+    storeBool(as, 1);
+    adjustStack(as, -size);
+    break;
+  }
+
+  case OP_NOT:
+    emitFalsey(as);
+    storeBool(as, 0);
+    break;
+
+  case OP_EQUAL:
+    callHelper(as, jitEqual, next);
+    break;
+
+  case OP_PRINT:
+    callHelper(as, jitPrint, next);
+    break;
+
+  case OP_DEFINE_GLOBAL:
+    moveImmediate64(as, RDI, (uint64_t)(uintptr_t)globalName(as, offset));
+    callHelper(as, jitDefineGlobal, next);
+    break;
+
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL: {
+    // go straight to the entry the last lookup found, if it is still valid
+    EntryCache *cache = &as->jit->globals[as->globalCount++];
+    moveImmediate64(as, RDI, (uint64_t)(uintptr_t)globalName(as, offset));
+    moveImmediate64(as, RSI, (uint64_t)(uintptr_t)cache);
+    LOAD(as, RAX, R15, offsetof(VM, globals) + offsetof(Table, entries));
+    op(as, 0, true, 0, 0x3b, RAX, RSI, offsetof(EntryCache, entries)); // cmp
+    jumpIf(as, CC_NE, FIX_SLOW, offset);
+    LOAD(as, RAX, RSI, offsetof(EntryCache, entry));
+    op(as, 0, true, 0, 0x3b, RDI, RAX, offsetof(Entry, key)); // cmp
+    jumpIf(as, CC_NE, FIX_SLOW, offset);
+    if (instruction == OP_GET_GLOBAL) {
+      copyValue(as, RBX, 0, RAX, offsetof(Entry, value));
+      adjustStack(as, size);
+    } else {
+      copyValue(as, RAX, offsetof(Entry, value), RBX, -size);
+    }
+    break;
+  }
+
+  case OP_JUMP_IF_FALSE:
+    emitFalsey(as);
+    emit8(as, 0x84); // test al, al
+    emit8(as, 0xc0);
+    jumpIf(as, CC_NE, FIX_JUMP, next + (code[1] << 8 | code[2]));
+    break;
+
+  case OP_JUMP:
+    emit8(as, 0xe9);
+    addFixup(as, FIX_JUMP, next + (code[1] << 8 | code[2]));
+    break;
+
+  case OP_LOOP: {
+    int target = next - (code[1] << 8 | code[2]);
+    op(as, 0, true, 0, 0xff, 1, R15, offsetof(VM, fuel)); // dec qword
+    jumpIf(as, CC_LE, FIX_REFUEL, offset);
+    emit8(as, 0xe9);
+    addFixup(as, FIX_JUMP, target);
+    break;
+  }
+
+  case OP_CALL: {
+    // Compiled functions call each other directly. Everything else, and any
+    // call that would fail, goes through runCall() instead.
+    int32_t callee = -(code[1] + 1) * size;
+    op(as, 0, false, 0, 0x83, 7, RBX, callee + type); // cmp dword, imm8
+    emit8(as, VAL_OBJ);
+    jumpIf(as, CC_NE, FIX_SLOW, offset);
+    LOAD(as, RDI, RBX, callee + payload);
+    callCompiled(as, code[1], next, offset);
+    break;
+  }
+
+  case OP_GUARD_CALLEE: {
+    // the inlined body is for one function only, anything else gets called
+    int32_t callee = -(code[1] + 1) * size;
+    int target = next + (code[3] << 8 | code[4]);
+    Value function = as->function->chunk.constants.values[code[2]];
+    op(as, 0, false, 0, 0x83, 7, RBX, callee + type); // cmp dword, imm8
+    emit8(as, VAL_OBJ);
+    jumpIf(as, CC_NE, FIX_JUMP, target);
+    moveImmediate64(as, RAX, (uint64_t)(uintptr_t)AS_OBJ(function));
+    op(as, 0, true, 0, 0x3b, RAX, RBX, callee + payload); // cmp
+    jumpIf(as, CC_NE, FIX_JUMP, target);
+    break;
+  }
+
+  case OP_INVOKE: {
+    // A method in the first way of the cache, still current for the class,
+    // is called directly if it is compiled. Everything else is runInvoke().
+    const int32_t entry = offsetof(PropertyCache, entries);
+    checkShape(as, code[2], offset);
+    op(as, 0, false, 0, 0x83, 7, RSI, entry + offsetof(CacheEntry, slot));
+    emit8(as, 0xff); // cmp dword, -1
+    jumpIf(as, CC_NE, FIX_SLOW, offset);
+    LOAD(as, RCX, RAX, offsetof(ObjInstance, klass));
+    op(as, 0, false, 0, 0x8b, RCX, RCX, offsetof(ObjClass, version)); // mov
+    op(as, 0, false, 0, 0x3b, RCX, RSI, entry + offsetof(CacheEntry, version));
+    jumpIf(as, CC_NE, FIX_SLOW, offset);
+    LOAD(as, RDI, RSI,
+         entry + offsetof(CacheEntry, method) + offsetof(Value, as));
+    callCompiled(as, code[2], next, offset);
+    break;
+  }
+
+  case OP_SUPER_INVOKE:
+    moveImmediate64(as, RDI, (uint64_t)(uintptr_t)globalName(as, offset));
+    moveImmediate32(as, RSI, code[2]);
+    moveImmediate64(as, RDX, (uint64_t)(uintptr_t)propertyCache(as, offset));
+    callHelper(as, runSuperInvoke, next);
+    exitOnError(as);
+    break;
+
+  case OP_BUILD_LIST:
+    moveImmediate32(as, RDI, code[1]);
+    callHelper(as, buildList, next);
+    break;
+
+  case OP_GET_INDEX:
+  case OP_SET_INDEX: {
+    // a list and an integer index in range, anything else is up to getIndex()
+    // and setIndex()
+    int distance = instruction == OP_GET_INDEX ? 1 : 2;
+    indexList(as, distance, offset);
+    if (instruction == OP_GET_INDEX) {
+      copyValue(as, RBX, slot(1), RAX, 0);
+      adjustStack(as, -size);
+    } else {
+      copyValue(as, RAX, 0, RBX, slot(0));
+      copyValue(as, RBX, slot(2), RBX, slot(0));
+      adjustStack(as, -2 * size);
+    }
+    break;
+  }
+
+  case OP_CLOSURE:
+    op(as, 0, true, 0, 0x8d, RDI, R13, 0); // lea rdi, [r13]
+    moveImmediate64(as, RSI, (uint64_t)(uintptr_t)AS_FUNCTION(
+                                 as->function->chunk.constants.values[code[1]]));
+    callHelper(as, pushClosure, next);
+    break;
+
+  case OP_GET_UPVALUE:
+  case OP_GET_BOXED:
+  case OP_SET_BOXED: {
+    int32_t upvalue = offsetof(ObjClosure, upvalues) + code[1] * size;
+    LOAD(as, RAX, R13, offsetof(CallFrame, closure));
+    if (instruction == OP_GET_UPVALUE) {
+      copyValue(as, RBX, 0, RAX, upvalue);
+      adjustStack(as, size);
+      break;
+    }
+    LOAD(as, RAX, RAX, upvalue + payload);
+    LOAD(as, RAX, RAX, offsetof(ObjUpvalue, location));
+    if (instruction == OP_GET_BOXED) {
+      copyValue(as, RBX, 0, RAX, 0);
+      adjustStack(as, size);
+    } else {
+      copyValue(as, RAX, 0, RBX, -size);
+    }
+    break;
+  }
+
+  case OP_CLASS:
+  case OP_METHOD:
+    moveImmediate64(as, RDI, (uint64_t)(uintptr_t)globalName(as, offset));
+    callHelper(as, instruction == OP_CLASS ? pushClass : defineMethod, next);
+    break;
+
+  case OP_INHERIT:
+    callHelper(as, inherit, next);
+    exitOnError(as);
+    break;
+
+  case OP_GET_SUPER:
+    moveImmediate64(as, RDI, (uint64_t)(uintptr_t)globalName(as, offset));
+    callHelper(as, getSuper, next);
+    exitOnError(as);
+    break;
+
+  case OP_GET_PROPERTY: {
+    // a field of an instance shaped like the one in the first way of the
+    // cache, methods and everything else are up to getProperty()
+    const int32_t entry = offsetof(PropertyCache, entries);
+    checkShape(as, 0, offset);
+    op(as, 0, true, 0, 0x63, RCX, RSI, entry + offsetof(CacheEntry, slot));
+    emit8(as, 0x48); // test rcx, rcx
+    emit8(as, 0x85);
+    emit8(as, 0xc9);
+    jumpIf(as, CC_S, FIX_SLOW, offset);
+    fieldAddress(as);
+    copyValue(as, RBX, slot(0), RAX, 0);
+    break;
+  }
+
+  case OP_SET_PROPERTY: {
+    // a field the instance has, or a new one it has room for
+    const int32_t entry = offsetof(PropertyCache, entries);
+    checkShape(as, 1, offset);
+    LOAD(as, RDX, RSI, entry + offsetof(CacheEntry, after));
+    emit8(as, 0x48); // cmp rcx, rdx
+    emit8(as, 0x39);
+    emit8(as, 0xd1);
+    size_t same = jumpForward(as, CC_E);
+    op(as, 0, false, 0, 0x8b, RCX, RDX, offsetof(ObjShape, count)); // mov ecx
+    op(as, 0, false, 0, 0x3b, RCX, RAX, offsetof(ObjInstance, capacity));
+    jumpIf(as, CC_G, FIX_SLOW, offset);
+    STORE(as, RAX, offsetof(ObjInstance, shape), RDX);
+    land(as, same);
+    op(as, 0, true, 0, 0x63, RCX, RSI, entry + offsetof(CacheEntry, slot));
+    fieldAddress(as);
+    copyValue(as, RAX, 0, RBX, slot(0));
+    copyValue(as, RBX, slot(1), RBX, slot(0));
+    adjustStack(as, -size);
+    break;
+  }
+
+  case OP_CLOSE_UPVALUES:
+    op(as, 0, true, 0, 0x8d, RDI, R12, code[1] * size); // lea
+    callHelper(as, closeUpvalues, next);
+    break;
+
+  case OP_RETURN_CLOSING:
+    op(as, 0, true, 0, 0x8d, RDI, R12, 0); // lea rdi, [r12]
+    callHelper(as, closeUpvalues, next);
+    // fall through
+  case OP_RETURN:
+    // the result replaces the callee, just like the interpreter does it
+    copyValue(as, R12, 0, RBX, -size);
+    op(as, 0, true, 0, 0x8d, RBX, R12, size); // lea rbx, [r12 + 16]
+    op(as, 0, false, 0, 0xff, 1, R15, offsetof(VM, frameCount)); // dec dword
+    moveImmediate32(as, RAX, (uint32_t)JIT_RETURNED);
+    jumpTo(as, as->epilogue);
+    break;
+
+  default:
+    return false;
+  }
+  return true;
+}
+
+// carry on with the instruction after the one at offset
+static void jumpNext(Assembler *as, int offset) {
+  int next = offset + instructionLength(*bytecodeAt(as, offset));
+  jumpTo(as, as->offsets[next]);
+}
+
+// the out of line paths, only taken when something unusual happens
+static void emitStub(Assembler *as, Fixup *fixup) {
+  uint8_t *code = bytecodeAt(as, fixup->offset);
+  int next = fixup->offset + instructionLength(code[0]);
+
+  switch (fixup->kind) {
+  case FIX_DEOPT:
+    storeIp(as, fixup->offset);
+    moveImmediate32(as, RAX, (uint32_t)JIT_DEOPT);
+    jumpTo(as, as->epilogue);
+    break;
+
+  case FIX_REFUEL: {
+    // the ip stays on the loop, for an error out of fuel
+    int target = fixup->offset + 3 - (code[1] << 8 | code[2]);
+    callHelper(as, refuel, fixup->offset + 3);
+    emit8(as, 0x84); // test al, al
+    emit8(as, 0xc0);
+    emit8(as, 0x0f);
+    emit8(as, 0x85); // jnz target
+    emit32(as, (uint32_t)(as->offsets[target] - (as->count + 4)));
+    moveImmediate32(as, RAX, INTERPRET_INTERRUPTED);
+    jumpTo(as, as->epilogue);
+    break;
+  }
+
+  case FIX_SLOW_REFUEL:
+    // give back the tick, runCall() takes it again
+    op(as, 0, true, 0, 0xff, 0, R15, offsetof(VM, fuel)); // inc qword
+    // fall through
+  case FIX_SLOW:
+    if (code[0] == OP_CALL) {
+      // the callee runs to completion, in compiled code if it is hot too
+      moveImmediate32(as, RDI, code[1]);
+      moveImmediate64(as, RSI,
+                      (uint64_t)(uintptr_t)callCache(as, fixup->offset));
+      callHelper(as, runCall, next);
+      exitOnError(as);
+    } else if (code[0] == OP_GET_INDEX || code[0] == OP_SET_INDEX) {
+      callHelper(as, code[0] == OP_GET_INDEX ? getIndex : setIndex, next);
+      exitOnError(as);
+    } else if (code[0] == OP_GET_PROPERTY || code[0] == OP_SET_PROPERTY) {
+      moveImmediate64(as, RDI,
+                      (uint64_t)(uintptr_t)globalName(as, fixup->offset));
+      moveImmediate64(as, RSI, (uint64_t)(uintptr_t)propertyCache(
+                                   as, fixup->offset));
+      callHelper(as, code[0] == OP_GET_PROPERTY ? getProperty : setProperty,
+                 next);
+      exitOnError(as);
+    } else if (code[0] == OP_INVOKE) {
+      // the method runs to completion, like a call
+      moveImmediate64(as, RDI,
+                      (uint64_t)(uintptr_t)globalName(as, fixup->offset));
+      moveImmediate32(as, RSI, code[2]);
+      moveImmediate64(as, RDX, (uint64_t)(uintptr_t)propertyCache(
+                                   as, fixup->offset));
+      callHelper(as, runInvoke, next);
+      exitOnError(as);
+    } else {
+      // rdi and rsi still hold the name and the cache
+      callHelper(as, code[0] == OP_GET_GLOBAL ? jitGetGlobal : jitSetGlobal,
+                 next);
+      emit8(as, 0x84); // test al, al
+      emit8(as, 0xc0);
+      jumpIf(as, CC_E, FIX_DEOPT, fixup->offset);
+    }
+    jumpNext(as, fixup->offset);
+    break;
+
+  case FIX_RESUME:
+    // the stack top in rbx is out of date, the callee has moved it
+    LOAD(as, RBX, R15, offsetof(VM, stackTop));
+    emit8(as, 0x83); // cmp eax, JIT_DEOPT
+    emit8(as, 0xf8);
+    emit8(as, (uint8_t)JIT_DEOPT);
+    emit8(as, 0x0f);
+    emit8(as, 0x85); // jne epilogue, the status is an error
+    emit32(as, (uint32_t)(as->epilogue - (as->count + 4)));
+    moveImmediate64(as, RAX, (uint64_t)(uintptr_t)jitResume);
+    emit8(as, 0xff); // call rax
+    emit8(as, 0xd0);
+    LOAD(as, RBX, R15, offsetof(VM, stackTop));
+    exitOnError(as);
+    jumpNext(as, fixup->offset);
+    break;
+
+  case FIX_JUMP:
+    break;
+  }
+}
+
+static void emitPrologue(Assembler *as) {
+  emit8(as, 0x53); // push rbx
+  emit8(as, 0x41); // push r12..r15
+  emit8(as, 0x54);
+  emit8(as, 0x41);
+  emit8(as, 0x55);
+  emit8(as, 0x41);
+  emit8(as, 0x56);
+  emit8(as, 0x41);
+  emit8(as, 0x57);
+  emit8(as, 0x49); // mov r13, rdi
+  emit8(as, 0x89);
+  emit8(as, 0xfd);
+  emit8(as, 0x49); // mov r15, rsi
+  emit8(as, 0x89);
+  emit8(as, 0xf7);
+  LOAD(as, R12, R13, offsetof(CallFrame, slots));
+  LOAD(as, RBX, R15, offsetof(VM, stackTop));
+  LOAD(as, RAX, R13, offsetof(CallFrame, function));
+  LOAD(as, R14, RAX,
+       offsetof(ObjFunction, chunk) + offsetof(Chunk, constants) +
+           offsetof(ValueArray, values));
+  emit8(as, 0xff); // jmp rdx, wherever the frame is at
+  emit8(as, 0xe2);
+
+  as->epilogue = as->count;
+  STORE(as, R15, offsetof(VM, stackTop), RBX);
+  emit8(as, 0x41); // pop r15..r12
+  emit8(as, 0x5f);
+  emit8(as, 0x41);
+  emit8(as, 0x5e);
+  emit8(as, 0x41);
+  emit8(as, 0x5d);
+  emit8(as, 0x41);
+  emit8(as, 0x5c);
+  emit8(as, 0x5b); // pop rbx
+  emit8(as, 0xc3); // ret
+}
+
+static void freeAssembler(Assembler *as) {
+  FREE_ARRAY(uint8_t, as->code, as->capacity);
+  FREE_ARRAY(Fixup, as->fixups, as->fixupCapacity);
+}
+
+static void freeJitCode(JitCode *jit) {
+  if (jit == NULL)
+    return;
+  FREE_ARRAY(uint32_t, jit->offsets, jit->offsetCount + 1);
+  FREE_ARRAY(EntryCache, jit->globals, jit->globalCount + 1);
+  FREE(JitCode, jit);
+}
+
+// Out here rather than on the stack, so it still holds what was allocated
+// when running out of heap jumps back into jitCompile().
+static _Thread_local Assembler assembler;
+
+bool jitCompile(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  Assembler *as = &assembler;
+  *as = (Assembler){0};
+  as->function = function;
+
+  // running out of heap lets go of what was assembled so far, and carries on
+  // to the handler the error was meant for
+  jmp_buf handler;
+  jmp_buf *enclosing = vm->errorHandler;
+  if (enclosing != NULL) {
+    vm->errorHandler = &handler;
+    if (setjmp(handler) != 0) {
+      vm->errorHandler = enclosing;
+      freeJitCode(as->jit);
+      freeAssembler(as);
+      longjmp(*enclosing, 1);
+    }
+  }
+
+  // the tables are on the Lox heap, the machine code is mapped on its own
+  int globalCount = 0;
+  for (int i = 0; i < chunk->count; i++) {
+    if (chunk->code[i] == OP_GET_GLOBAL || chunk->code[i] == OP_SET_GLOBAL)
+      globalCount++; // operands can match too, which only wastes a little
+  }
+  as->jit = ALLOCATE(JitCode, 1);
+  memset(as->jit, 0, sizeof(JitCode));
+  as->jit->offsetCount = -1; // nothing to free yet
+  as->jit->globalCount = -1;
+  as->offsets = ALLOCATE(uint32_t, chunk->count + 1);
+  memset(as->offsets, 0, sizeof(uint32_t) * (chunk->count + 1));
+  as->jit->offsets = as->offsets;
+  as->jit->offsetCount = chunk->count;
+  as->jit->globals = ALLOCATE(EntryCache, globalCount + 1);
+  memset(as->jit->globals, 0, sizeof(EntryCache) * (globalCount + 1));
+  as->jit->globalCount = globalCount;
+
+  bool compiled = true;
+  emitPrologue(as);
+  for (int offset = 0; offset < chunk->count && compiled;) {
+    int length = instructionLength(chunk->code[offset]);
+    as->offsets[offset] = (uint32_t)as->count;
+    compiled = jitSupports(chunk->code[offset]) &&
+               offset + length <= chunk->count &&
+               compileInstruction(as, offset);
+    offset += length;
+  }
+
+  // stubs can add fixups of their own, which get handled further along
+  for (int i = 0; compiled && i < as->fixupCount; i++) {
+    Fixup fixup = as->fixups[i];
+    size_t target = as->count;
+    if (fixup.kind == FIX_JUMP) {
+      target = as->offsets[fixup.offset];
+    } else {
+      emitStub(as, &fixup);
+    }
+    patch32(as, fixup.at, (uint32_t)(target - (fixup.at + 4)));
+  }
+
+  uint8_t *memory = MAP_FAILED;
+  if (compiled) {
+    memory = mmap(NULL, as->count, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  vm->errorHandler = enclosing;
+  if (memory == MAP_FAILED) {
+    freeJitCode(as->jit);
+    freeAssembler(as);
+    return false;
+  }
+  memcpy(memory, as->code, as->count);
+  mprotect(memory, as->count, PROT_READ | PROT_EXEC);
+
+  as->jit->code = memory;
+  as->jit->size = as->count;
+  function->jit = as->jit;
+  freeAssembler(as);
+  return true;
+}
+
+void jitFree(ObjFunction *function) {
+  JitCode *jit = function->jit;
+  if (jit == NULL)
+    return;
+  munmap(jit->code, jit->size);
+  freeJitCode(jit);
+  function->jit = NULL;
+}
+
+typedef int (*JitEntry)(CallFrame *frame, VM *machine, void *target);
+
+// run the frame's function from wherever its ip is
+int jitExecute(CallFrame *frame) {
+  ObjFunction *function = frame->function;
+  JitCode *jit = function->jit;
+  void *target = jit->code + jit->offsets[frame->ip - function->chunk.code];
+
+  int status = ((JitEntry)(void *)jit->code)(frame, vm, target);
+  if (status == JIT_DEOPT)
+    noteDeopt(function);
+  return status;
+}
+
+#endif
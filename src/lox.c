@@ -0,0 +1,111 @@
+/*
+ * The embedding interface. Every entry point switches the current VM to the
+ * one it was handed, and then defers to the same functions the command line
+ * interpreter uses.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/compiler.h"
+#include "../include/lox.h"
+#include "../include/table.h"
+
+LoxVM *loxNewVM() {
+  LoxVM *lox = (LoxVM *)malloc(sizeof(LoxVM));
+  if (lox == NULL)
+    return NULL;
+
+  initVM(lox);
+  lox->printErrors = false;
+  return lox;
+}
+
+void loxFreeVM(LoxVM *lox) {
+  freeVM(lox);
+  free(lox);
+  vm = NULL;
+}
+
+ObjFunction *loxCompile(LoxVM *lox, const char *source) {
+  vm = lox;
+  vm->error[0] = '\0';
+  return compile(source);
+}
+
+InterpretResult loxRun(LoxVM *lox, ObjFunction *script) {
+  vm = lox;
+  return runFunction(script);
+}
+
+InterpretResult loxInterpret(LoxVM *lox, const char *source) {
+  vm = lox;
+  return interpret(source);
+}
+
+InterpretResult loxCall(LoxVM *lox, Value callee, int argCount, Value *args,
+                        Value *result) {
+  vm = lox;
+  return callFunction(callee, argCount, args, result);
+}
+
+InterpretResult loxCallGlobal(LoxVM *lox, const char *name, int argCount,
+                              Value *args, Value *result) {
+  Value callee;
+  if (!loxGetGlobal(lox, name, &callee)) {
+    lox->error[0] = '\0';
+    reportError("Undefined variable '%s'.\n", name);
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  return callFunction(callee, argCount, args, result);
+}
+
+void loxDefineNative(LoxVM *lox, const char *name, NativeFn function,
+                     int arity, void *userdata) {
+  vm = lox;
+  defineNative(name, function, arity, userdata);
+}
+
+bool loxGetGlobal(LoxVM *lox, const char *name, Value *value) {
+  vm = lox;
+  ObjString *key = copyString(name, (int)strlen(name));
+  return tableGet(&vm->globals, key, value);
+}
+
+void loxSetGlobal(LoxVM *lox, const char *name, Value value) {
+  vm = lox;
+  push(value);
+  ObjString *key = copyString(name, (int)strlen(name));
+  tableSet(&vm->globals, key, value);
+  pop();
+}
+
+Value loxString(LoxVM *lox, const char *chars, int length) {
+  vm = lox;
+  return OBJ_VAL(copyString(chars, length));
+}
+
+const char *loxError(LoxVM *lox) { return lox->error; }
+
+void loxPrintErrors(LoxVM *lox, bool enabled) { lox->printErrors = enabled; }
+
+void loxSetOutput(LoxVM *lox, FILE *out) {
+  flushOutput(&lox->output);
+  lox->output.file = out;
+}
+
+void loxSetHeapLimit(LoxVM *lox, size_t bytes) { lox->heapLimit = bytes; }
+
+size_t loxHeapUsed(LoxVM *lox) { return lox->bytesAllocated; }
+
+void loxSetBudget(LoxVM *lox, long ticks) { lox->budget = ticks; }
+
+void loxSetLazyCompile(LoxVM *lox, bool enabled) { lox->lazyCompile = enabled; }
+
+void loxSetTimeout(LoxVM *lox, long milliseconds) {
+  lox->timeout = milliseconds;
+}
+
+// the next fuel check notices the flag, which is at most FUEL_SLICE loops and
+// calls away
+void loxInterrupt(LoxVM *lox) { atomic_store(&lox->interruptRequested, true); }
@@ -1,11 +1,17 @@
 #include "../include/common.h"
+#include "../include/aot.h"
 #include "../include/chunk.h"
+#include "../include/compiler.h"
 #include "../include/debug.h"
 #include "../include/vm.h"
 
+#include <dirent.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <unistd.h>
 
 
 // our repl, which takes user input line by line
@@ -25,13 +31,13 @@ static void repl() {
 
 
 
-static char* readFile(const char* path) {
+// read a whole file into a new buffer, NULL if that isn't possible
+static char* loadFile(const char* path) {
 
 	// open the file
 	FILE* file = fopen(path, "rb");
 	if (file == NULL) {
-		fprintf(stderr, "Could not open file \"%s\".\n", path);
-		exit(74);
+		return NULL;
 	}
 	
 	// find file size
@@ -42,19 +48,29 @@ static char* readFile(const char* path) {
 	// allocate buffer
 	char* buffer = (char*)malloc(fileSize + 1);
 	if (buffer == NULL) {
-		fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-		exit(74);
+		fclose(file);
+		return NULL;
 	}
 	
 	// read the file into the buffer
 	size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+	fclose(file);
 	if (bytesRead < fileSize) {
-		fprintf(stderr, "Could not read file \"%s\".\n", path);
-		exit(74);
+		free(buffer);
+		return NULL;
 	}
 	buffer[bytesRead] = '\0';
 
-	fclose(file);
+	return buffer;
+}
+
+
+static char* readFile(const char* path) {
+	char* buffer = loadFile(path);
+	if (buffer == NULL) {
+		fprintf(stderr, "Could not read file \"%s\".\n", path);
+		exit(74);
+	}
 	return buffer;
 }
 
@@ -66,27 +82,322 @@ static void runFile(const char* path) {
 
 	if (result == INTERPRET_COMPILE_ERROR) exit(65);
 	if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+	if (result == INTERPRET_INTERRUPTED) exit(75);
+}
+
+// compile a script and write it out as a C program instead of running it
+static void translateFile(const char* path, const char* output) {
+	char* source = readFile(path);
+	// every function has to be there to be translated
+	vm->lazyCompile = false;
+	ObjFunction* function = compile(source);
+	free(source);
+	if (function == NULL) exit(65);
+
+	FILE* file = fopen(output, "w");
+	if (file == NULL) {
+		fprintf(stderr, "Could not open file \"%s\".\n", output);
+		exit(74);
+	}
+	translateToC(function, path, file);
+	fclose(file);
 }
 
 
 
+// --------------------------------------------------------------------------
+// Batch mode runs many independent scripts on a pool of threads. Every worker
+// owns one VM, which is reset between scripts so no globals leak from one
+// script to the next. Output is captured per script and printed in order once
+// everything has finished.
+
+typedef struct {
+	char* path;
+	char* output;     // everything the script printed
+	size_t outputLength;
+	char* error;      // compile or runtime error messages
+	InterpretResult result;
+	bool unreadable;
+	double seconds;
+} BatchScript;
+
+// limits from the command line, applied to every VM we create
+typedef struct {
+	size_t heapLimit;
+	long budget;
+	long timeout;
+	bool lazy; // not a limit, but it goes to every VM the same way
+} Limits;
+
+static void applyLimits(VM* machine, Limits* limits) {
+	machine->heapLimit = limits->heapLimit;
+	machine->budget = limits->budget;
+	machine->timeout = limits->timeout;
+	machine->lazyCompile = limits->lazy;
+}
+
+typedef struct {
+	BatchScript* scripts;
+	int count;
+	int next; // next script to hand out, shared by all workers
+	pthread_mutex_t lock;
+	Limits limits;
+} Batch;
+
+static double now() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void addScript(BatchScript** scripts, int* count, int* capacity,
+		const char* path) {
+	if (*count == *capacity) {
+		*capacity = *capacity < 8 ? 8 : *capacity * 2;
+		*scripts = realloc(*scripts, sizeof(BatchScript) * *capacity);
+		if (*scripts == NULL) {
+			fprintf(stderr, "Not enough memory for the batch.\n");
+			exit(74);
+		}
+	}
+
+	BatchScript* script = &(*scripts)[(*count)++];
+	memset(script, 0, sizeof(BatchScript));
+	script->path = strdup(path);
+}
+
+static int comparePaths(const void* a, const void* b) {
+	return strcmp(((const BatchScript*)a)->path, ((const BatchScript*)b)->path);
+}
+
+// a directory contributes every .lox file in it, anything else is a manifest
+// with one script path per line. Blank lines and lines starting with # are
+// skipped.
+static BatchScript* collectScripts(const char* source, int* count) {
+	BatchScript* scripts = NULL;
+	int capacity = 0;
+	*count = 0;
+
+	DIR* dir = opendir(source);
+	if (dir != NULL) {
+		struct dirent* entry;
+		while ((entry = readdir(dir)) != NULL) {
+			size_t length = strlen(entry->d_name);
+			if (length < 5 || strcmp(entry->d_name + length - 4, ".lox") != 0) {
+				continue;
+			}
+
+			char path[4096];
+			snprintf(path, sizeof(path), "%s/%s", source, entry->d_name);
+			addScript(&scripts, count, &capacity, path);
+		}
+		closedir(dir);
+		qsort(scripts, *count, sizeof(BatchScript), comparePaths);
+		return scripts;
+	}
+
+	char* manifest = readFile(source);
+	for (char* line = strtok(manifest, "\r\n"); line != NULL;
+			line = strtok(NULL, "\r\n")) {
+		while (*line == ' ' || *line == '\t') line++;
+		if (*line == '\0' || *line == '#') continue;
+		addScript(&scripts, count, &capacity, line);
+	}
+	free(manifest);
+	return scripts;
+}
+
+static void runBatchScript(VM* machine, BatchScript* script, Batch* batch) {
+	double start = now();
+	char* source = loadFile(script->path);
+	if (source == NULL) {
+		script->unreadable = true;
+		script->result = INTERPRET_RUNTIME_ERROR;
+		script->seconds = now() - start;
+		return;
+	}
+
+	initVM(machine);
+	machine->printErrors = false;
+	applyLimits(machine, &batch->limits);
+	machine->output.file =
+			open_memstream(&script->output, &script->outputLength);
+
+	script->result = interpret(source);
+
+	fclose(machine->output.file);
+	if (machine->error[0] != '\0') {
+		script->error = strdup(machine->error);
+	}
+	freeVM(machine);
+	free(source);
+	script->seconds = now() - start;
+}
+
+static void* batchWorker(void* argument) {
+	Batch* batch = (Batch*)argument;
+	VM* machine = malloc(sizeof(VM));
+	if (machine == NULL) {
+		fprintf(stderr, "Not enough memory for a worker VM.\n");
+		return NULL;
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&batch->lock);
+		int index = batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+		if (index >= batch->count) break;
+
+		runBatchScript(machine, &batch->scripts[index], batch);
+	}
+
+	free(machine);
+	return NULL;
+}
+
+static int runBatch(const char* source, int jobs, Limits limits) {
+	Batch batch;
+	batch.scripts = collectScripts(source, &batch.count);
+	batch.next = 0;
+	batch.limits = limits;
+	pthread_mutex_init(&batch.lock, NULL);
+
+	if (jobs <= 0) {
+		jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (jobs <= 0) jobs = 1;
+	}
+	if (jobs > batch.count && batch.count > 0) jobs = batch.count;
+
+	double start = now();
+	pthread_t* workers = malloc(sizeof(pthread_t) * jobs);
+	for (int i = 0; i < jobs; i++) {
+		if (pthread_create(&workers[i], NULL, batchWorker, &batch) != 0) {
+			fprintf(stderr, "Could not start worker thread.\n");
+			exit(71);
+		}
+	}
+	for (int i = 0; i < jobs; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	double elapsed = now() - start;
+	free(workers);
+	pthread_mutex_destroy(&batch.lock);
+
+	// report each script in the order they were given
+	int failed = 0;
+	for (int i = 0; i < batch.count; i++) {
+		BatchScript* script = &batch.scripts[i];
+		const char* status = "ok";
+		if (script->unreadable) {
+			status = "unreadable";
+		} else if (script->result == INTERPRET_COMPILE_ERROR) {
+			status = "compile error";
+		} else if (script->result == INTERPRET_RUNTIME_ERROR) {
+			status = "runtime error";
+		} else if (script->result == INTERPRET_INTERRUPTED) {
+			status = "interrupted";
+		}
+		if (script->unreadable || script->result != INTERPRET_OK) failed++;
+
+		printf("== %s (%s, %.3f ms) ==\n", script->path, status,
+				script->seconds * 1000);
+		if (script->output != NULL) {
+			fwrite(script->output, 1, script->outputLength, stdout);
+		}
+		if (script->error != NULL) {
+			fputs(script->error, stdout);
+		}
+
+		free(script->path);
+		free(script->output);
+		free(script->error);
+	}
+
+	fprintf(stderr, "batch: %d scripts, %d failed, %d threads, %.3f s, "
+			"%.1f scripts/s\n", batch.count, failed, jobs, elapsed,
+			elapsed > 0 ? batch.count / elapsed : 0.0);
+	free(batch.scripts);
+	return failed == 0 ? 0 : 70;
+}
+
+
+
+static void usage() {
+	fprintf(stderr, "Usage: clox [options] [path]\n"
+			"       clox [options] --batch <manifest|directory> [--jobs n]\n"
+			"       clox --emit-c <output.c> <path>\n"
+			"Options:\n"
+			"  --heap-limit <bytes>  cap each VM's heap, k, m and g suffixes "
+			"work\n"
+			"  --budget <n>          stop after n loop iterations and calls\n"
+			"  --timeout <ms>        stop after this much wall clock time\n"
+			"  --lazy                compile functions when they are first "
+			"called\n");
+	exit(64);
+}
+
+// a number of bytes with an optional k, m or g suffix
+static size_t parseSize(const char* text) {
+	char* end;
+	double size = strtod(text, &end);
+	switch (*end) {
+		case 'k': case 'K': size *= 1024; end++; break;
+		case 'm': case 'M': size *= 1024 * 1024; end++; break;
+		case 'g': case 'G': size *= 1024 * 1024 * 1024; end++; break;
+	}
+	if (end == text || *end != '\0' || size < 1) usage();
+	return (size_t)size;
+}
+
 int main(int argc, const char* argv[]) {
-	initVM();
+	const char* path = NULL;
+	const char* batch = NULL;
+	const char* emit = NULL;
+	int jobs = 0;
+	Limits limits = {0, 0, 0, false};
+
+	for (int i = 1; i < argc; i++) {
+		bool hasValue = i + 1 < argc;
+		if (strcmp(argv[i], "--batch") == 0 && hasValue) {
+			batch = argv[++i];
+		} else if (strcmp(argv[i], "--emit-c") == 0 && hasValue) {
+			emit = argv[++i];
+		} else if (strcmp(argv[i], "--jobs") == 0 && hasValue) {
+			jobs = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--heap-limit") == 0 && hasValue) {
+			limits.heapLimit = parseSize(argv[++i]);
+		} else if (strcmp(argv[i], "--budget") == 0 && hasValue) {
+			limits.budget = atol(argv[++i]);
+		} else if (strcmp(argv[i], "--timeout") == 0 && hasValue) {
+			limits.timeout = atol(argv[++i]);
+		} else if (strcmp(argv[i], "--lazy") == 0) {
+			limits.lazy = true;
+		} else if (argv[i][0] != '-' && path == NULL) {
+			path = argv[i];
+		} else {
+			usage();
+		}
+	}
+
+	if (batch != NULL) {
+		if (path != NULL) usage();
+		return runBatch(batch, jobs, limits);
+	}
+
+	static VM machine;
+	initVM(&machine);
+	applyLimits(&machine, &limits);
 
-	if (argc == 1) {
+	if (emit != NULL) {
+		if (path == NULL) usage();
+		translateFile(path, emit);
+	} else if (path == NULL) {
 		repl();
 	} 
-	else if (argc == 2) {
-		runFile(argv[1]);
-	} 
 	else {
-		fprintf(stderr, "Usage: clox [path]\n");
-		exit(64);
+		runFile(path);
 	}
 
-	freeVM();
+	freeVM(&machine);
 	return 0;
 }
-
-
-
@@ -0,0 +1,156 @@
+#include <math.h>
+#include <string.h>
+
+#include "../include/map.h"
+#include "../include/memory.h"
+
+// The table has twice as many slots as there are entries, so it is never more
+// than half full. A deleted entry keeps its slot until the next time the
+// entries are packed, which saves probing past tombstones.
+
+// murmur3's finalizer, to spread out pointers and small integers
+static uint32_t mix(uint64_t bits) {
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdull;
+  bits ^= bits >> 33;
+  bits *= 0xc4ceb9fe1a85ec53ull;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+uint32_t hashValue(Value value) {
+  switch (value.type) {
+  case VAL_BOOL:
+    return AS_BOOL(value) ? 3 : 2;
+  case VAL_NIL:
+    return 1;
+  case VAL_INT:
+    return mix((uint64_t)AS_INT(value));
+  case VAL_NUMBER: {
+    // a whole double has to land where the same integer does
+    double number = AS_NUMBER(value);
+    if (fabs(number) <= 9007199254740992.0 &&
+        (double)(int64_t)number == number)
+      return mix((uint64_t)(int64_t)number);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return mix(bits);
+  }
+  case VAL_OBJ:
+    if (IS_STRING(value))
+      return AS_STRING(value)->hash;
+    return mix((uint64_t)(uintptr_t)AS_OBJ(value));
+  }
+  return 0; // Unreachable.
+}
+
+// the slot key is in, or the empty one where it would go
+static int32_t *findSlot(ObjMap *map, Value key, uint32_t hash) {
+  uint32_t mask = 2 * map->capacity - 1;
+  for (uint32_t index = hash & mask;; index = (index + 1) & mask) {
+    int32_t *slot = &map->slots[index];
+    if (*slot == -1)
+      return slot;
+    MapEntry *entry = &map->entries[*slot];
+    if (entry->hash == hash && valuesEqual(entry->key, key))
+      return slot;
+  }
+}
+
+// make room for one more entry, packing out the deleted ones on the way
+static void makeRoom(ObjMap *map) {
+  int capacity = map->capacity;
+  if (map->count >= map->used / 2 || capacity == 0)
+    capacity = GROW_CAPACITY(capacity);
+
+  int live = 0;
+  for (int i = 0; i < map->used; i++) {
+    if (!map->entries[i].deleted)
+      map->entries[live++] = map->entries[i];
+  }
+  map->used = live;
+
+  if (capacity != map->capacity) {
+    map->entries =
+        GROW_ARRAY(MapEntry, map->entries, map->capacity, capacity);
+    FREE_ARRAY(int32_t, map->slots, 2 * map->capacity);
+    map->slots = ALLOCATE(int32_t, 2 * capacity);
+    trackObject(OBJ_MAP,
+                (long)((sizeof(MapEntry) + 2 * sizeof(int32_t)) *
+                       (capacity - map->capacity)),
+                0);
+    map->capacity = capacity;
+  }
+
+  memset(map->slots, -1, sizeof(int32_t) * 2 * capacity);
+  for (int i = 0; i < map->used; i++)
+    *findSlot(map, map->entries[i].key, map->entries[i].hash) = i;
+}
+
+bool mapGet(ObjMap *map, Value key, Value *value) {
+  if (map->count == 0)
+    return false;
+
+  int32_t *slot = findSlot(map, key, hashValue(key));
+  if (*slot == -1 || map->entries[*slot].deleted)
+    return false;
+  *value = map->entries[*slot].value;
+  return true;
+}
+
+bool mapSet(ObjMap *map, Value key, Value value) {
+  uint32_t hash = hashValue(key);
+  if (map->capacity > 0) {
+    int32_t *slot = findSlot(map, key, hash);
+    if (*slot != -1) {
+      // a deleted key comes back where it was
+      MapEntry *entry = &map->entries[*slot];
+      bool isNewKey = entry->deleted;
+      if (isNewKey)
+        map->count++;
+      entry->deleted = false;
+      entry->value = value;
+      return isNewKey;
+    }
+  }
+
+  if (map->used == map->capacity)
+    makeRoom(map);
+
+  MapEntry *entry = &map->entries[map->used];
+  entry->key = key;
+  entry->value = value;
+  entry->hash = hash;
+  entry->deleted = false;
+  *findSlot(map, key, hash) = map->used++;
+  map->count++;
+  return true;
+}
+
+bool mapDelete(ObjMap *map, Value key) {
+  if (map->count == 0)
+    return false;
+
+  int32_t *slot = findSlot(map, key, hashValue(key));
+  if (*slot == -1 || map->entries[*slot].deleted)
+    return false;
+  MapEntry *entry = &map->entries[*slot];
+  entry->deleted = true;
+  entry->value = NIL_VAL;
+  map->count--;
+  return true;
+}
+
+int mapNext(ObjMap *map, int position) {
+  for (int i = position + 1; i < map->used; i++) {
+    if (!map->entries[i].deleted)
+      return i;
+  }
+  return -1;
+}
+
+int mapPosition(ObjMap *map, Value key) {
+  if (map->capacity == 0)
+    return -1;
+  return *findSlot(map, key, hashValue(key));
+}
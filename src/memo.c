@@ -0,0 +1,190 @@
+#include <string.h>
+
+#include "../include/map.h"
+#include "../include/memo.h"
+#include "../include/memory.h"
+
+// The entries live in one array that grows up to the limit, and once it is
+// full the oldest entry is handed over to the new result. Buckets chain the
+// entries with the same hash bits, and there are at least as many buckets as
+// entries. Entries, keys and buckets share one block of heap, so growing is a
+// single allocation that either happens or leaves the memo as it was.
+
+// the bytes of the block for this many entries
+static size_t blockSize(int capacity, int bucketCount, int arity) {
+  return sizeof(MemoEntry) * capacity + sizeof(Value) * capacity * arity +
+         sizeof(int32_t) * bucketCount;
+}
+
+Memo *newMemo(int limit) {
+  Memo *memo = ALLOCATE(Memo, 1);
+  memset(memo, 0, sizeof(Memo));
+  memo->limit = limit;
+  memo->newest = -1;
+  memo->oldest = -1;
+  return memo;
+}
+
+void freeMemo(Memo *memo, int arity) {
+  if (memo == NULL)
+    return;
+  if (memo->capacity > 0)
+    reallocate(memo->entries,
+               blockSize(memo->capacity, memo->bucketCount, arity), 0);
+  FREE(Memo, memo);
+}
+
+static uint32_t hashArguments(Value *args, int arity) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < arity; i++)
+    hash = (hash ^ hashValue(args[i])) * 16777619u;
+  return hash;
+}
+
+static bool sameArgument(Value a, Value b) {
+  if (IS_INT(a) && IS_INT(b))
+    return AS_INT(a) == AS_INT(b);
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+  }
+  return valuesEqual(a, b);
+}
+
+static int32_t findEntry(Memo *memo, Value *args, int arity, uint32_t hash) {
+  if (memo->count == 0)
+    return -1;
+  int32_t index = memo->buckets[hash & (memo->bucketCount - 1)];
+  for (; index != -1; index = memo->entries[index].chain) {
+    MemoEntry *entry = &memo->entries[index];
+    if (entry->hash != hash)
+      continue;
+    Value *keys = &memo->keys[index * arity];
+    int i = 0;
+    while (i < arity && sameArgument(keys[i], args[i]))
+      i++;
+    if (i == arity)
+      return index;
+  }
+  return -1;
+}
+
+static void unlinkUse(Memo *memo, int32_t index) {
+  MemoEntry *entry = &memo->entries[index];
+  if (entry->newer != -1)
+    memo->entries[entry->newer].older = entry->older;
+  else
+    memo->newest = entry->older;
+  if (entry->older != -1)
+    memo->entries[entry->older].newer = entry->newer;
+  else
+    memo->oldest = entry->newer;
+}
+
+static void linkNewest(Memo *memo, int32_t index) {
+  MemoEntry *entry = &memo->entries[index];
+  entry->newer = -1;
+  entry->older = memo->newest;
+  if (memo->newest != -1)
+    memo->entries[memo->newest].newer = index;
+  else
+    memo->oldest = index;
+  memo->newest = index;
+}
+
+static void unlinkBucket(Memo *memo, int32_t index) {
+  int32_t *link = &memo->buckets[memo->entries[index].hash &
+                                 (memo->bucketCount - 1)];
+  while (*link != index)
+    link = &memo->entries[*link].chain;
+  *link = memo->entries[index].chain;
+}
+
+static void linkBucket(Memo *memo, int32_t index) {
+  int32_t *bucket = &memo->buckets[memo->entries[index].hash &
+                                   (memo->bucketCount - 1)];
+  memo->entries[index].chain = *bucket;
+  *bucket = index;
+}
+
+// room for more entries, up to the limit, with the buckets to match
+static void grow(Memo *memo, int arity) {
+  int capacity = GROW_CAPACITY(memo->capacity);
+  if (capacity > memo->limit)
+    capacity = memo->limit;
+  int bucketCount = memo->bucketCount == 0 ? 8 : memo->bucketCount;
+  while (bucketCount < capacity)
+    bucketCount *= 2;
+
+  MemoEntry *entries = (MemoEntry *)reallocate(
+      NULL, 0, blockSize(capacity, bucketCount, arity));
+  Value *keys = (Value *)(entries + capacity);
+  int32_t *buckets = (int32_t *)(keys + capacity * arity);
+  if (memo->count > 0) {
+    memcpy(entries, memo->entries, sizeof(MemoEntry) * memo->count);
+    if (arity > 0)
+      memcpy(keys, memo->keys, sizeof(Value) * memo->count * arity);
+  }
+  if (memo->capacity > 0)
+    reallocate(memo->entries,
+               blockSize(memo->capacity, memo->bucketCount, arity), 0);
+
+  memo->entries = entries;
+  memo->keys = keys;
+  memo->buckets = buckets;
+  memo->capacity = capacity;
+  memo->bucketCount = bucketCount;
+  memset(buckets, -1, sizeof(int32_t) * bucketCount);
+  for (int32_t i = 0; i < memo->count; i++)
+    linkBucket(memo, i);
+}
+
+bool memoLookup(ObjFunction *function, Value *args, Value *result) {
+  Memo *memo = function->memo;
+  int32_t index = findEntry(memo, args, function->arity,
+                            hashArguments(args, function->arity));
+  if (index == -1) {
+    memo->misses++;
+    return false;
+  }
+  memo->hits++;
+  if (index != memo->newest) {
+    unlinkUse(memo, index);
+    linkNewest(memo, index);
+  }
+  *result = memo->entries[index].result;
+  return true;
+}
+
+void memoStore(ObjFunction *function, Value *args, Value result) {
+  Memo *memo = function->memo;
+  int arity = function->arity;
+  uint32_t hash = hashArguments(args, arity);
+
+  // a call further in may have got there first with the same arguments
+  int32_t index = findEntry(memo, args, arity, hash);
+  bool isNew = index == -1;
+  if (!isNew) {
+    unlinkUse(memo, index);
+  } else if (memo->count == memo->limit) {
+    index = memo->oldest;
+    unlinkUse(memo, index);
+    unlinkBucket(memo, index);
+    memo->evictions++;
+  } else {
+    if (memo->count == memo->capacity)
+      grow(memo, arity);
+    index = memo->count++;
+  }
+
+  MemoEntry *entry = &memo->entries[index];
+  entry->result = result;
+  linkNewest(memo, index);
+  if (isNew) {
+    entry->hash = hash;
+    if (arity > 0) // no keys array for a function without parameters
+      memcpy(&memo->keys[index * arity], args, sizeof(Value) * arity);
+    linkBucket(memo, index);
+  }
+}
@@ -1,28 +1,236 @@
+#include "../include/jit.h"
+#include "../include/memo.h"
 #include "../include/memory.h"
 #include "../include/object.h"
 #include "../include/vm.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-extern VM vm;
+#define SIZE_CLASS(size) (((size) - 1) / POOL_GRANULE)
+#define IS_POOLED(size) ((size) > 0 && (size) <= POOL_MAX_SIZE)
 
-// handles allocating memory, freeing memory, and growing/shrinking memory
+void initPools(Pool *pools) {
+  for (int i = 0; i < POOL_CLASSES; i++) {
+    pools[i].free = NULL;
+    pools[i].slabs = NULL;
+    pools[i].next = NULL;
+    pools[i].limit = NULL;
+    pools[i].slabCount = 0;
+  }
+}
+
+// hand every slab back at once, without visiting the cells in them
+void freePools(Pool *pools) {
+  for (int i = 0; i < POOL_CLASSES; i++) {
+    PoolSlab *slab = pools[i].slabs;
+    while (slab != NULL) {
+      PoolSlab *next = slab->next;
+      free(slab);
+      slab = next;
+    }
+  }
+  initPools(pools);
+}
+
+static void *poolAllocate(size_t size) {
+  Pool *pool = &vm->pools[SIZE_CLASS(size)];
+  size_t cellSize = (SIZE_CLASS(size) + 1) * POOL_GRANULE;
+
+  if (pool->free != NULL) {
+    PoolCell *cell = pool->free;
+    pool->free = cell->next;
+    return cell;
+  }
+
+  if (pool->next == NULL || pool->next + cellSize > pool->limit) {
+    // the slab header takes up the first granule so the cells stay aligned
+    PoolSlab *slab = (PoolSlab *)malloc(SLAB_SIZE);
+    if (slab == NULL)
+      return NULL;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->slabCount++;
+    pool->next = (uint8_t *)slab + POOL_GRANULE;
+    pool->limit = (uint8_t *)slab + SLAB_SIZE;
+  }
+
+  void *result = pool->next;
+  pool->next += cellSize;
+  return result;
+}
+
+static void poolFree(void *pointer, size_t size) {
+  // the slabs are about to be released wholesale
+  if (vm->releasing)
+    return;
+
+  PoolCell *cell = (PoolCell *)pointer;
+  Pool *pool = &vm->pools[SIZE_CLASS(size)];
+  cell->next = pool->free;
+  pool->free = cell;
+}
+
+// handles allocating memory, freeing memory, and growing/shrinking memory.
+// Small blocks come from the pools, which means the old size has to be right
+// so we know which pool a block belongs to.
+//
+// For allocations that belong together, so hitting the limit part way
+// through doesn't leave the first of them half done.
+void reserveHeap(size_t bytes) {
+  if (vm->heapLimit != 0 && vm->bytesAllocated + bytes > vm->heapLimit)
+    heapExhausted(bytes);
+}
+
+// Every byte is charged to the current VM. Going over its heap limit, or
+// running out of memory altogether, unwinds to whoever called into the VM
+// with a runtime error.
 void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+  if (newSize > oldSize && vm->heapLimit != 0 &&
+      vm->bytesAllocated + (newSize - oldSize) > vm->heapLimit) {
+    heapExhausted(newSize - oldSize);
+  }
+  vm->bytesAllocated += newSize - oldSize;
+
   if (newSize == 0) {
-    free(pointer);
+    if (pointer != NULL && IS_POOLED(oldSize)) {
+      poolFree(pointer, oldSize);
+    } else {
+      free(pointer);
+    }
     return NULL;
   }
 
-  // if pointer is NULL, realloc acts like malloc
-  void *result = realloc(pointer, newSize);
-  if (result == NULL)
-    exit(1);
+  if (pointer != NULL && IS_POOLED(oldSize) && IS_POOLED(newSize) &&
+      SIZE_CLASS(oldSize) == SIZE_CLASS(newSize)) {
+    return pointer;
+  }
+
+  void *result;
+  if (IS_POOLED(newSize)) {
+    result = poolAllocate(newSize);
+  } else if (pointer != NULL && !IS_POOLED(oldSize)) {
+    // if pointer is NULL, realloc acts like malloc
+    result = realloc(pointer, newSize);
+    if (result == NULL) {
+      vm->bytesAllocated -= newSize - oldSize;
+      heapExhausted(newSize - oldSize);
+    }
+    return result;
+  } else {
+    result = malloc(newSize);
+  }
+
+  if (result == NULL) {
+    vm->bytesAllocated -= newSize - oldSize;
+    heapExhausted(newSize - oldSize);
+  }
+
+  // moving between a pool and the heap, or between two pools
+  if (pointer != NULL) {
+    memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    reallocate(pointer, oldSize, 0);
+  }
   return result;
 }
 
+// keep the per type statistics up to date. Count is +1 for a new object and
+// -1 for a freed one, 0 when only its size is changing.
+void trackObject(ObjType type, long bytes, int count) {
+  ObjStats *stats = &vm->objStats[type];
+  stats->liveBytes += bytes;
+  stats->liveCount += count;
+  if (count > 0)
+    stats->allocations += count;
+  if (stats->liveBytes > stats->peakBytes)
+    stats->peakBytes = stats->liveBytes;
+}
+
+// describe what the heap holds, one line for each type of object
+const char *objTypeName(ObjType type) {
+  static const char *names[OBJ_TYPE_COUNT] = {
+      [OBJ_FUNCTION] = "function",
+      [OBJ_NATIVE] = "native",
+      [OBJ_STRING] = "string",
+      [OBJ_LIST] = "list",
+      [OBJ_FLOAT_ARRAY] = "float64 array",
+      [OBJ_MAP] = "map",
+      [OBJ_CLOSURE] = "closure",
+      [OBJ_UPVALUE] = "upvalue",
+      [OBJ_CLASS] = "class",
+      [OBJ_INSTANCE] = "instance",
+      [OBJ_BOUND_METHOD] = "bound method",
+      [OBJ_SHAPE] = "shape",
+  };
+  return names[type];
+}
+
+int poolSlabs() {
+  int slabs = 0;
+  for (int i = 0; i < POOL_CLASSES; i++) {
+    slabs += vm->pools[i].slabCount;
+  }
+  return slabs;
+}
+
+// The heap as a whole comes first, and only types with something alive get
+// a line, the most live bytes first. Lines that don't fit are left out whole,
+// so the type that ran away survives a small buffer.
+int heapReport(char *buffer, size_t size) {
+  char line[128];
+  int length = snprintf(buffer, size, "heap: %zu bytes in use",
+                        vm->bytesAllocated);
+  if (vm->heapLimit != 0 && (size_t)length < size) {
+    length += snprintf(buffer + length, size - length, ", limit %zu",
+                       vm->heapLimit);
+  }
+  if ((size_t)length >= size)
+    return (int)size - 1;
+
+  int slabs = poolSlabs();
+  int lineLength = snprintf(line, sizeof(line), "\npools: %d slabs, %d bytes",
+                            slabs, slabs * SLAB_SIZE);
+  if ((size_t)(length + lineLength) < size) {
+    memcpy(buffer + length, line, lineLength + 1);
+    length += lineLength;
+  }
+
+  // sorted by inserting, there are only a dozen types
+  int order[OBJ_TYPE_COUNT];
+  int count = 0;
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    if (vm->objStats[i].liveCount == 0)
+      continue;
+    int j = count++;
+    for (; j > 0 && vm->objStats[order[j - 1]].liveBytes <
+                        vm->objStats[i].liveBytes;
+         j--)
+      order[j] = order[j - 1];
+    order[j] = i;
+  }
+
+  for (int i = 0; i < count; i++) {
+    ObjStats *stats = &vm->objStats[order[i]];
+    lineLength = snprintf(line, sizeof(line),
+                          "\n%s: %zu live, %zu bytes, %zu allocated, %zu "
+                          "peak bytes",
+                          objTypeName(order[i]), stats->liveCount,
+                          stats->liveBytes, stats->allocations,
+                          stats->peakBytes);
+    if ((size_t)(length + lineLength) >= size)
+      break;
+    memcpy(buffer + length, line, lineLength + 1);
+    length += lineLength;
+  }
+  return length;
+}
+
 static void freeObject(Obj *object) {
   switch (object->type) {
   case OBJ_STRING: {
     ObjString *string = (ObjString *)object;
+    trackObject(OBJ_STRING, -(long)(sizeof(ObjString) + string->length + 1),
+                -1);
     FREE_ARRAY(char, string->chars, string->length + 1);
     FREE(ObjString, object);
     break;
@@ -30,22 +238,116 @@ static void freeObject(Obj *object) {
 
   case OBJ_FUNCTION: {
     ObjFunction *function = (ObjFunction *)object;
+    trackObject(OBJ_FUNCTION, -(long)sizeof(ObjFunction), -1);
+#ifdef LOX_JIT
+    jitFree(function);
+#endif
     freeChunk(&function->chunk);
+    FREE_ARRAY(Upvalue, function->upvalues, function->upvalueCount);
+    FREE_ARRAY(PropertyCache, function->caches, function->cacheCount);
+    FREE_ARRAY(CallCache, function->callCaches, function->callCacheCount);
+    freeMemo(function->memo, function->arity);
     FREE(ObjFunction, object);
     break;
   }
 
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *)object;
+    size_t size = sizeof(ObjClosure) + sizeof(Value) * closure->upvalueCount;
+    trackObject(OBJ_CLOSURE, -(long)size, -1);
+    reallocate(object, size, 0);
+    break;
+  }
+
+  case OBJ_UPVALUE:
+    trackObject(OBJ_UPVALUE, -(long)sizeof(ObjUpvalue), -1);
+    FREE(ObjUpvalue, object);
+    break;
+
+  case OBJ_CLASS: {
+    ObjClass *klass = (ObjClass *)object;
+    trackObject(OBJ_CLASS, -(long)sizeof(ObjClass), -1);
+    freeTable(&klass->methods);
+    FREE(ObjClass, object);
+    break;
+  }
+
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = (ObjInstance *)object;
+    trackObject(OBJ_INSTANCE,
+                -(long)(sizeof(ObjInstance) +
+                        sizeof(Value) * instance->capacity),
+                -1);
+    FREE_ARRAY(Value, instance->fields, instance->capacity);
+    FREE(ObjInstance, object);
+    break;
+  }
+
+  case OBJ_BOUND_METHOD:
+    trackObject(OBJ_BOUND_METHOD, -(long)sizeof(ObjBoundMethod), -1);
+    FREE(ObjBoundMethod, object);
+    break;
+
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    trackObject(OBJ_SHAPE,
+                -(long)(sizeof(ObjShape) +
+                        sizeof(ObjShape *) * shape->transitionCapacity),
+                -1);
+    FREE_ARRAY(ObjShape *, shape->transitions, shape->transitionCapacity);
+    FREE(ObjShape, object);
+    break;
+  }
+
   case OBJ_NATIVE:
+    trackObject(OBJ_NATIVE, -(long)sizeof(ObjNative), -1);
     FREE(ObjNative, object);
     break;
+
+  case OBJ_LIST: {
+    ObjList *list = (ObjList *)object;
+    trackObject(OBJ_LIST,
+                -(long)(sizeof(ObjList) + sizeof(Value) * list->capacity), -1);
+    FREE_ARRAY(Value, list->items, list->capacity);
+    FREE(ObjList, object);
+    break;
+  }
+
+  case OBJ_FLOAT_ARRAY: {
+    ObjFloatArray *array = (ObjFloatArray *)object;
+    trackObject(OBJ_FLOAT_ARRAY,
+                -(long)(sizeof(ObjFloatArray) + sizeof(double) * array->count),
+                -1);
+    FREE_ARRAY(double, array->values, array->count);
+    FREE(ObjFloatArray, object);
+    break;
+  }
+
+  case OBJ_MAP: {
+    ObjMap *map = (ObjMap *)object;
+    trackObject(OBJ_MAP,
+                -(long)(sizeof(ObjMap) + (sizeof(MapEntry) +
+                                          2 * sizeof(int32_t)) * map->capacity),
+                -1);
+    FREE_ARRAY(MapEntry, map->entries, map->capacity);
+    FREE_ARRAY(int32_t, map->slots, 2 * map->capacity);
+    FREE(ObjMap, object);
+    break;
+  }
   }
 }
 
+// Free everything the VM owns. Blocks that live in the pools aren't handed
+// back one at a time, the slabs are released together at the end instead.
 void freeObjects() {
-  Obj *object = vm.objects;
+  vm->releasing = true;
+  Obj *object = vm->objects;
   while (object != NULL) {
     Obj *next = object->next;
     freeObject(object);
     object = next;
   }
+  vm->objects = NULL;
+  freePools(vm->pools);
+  vm->releasing = false;
 }
@@ -15,7 +15,6 @@
 #include "../include/value.h"
 #include "../include/vm.h"
 
-extern VM vm;
 
 #define ALLOCATE_OBJ(type, objectType)                                         \
   (type *)allocateObject(sizeof(type), objectType)
@@ -23,24 +22,77 @@ extern VM vm;
 static Obj *allocateObject(size_t size, ObjType type) {
   Obj *object = (Obj *)reallocate(NULL, 0, size);
   object->type = type;
+  trackObject(type, (long)size, 1);
 
-  object->next = vm.objects;
-  vm.objects = object;
+  object->next = vm->objects;
+  vm->objects = object;
   return object;
 }
 
-ObjNative *newNative(NativeFn function) {
+ObjNative *newNative(NativeFn function, int arity, void *userdata) {
   ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
   native->function = function;
+  native->arity = arity;
+  native->userdata = userdata;
   return native;
 }
 
+ObjList *newList(int capacity) {
+  ObjList *list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+  list->count = 0;
+  list->capacity = 0;
+  list->items = NULL;
+  if (capacity > 0) {
+    list->items = ALLOCATE(Value, capacity);
+    list->capacity = capacity;
+    trackObject(OBJ_LIST, (long)(sizeof(Value) * capacity), 0);
+  }
+  return list;
+}
+
+// the caller makes sure the list is shorter than LIST_MAX
+void appendToList(ObjList *list, Value value) {
+  if (list->count == list->capacity) {
+    int capacity = GROW_CAPACITY(list->capacity);
+    list->items = GROW_ARRAY(Value, list->items, list->capacity, capacity);
+    trackObject(OBJ_LIST, (long)(sizeof(Value) * (capacity - list->capacity)),
+                0);
+    list->capacity = capacity;
+  }
+  list->items[list->count++] = value;
+}
+
+// all zeros to start with
+ObjFloatArray *newFloatArray(int count) {
+  ObjFloatArray *array = ALLOCATE_OBJ(ObjFloatArray, OBJ_FLOAT_ARRAY);
+  array->count = 0;
+  array->values = NULL;
+  if (count > 0) {
+    array->values = ALLOCATE(double, count);
+    memset(array->values, 0, sizeof(double) * count);
+    array->count = count;
+    trackObject(OBJ_FLOAT_ARRAY, (long)(sizeof(double) * count), 0);
+  }
+  return array;
+}
+
+ObjMap *newMap() {
+  ObjMap *map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+  map->count = 0;
+  map->used = 0;
+  map->capacity = 0;
+  map->entries = NULL;
+  map->slots = NULL;
+  return map;
+}
+
 static ObjString *allocateString(char *chars, int length, uint32_t hash) {
   ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
   string->length = length;
   string->chars = chars;
   string->hash = hash;
-  tableSet(&vm.strings, string, NIL_VAL);
+  trackObject(OBJ_STRING, length + 1, 0);
+  tableSet(&vm->strings, string, NIL_VAL);
   return string;
 }
 
@@ -48,10 +100,81 @@ ObjFunction *newFunction() {
   ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->name = NULL;
+  function->hotness = 0;
+  function->jitDisabled = false;
+  function->jit = NULL;
+  function->optimized = false;
+  function->aot = NULL;
+  function->lazySource = NULL;
+  function->lazyEnd = NULL;
+  function->lazyLine = 0;
+  function->memo = NULL;
+  function->upvalueCount = 0;
+  function->upvalues = NULL;
+  function->cacheCount = 0;
+  function->caches = NULL;
+  function->callCacheCount = 0;
+  function->callCaches = NULL;
   initChunk(&function->chunk);
   return function;
 }
 
+// the upvalues are left for the caller to fill in
+ObjClosure *newClosure(ObjFunction *function) {
+  ObjClosure *closure = (ObjClosure *)allocateObject(
+      sizeof(ObjClosure) + sizeof(Value) * function->upvalueCount, OBJ_CLOSURE);
+  closure->function = function;
+  closure->upvalueCount = function->upvalueCount;
+  return closure;
+}
+
+ObjUpvalue *newUpvalue(Value *slot) {
+  ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+  upvalue->location = slot;
+  upvalue->closed = NIL_VAL;
+  upvalue->next = NULL;
+  return upvalue;
+}
+
+ObjShape *newShape(ObjShape *parent, ObjString *name) {
+  ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+  shape->parent = parent;
+  shape->name = name;
+  shape->count = parent == NULL ? 0 : parent->count + 1;
+  shape->transitions = NULL;
+  shape->transitionCount = 0;
+  shape->transitionCapacity = 0;
+  return shape;
+}
+
+// every class gets an empty shape of its own, so a cache never mixes them up
+ObjClass *newClass(ObjString *name) {
+  ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+  klass->name = name;
+  klass->initializer = NIL_VAL;
+  klass->version = 0;
+  klass->shape = NULL;
+  initTable(&klass->methods);
+  klass->shape = newShape(NULL, NULL);
+  return klass;
+}
+
+ObjInstance *newInstance(ObjClass *klass) {
+  ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+  instance->klass = klass;
+  instance->shape = klass->shape;
+  instance->fields = NULL;
+  instance->capacity = 0;
+  return instance;
+}
+
+ObjBoundMethod *newBoundMethod(Value receiver, Value method) {
+  ObjBoundMethod *bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+  bound->receiver = receiver;
+  bound->method = method;
+  return bound;
+}
+
 // FNV-1a algorithm, short and sweet. We can replace this hash algorithm with
 // our own if desired.
 static uint32_t hashString(const char *key, int length) {
@@ -68,7 +191,7 @@ ObjString *takeString(char *chars, int length) {
 
   // check if the string already exists in our strings table
   // // if so, return a reference to it and free the newly created string
-  ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+  ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
   if (interned != NULL) {
     FREE_ARRAY(char, chars, length + 1);
     return interned;
@@ -82,7 +205,7 @@ ObjString *copyString(const char *chars, int length) {
 
   // check if the string is already in our string table
   // if so, return a pointer to that one, otherwise, allocate it
-  ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+  ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
   if (interned != NULL)
     return interned;
 
@@ -92,26 +215,120 @@ ObjString *copyString(const char *chars, int length) {
   return allocateString(heapChars, length, hash);
 }
 
-static void printFunction(ObjFunction *function) {
+#define WRITE_LITERAL(output, text) writeBytes(output, text, sizeof(text) - 1)
+
+static void printFunction(Output *out, ObjFunction *function) {
 
   if (function->name == NULL) {
-    printf("<script>");
+    WRITE_LITERAL(out, "<script>");
+    return;
+  }
+
+  WRITE_LITERAL(out, "<fn ");
+  writeBytes(out, function->name->chars, function->name->length);
+  writeByte(out, '>');
+}
+
+// lists and maps that contain themselves are cut off instead of printed
+// forever
+#define PRINT_DEPTH_MAX 16
+
+static _Thread_local int depth = 0;
+
+static void printList(Output *out, ObjList *list) {
+  if (depth == PRINT_DEPTH_MAX) {
+    WRITE_LITERAL(out, "[...]");
     return;
   }
 
-  printf("<fn %s>", function->name->chars);
+  depth++;
+  writeByte(out, '[');
+  for (int i = 0; i < list->count; i++) {
+    if (i > 0)
+      WRITE_LITERAL(out, ", ");
+    writeValue(out, list->items[i]);
+  }
+  writeByte(out, ']');
+  depth--;
+}
+
+static void printMap(Output *out, ObjMap *map) {
+  if (depth == PRINT_DEPTH_MAX) {
+    WRITE_LITERAL(out, "{...}");
+    return;
+  }
+
+  depth++;
+  writeByte(out, '{');
+  bool first = true;
+  for (int i = 0; i < map->used; i++) {
+    MapEntry *entry = &map->entries[i];
+    if (entry->deleted)
+      continue;
+    if (!first)
+      WRITE_LITERAL(out, ", ");
+    first = false;
+    writeValue(out, entry->key);
+    WRITE_LITERAL(out, ": ");
+    writeValue(out, entry->value);
+  }
+  writeByte(out, '}');
+  depth--;
+}
+
+static void printFloatArray(Output *out, ObjFloatArray *array) {
+  WRITE_LITERAL(out, "float64[");
+  for (int i = 0; i < array->count; i++) {
+    if (i > 0)
+      WRITE_LITERAL(out, ", ");
+    writeValue(out, NUMBER_VAL(array->values[i]));
+  }
+  writeByte(out, ']');
 }
 
-void printObject(Value value) {
+void writeObject(Output *out, Value value) {
   switch (OBJ_TYPE(value)) {
   case OBJ_STRING:
-    printf("%s", AS_CSTRING(value));
+    writeBytes(out, AS_CSTRING(value), AS_STRING(value)->length);
     break;
   case OBJ_FUNCTION:
-    printFunction(AS_FUNCTION(value));
+    printFunction(out, AS_FUNCTION(value));
+    break;
+  case OBJ_CLOSURE:
+    printFunction(out, AS_CLOSURE(value)->function);
+    break;
+  case OBJ_UPVALUE:
+    WRITE_LITERAL(out, "upvalue");
+    break;
+  case OBJ_CLASS:
+    writeBytes(out, AS_CLASS(value)->name->chars, AS_CLASS(value)->name->length);
+    break;
+  case OBJ_INSTANCE: {
+    ObjString *name = AS_INSTANCE(value)->klass->name;
+    writeBytes(out, name->chars, name->length);
+    WRITE_LITERAL(out, " instance");
+    break;
+  }
+  case OBJ_BOUND_METHOD: {
+    Value method = AS_BOUND_METHOD(value)->method;
+    printFunction(out, IS_CLOSURE(method) ? AS_CLOSURE(method)->function
+                                          : AS_FUNCTION(method));
+    break;
+  }
+  case OBJ_SHAPE:
+    WRITE_LITERAL(out, "shape");
     break;
   case OBJ_NATIVE:
-    printf("<native fn>");
+    WRITE_LITERAL(out, "<native fn>");
+    break;
+  case OBJ_LIST:
+    printList(out, AS_LIST(value));
+    break;
+  case OBJ_FLOAT_ARRAY:
+    printFloatArray(out, AS_FLOAT_ARRAY(value));
+    break;
+  case OBJ_MAP:
+    printMap(out, AS_MAP(value));
     break;
   }
 }
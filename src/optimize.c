@@ -0,0 +1,1749 @@
+/*
+ * The optimizing tier, see optimize.h.
+ *
+ * The compiler keeps track of how deep the stack is, so every instruction
+ * works on known slots of the frame: a push writes the slot at the current
+ * depth, and a pop reads the one just below it. With the slots taken as
+ * variables the bytecode is a register program, and lifting it into SSA form
+ * is the textbook construction over its blocks. Expressions compile to runs
+ * of instructions within a block, the operands first. Each instruction that
+ * ends such a run, a tree, remembers where it starts. Lowering can then
+ * replace a whole tree with a constant, with a read of a slot that already
+ * holds its value, or with a read of a slot its loop's preheader filled. It
+ * can also drop the tree altogether.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/optimize.h"
+
+#ifdef LOX_OPTIMIZE
+
+#include "../include/arena.h"
+#include "../include/chunk.h"
+#include "../include/debug.h"
+#include "../include/memory.h"
+#include "../include/vm.h"
+
+// bigger functions are left alone, some of the passes are quadratic
+#define OPTIMIZE_MAX_CODE 4096
+// constant propagation gives up after this many rounds over the blocks
+#define MAX_ROUNDS 64
+// buckets for value numbering
+#define VALUE_BUCKETS 1024
+
+typedef enum {
+  IR_ENTRY,    // what a slot held when the function started
+  IR_PHI,
+  IR_OPAQUE,   // made by an instruction we don't look into
+  IR_CONSTANT,
+  IR_GLOBAL,   // read from a global
+  IR_OP,       // computed by a pure instruction, see pure()
+} IrKind;
+
+typedef enum { LATTICE_TOP, LATTICE_CONSTANT, LATTICE_BOTTOM } Lattice;
+
+typedef struct {
+  IrKind kind;
+  uint8_t op; // IR_OP: the generic instruction
+  int a, b;   // IR_OP: the operands, b is -1 for unary ones
+  int block;
+  int *args;   // IR_PHI: one per predecessor of the block, and one more
+               // for the first block, for the way in from the call
+  int forward; // the value a phi turned out to be a copy of, or itself
+
+  Lattice lattice;
+  Value constant; // once the lattice says it's constant
+  bool number;    // always a number
+  int leader;     // the first value that computes the same thing
+  int next;       // the next value in its value numbering bucket
+} IrValue;
+
+typedef struct {
+  int start, end; // instruction offsets, end is exclusive
+  int last;       // offset of the last instruction
+  int depth;      // slots in use on the way in
+  int jump, fall; // successors, -1 for none
+  int *preds;
+  int predCount;
+  int *entry; // the value in each slot on the way in
+  int *exit;  // and on the way out
+  int firstValue, endValue; // the values made in the block
+  bool executable;
+  bool jumpTaken, fallTaken;
+  int idom;
+  int order; // in reverse postorder
+  int loop;  // innermost loop it is in, or -1
+} IrBlock;
+
+typedef struct {
+  int header, end; // offsets, the last back edge ends at end
+  int parent;      // the loop around this one, or -1
+  int base;        // slots in use at the header
+  bool hoistable;
+  int hoisted;   // values computed in front of the loop
+  int preheader; // where that code starts in the new bytecode
+} IrLoop;
+
+// what lowering does with an instruction
+typedef enum {
+  KEEP,
+  AS_CONSTANT, // the tree ending here becomes a constant
+  AS_SLOT,     // or a read of a slot that holds the same value
+  AS_HOISTED,  // or a read of a slot the loop's preheader filled
+  DROP_TREE,   // a pop goes, along with the pure tree it pops
+  FOLD_TRUE,   // a conditional jump that is never taken
+  FOLD_FALSE,  // or always is
+} Action;
+
+typedef struct {
+  ObjFunction *function;
+  Chunk *chunk;
+  int *entries;
+  int entryCount;
+  int *moved; // where each entry carries on in the new bytecode
+  int maxDepth;
+
+  // per offset, where an instruction starts
+  bool *starts;
+  int *depth;    // on the way in, -1 where nothing gets to
+  int *blockOf;
+  int *out;      // the value left on top, or -1
+  int *read;     // for a conditional jump, the value it tests
+  int *tree;     // where the tree ending here starts, or -1
+  int *popped;   // for a pop or a conditional jump, the end of the tree
+                 // right before it, or -1
+  bool *known;   // a global read that can't fail, the global was just seen
+  Action *action;
+  int *operand;  // the constant, slot, loop or tree an action goes with
+  int *hoist;    // AS_HOISTED: which of the loop's slots
+  bool *dropped;
+  int *newOffset;
+
+  IrValue *values;
+  int valueCount, valueCapacity;
+  IrBlock *blocks;
+  int blockCount;
+  int *order; // the executable blocks in reverse postorder
+  int orderCount;
+  IrLoop *loops;
+  int loopCount;
+  int proposedHoists;
+} Ir;
+
+static _Thread_local Arena arena;
+
+static void *scratch(size_t size) {
+  void *memory = arenaAllocate(&arena, size);
+  memset(memory, 0, size);
+  return memory;
+}
+
+#define SCRATCH(type, count) ((type *)scratch(sizeof(type) * (size_t)(count)))
+
+// Instructions.
+
+static int next(Ir *ir, int offset) {
+  return offset + instructionLength(ir->chunk->code[offset]);
+}
+
+static uint8_t opAt(Ir *ir, int offset) {
+  return genericInstruction(ir->chunk->code[offset]);
+}
+
+static bool supported(uint8_t instruction) {
+  switch (genericInstruction(instruction)) {
+  case OP_RETURN:
+  case OP_CONSTANT:
+  case OP_NEGATE:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_NOT:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_PRINT:
+  case OP_POP:
+  case OP_GET_GLOBAL:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_SET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP:
+  case OP_LOOP:
+  case OP_CALL:
+  case OP_BUILD_LIST:
+  case OP_GET_INDEX:
+  case OP_SET_INDEX:
+  case OP_GET_UPVALUE:
+  case OP_GET_BOXED:
+  case OP_SET_BOXED:
+  case OP_CLASS:
+  case OP_METHOD:
+  case OP_INHERIT:
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+  case OP_GET_SUPER:
+  case OP_INVOKE:
+  case OP_SUPER_INVOKE:
+  case OP_GUARD_CALLEE:
+    return true;
+  default:
+    // closures can reach into the frame's slots behind our back
+    return false;
+  }
+}
+
+// computes its result from its operands alone, and does nothing else
+static bool pure(uint8_t op) {
+  switch (op) {
+  case OP_NEGATE:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_NOT:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// can run user code, which can change any global
+static bool callsOut(uint8_t op) {
+  return op == OP_CALL || op == OP_INVOKE || op == OP_SUPER_INVOKE;
+}
+
+// How many values an instruction takes off the stack and how many it puts
+// back. The ones it only looks at count as taken and put back.
+static void stackUse(const uint8_t *code, int *pops, int *pushes) {
+  *pops = 0;
+  *pushes = 0;
+  switch (genericInstruction(code[0])) {
+  case OP_CONSTANT:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_LOCAL:
+  case OP_GET_GLOBAL:
+  case OP_GET_UPVALUE:
+  case OP_GET_BOXED:
+  case OP_CLASS:
+    *pushes = 1;
+    break;
+  case OP_SET_LOCAL:
+  case OP_SET_GLOBAL:
+  case OP_SET_BOXED:
+  case OP_NOT:
+  case OP_NEGATE:
+  case OP_GET_PROPERTY:
+    *pops = 1;
+    *pushes = 1;
+    break;
+  case OP_DEFINE_GLOBAL:
+  case OP_PRINT:
+  case OP_POP:
+  case OP_METHOD:
+  case OP_INHERIT:
+  case OP_RETURN:
+    *pops = 1;
+    break;
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_GET_INDEX:
+  case OP_GET_SUPER:
+  case OP_SET_PROPERTY:
+    *pops = 2;
+    *pushes = 1;
+    break;
+  case OP_SET_INDEX:
+    *pops = 3;
+    *pushes = 1;
+    break;
+  case OP_BUILD_LIST:
+    *pops = code[1];
+    *pushes = 1;
+    break;
+  case OP_CALL:
+    *pops = code[1] + 1;
+    *pushes = 1;
+    break;
+  case OP_INVOKE:
+    *pops = code[2] + 1;
+    *pushes = 1;
+    break;
+  case OP_SUPER_INVOKE:
+    *pops = code[2] + 2;
+    *pushes = 1;
+    break;
+  default:
+    break;
+  }
+}
+
+// where a jump goes, -1 for anything else
+static int jumpTarget(Ir *ir, int offset) {
+  const uint8_t *code = ir->chunk->code + offset;
+  switch (code[0]) {
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+    return offset + 3 + (uint16_t)(code[1] << 8 | code[2]);
+  case OP_GUARD_CALLEE:
+    return offset + 5 + (uint16_t)(code[3] << 8 | code[4]);
+  case OP_LOOP:
+    return offset + 3 - (uint16_t)(code[1] << 8 | code[2]);
+  default:
+    return -1;
+  }
+}
+
+static bool endsBlock(uint8_t instruction) {
+  return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE ||
+         instruction == OP_LOOP || instruction == OP_RETURN ||
+         instruction == OP_GUARD_CALLEE;
+}
+
+static bool fallsThrough(uint8_t instruction) {
+  return instruction != OP_JUMP && instruction != OP_LOOP &&
+         instruction != OP_RETURN;
+}
+
+// The stack depth at every instruction, going over the code until nothing
+// new turns up, as a for loop's increment is only reached going backwards.
+// Fails on anything we can't handle, or code whose depths don't add up.
+static bool findDepths(Ir *ir) {
+  Chunk *chunk = ir->chunk;
+  for (int offset = 0; offset < chunk->count; offset = next(ir, offset)) {
+    if (!supported(chunk->code[offset]))
+      return false;
+    ir->starts[offset] = true;
+  }
+  for (int offset = 0; offset <= chunk->count; offset++)
+    ir->depth[offset] = -1;
+  ir->depth[0] = ir->function->arity + 1;
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int offset = 0; offset < chunk->count; offset = next(ir, offset)) {
+      int here = ir->depth[offset];
+      if (here == -1)
+        continue;
+      const uint8_t *code = chunk->code + offset;
+      int pops, pushes;
+      stackUse(code, &pops, &pushes);
+      if (here < pops || (code[0] == OP_JUMP_IF_FALSE && here < 1) ||
+          (code[0] == OP_GUARD_CALLEE && here < code[1] + 1))
+        return false;
+      uint8_t op = genericInstruction(code[0]);
+      if ((op == OP_GET_LOCAL || op == OP_SET_LOCAL) && code[1] >= here)
+        return false;
+      int after = here - pops + pushes;
+      if (after > ir->maxDepth)
+        ir->maxDepth = after;
+      if (here > ir->maxDepth)
+        ir->maxDepth = here;
+
+      int targets[2] = {jumpTarget(ir, offset), -1};
+      if (fallsThrough(code[0])) {
+        targets[1] = next(ir, offset);
+        if (targets[1] >= chunk->count)
+          return false;
+      }
+      for (int i = 0; i < 2; i++) {
+        int target = targets[i];
+        if (target == -1)
+          continue;
+        if (target < 0 || target >= chunk->count || !ir->starts[target])
+          return false;
+        if (ir->depth[target] == -1) {
+          ir->depth[target] = after;
+          changed |= target < offset;
+        } else if (ir->depth[target] != after) {
+          return false;
+        }
+      }
+    }
+  }
+  return ir->maxDepth < UINT8_COUNT;
+}
+
+static void findBlocks(Ir *ir) {
+  Chunk *chunk = ir->chunk;
+  bool *leader = SCRATCH(bool, chunk->count + 1);
+  leader[0] = true;
+  for (int offset = 0; offset < chunk->count; offset = next(ir, offset)) {
+    if (ir->depth[offset] == -1)
+      continue;
+    int target = jumpTarget(ir, offset);
+    if (target != -1)
+      leader[target] = true;
+    if (endsBlock(chunk->code[offset]))
+      leader[next(ir, offset)] = true;
+  }
+
+  ir->blocks = SCRATCH(IrBlock, chunk->count);
+  IrBlock *block = NULL;
+  for (int offset = 0; offset < chunk->count; offset = next(ir, offset)) {
+    ir->blockOf[offset] = -1;
+    if (ir->depth[offset] == -1) {
+      block = NULL;
+      continue;
+    }
+    if (block == NULL || leader[offset]) {
+      block = &ir->blocks[ir->blockCount++];
+      block->start = offset;
+      block->depth = ir->depth[offset];
+      block->jump = -1;
+      block->fall = -1;
+      block->idom = -1;
+      block->loop = -1;
+    }
+    block->last = offset;
+    block->end = next(ir, offset);
+    ir->blockOf[offset] = ir->blockCount - 1;
+  }
+
+  for (int i = 0; i < ir->blockCount; i++) {
+    IrBlock *block = &ir->blocks[i];
+    uint8_t last = chunk->code[block->last];
+    int target = jumpTarget(ir, block->last);
+    if (target != -1)
+      block->jump = ir->blockOf[target];
+    if (fallsThrough(last))
+      block->fall = ir->blockOf[block->end];
+  }
+
+  for (int i = 0; i < ir->blockCount; i++) {
+    IrBlock *block = &ir->blocks[i];
+    if (block->jump != -1)
+      ir->blocks[block->jump].predCount++;
+    if (block->fall != -1)
+      ir->blocks[block->fall].predCount++;
+  }
+  for (int i = 0; i < ir->blockCount; i++) {
+    ir->blocks[i].preds = SCRATCH(int, ir->blocks[i].predCount);
+    ir->blocks[i].predCount = 0;
+  }
+  for (int i = 0; i < ir->blockCount; i++) {
+    IrBlock *block = &ir->blocks[i];
+    if (block->jump != -1) {
+      IrBlock *to = &ir->blocks[block->jump];
+      to->preds[to->predCount++] = i;
+    }
+    if (block->fall != -1) {
+      IrBlock *to = &ir->blocks[block->fall];
+      to->preds[to->predCount++] = i;
+    }
+  }
+}
+
+// Values.
+
+static int newValue(Ir *ir, IrKind kind, int block) {
+  if (ir->valueCount == ir->valueCapacity) {
+    int capacity = GROW_CAPACITY(ir->valueCapacity);
+    ir->values = GROW_ARRAY_IN(&arena, IrValue, ir->values, ir->valueCapacity,
+                               capacity);
+    ir->valueCapacity = capacity;
+  }
+  int id = ir->valueCount++;
+  IrValue *value = &ir->values[id];
+  memset(value, 0, sizeof(IrValue));
+  value->kind = kind;
+  value->a = -1;
+  value->b = -1;
+  value->block = block;
+  value->forward = id;
+  value->lattice = LATTICE_TOP;
+  value->leader = id;
+  value->next = -1;
+  return id;
+}
+
+static int resolve(Ir *ir, int value) {
+  while (ir->values[value].forward != value)
+    value = ir->values[value].forward;
+  return value;
+}
+
+static IrValue *valueOf(Ir *ir, int value) {
+  return &ir->values[resolve(ir, value)];
+}
+
+static int leaderOf(Ir *ir, int value) {
+  return valueOf(ir, value)->leader;
+}
+
+static bool hasBackEdge(Ir *ir, int index) {
+  IrBlock *block = &ir->blocks[index];
+  for (int i = 0; i < block->predCount; i++) {
+    if (block->preds[i] >= index)
+      return true;
+  }
+  return false;
+}
+
+static int argCount(Ir *ir, IrValue *phi) {
+  return ir->blocks[phi->block].predCount + (phi->block == 0);
+}
+
+static int newPhi(Ir *ir, int block) {
+  int phi = newValue(ir, IR_PHI, block);
+  IrValue *value = &ir->values[phi];
+  value->args = SCRATCH(int, argCount(ir, value));
+  if (block == 0) {
+    int entry = newValue(ir, IR_ENTRY, block);
+    ir->values[phi].args[ir->blocks[0].predCount] = entry;
+  }
+  return phi;
+}
+
+static Value literal(Ir *ir, const uint8_t *code) {
+  switch (code[0]) {
+  case OP_NIL:
+    return NIL_VAL;
+  case OP_TRUE:
+    return BOOL_VAL(true);
+  case OP_FALSE:
+    return BOOL_VAL(false);
+  default:
+    return ir->chunk->constants.values[code[1]];
+  }
+}
+
+// Give every value an SSA name, block by block in order. A block's forward
+// predecessors are done by the time we get to it. One that is a loop header
+// gets a phi for each slot, filled in once the back edges are done too.
+static void lift(Ir *ir) {
+  int *slots = SCRATCH(int, ir->maxDepth + 1);
+  int *pusher = SCRATCH(int, ir->maxDepth + 1); // tree end of each slot
+  int globals[UINT8_COUNT]; // the value of each global, by name constant
+
+  for (int index = 0; index < ir->blockCount; index++) {
+    IrBlock *block = &ir->blocks[index];
+    block->firstValue = ir->valueCount;
+    block->entry = SCRATCH(int, block->depth);
+    for (int slot = 0; slot < block->depth; slot++) {
+      if (index == 0 && block->predCount == 0) {
+        block->entry[slot] = newValue(ir, IR_ENTRY, index);
+      } else if (index == 0 || hasBackEdge(ir, index)) {
+        block->entry[slot] = newPhi(ir, index);
+      } else {
+        int same = resolve(ir, ir->blocks[block->preds[0]].exit[slot]);
+        for (int i = 1; i < block->predCount && same != -1; i++) {
+          if (resolve(ir, ir->blocks[block->preds[i]].exit[slot]) != same)
+            same = -1;
+        }
+        if (same == -1) {
+          same = newPhi(ir, index);
+          for (int i = 0; i < block->predCount; i++)
+            ir->values[same].args[i] = ir->blocks[block->preds[i]].exit[slot];
+        }
+        block->entry[slot] = same;
+      }
+      slots[slot] = block->entry[slot];
+      pusher[slot] = -1;
+    }
+    for (int i = 0; i < UINT8_COUNT; i++)
+      globals[i] = -1;
+
+    int depth = block->depth;
+    for (int offset = block->start; offset < block->end;
+         offset = next(ir, offset)) {
+      const uint8_t *code = ir->chunk->code + offset;
+      uint8_t op = genericInstruction(code[0]);
+      ir->out[offset] = -1;
+      ir->tree[offset] = -1;
+      ir->popped[offset] = -1;
+
+      switch (op) {
+      case OP_CONSTANT:
+      case OP_NIL:
+      case OP_TRUE:
+      case OP_FALSE: {
+        int value = newValue(ir, IR_CONSTANT, index);
+        ir->values[value].constant = literal(ir, code);
+        slots[depth] = value;
+        break;
+      }
+      case OP_GET_LOCAL:
+        slots[depth] = slots[code[1]];
+        break;
+      case OP_GET_GLOBAL:
+        if (globals[code[1]] != -1) {
+          ir->known[offset] = true;
+        } else {
+          globals[code[1]] = newValue(ir, IR_GLOBAL, index);
+        }
+        slots[depth] = globals[code[1]];
+        break;
+      case OP_SET_LOCAL:
+        slots[code[1]] = slots[depth - 1];
+        pusher[code[1]] = -1;
+        pusher[depth - 1] = -1;
+        break;
+      case OP_SET_GLOBAL:
+      case OP_DEFINE_GLOBAL:
+        // the same name may sit under more than one constant, so forget the
+        // lot, then remember the one we know
+        for (int i = 0; i < UINT8_COUNT; i++)
+          globals[i] = -1;
+        globals[code[1]] = slots[depth - 1];
+        pusher[depth - 1] = -1;
+        break;
+      case OP_POP:
+      case OP_JUMP_IF_FALSE: {
+        int end = pusher[depth - 1];
+        if (end != -1 && next(ir, end) == offset)
+          ir->popped[offset] = end;
+        ir->read[offset] = slots[depth - 1];
+        break;
+      }
+      default:
+        if (pure(op)) {
+          bool binary = op != OP_NOT && op != OP_NEGATE;
+          int first = depth - (binary ? 2 : 1);
+          int value = newValue(ir, IR_OP, index);
+          ir->values[value].op = op;
+          ir->values[value].a = slots[first];
+          ir->values[value].b = binary ? slots[depth - 1] : -1;
+
+          // the operands have to be trees right before this, one after
+          // the other
+          int left = pusher[first];
+          int right = binary ? pusher[depth - 1] : left;
+          bool isTree = left != -1 && right != -1 && next(ir, right) == offset;
+          if (binary && isTree)
+            isTree = next(ir, left) == ir->tree[right];
+          ir->tree[offset] = isTree ? ir->tree[left] : -1;
+          slots[first] = value;
+          pusher[first] = isTree ? offset : -1;
+          ir->out[offset] = value;
+          depth = first + 1;
+          continue;
+        }
+
+        int pops, pushes;
+        stackUse(code, &pops, &pushes);
+        if (callsOut(op)) {
+          for (int i = 0; i < UINT8_COUNT; i++)
+            globals[i] = -1;
+        }
+        for (int i = 0; i < pushes; i++) {
+          slots[depth - pops + i] = newValue(ir, IR_OPAQUE, index);
+          pusher[depth - pops + i] = -1;
+        }
+        break;
+      }
+
+      // the push instructions are trees of their own
+      int pops, pushes;
+      stackUse(code, &pops, &pushes);
+      if (pushes == 1 && pops == 0 && op != OP_CLASS && op != OP_GET_UPVALUE &&
+          op != OP_GET_BOXED) {
+        ir->tree[offset] = offset;
+        pusher[depth] = offset;
+      }
+      depth += pushes - pops;
+      if (pushes > 0)
+        ir->out[offset] = slots[depth - 1];
+    }
+
+    block->exit = SCRATCH(int, depth);
+    memcpy(block->exit, slots, sizeof(int) * depth);
+    block->endValue = ir->valueCount;
+  }
+
+  // the loop headers' phis, now that every predecessor is done
+  for (int index = 0; index < ir->blockCount; index++) {
+    IrBlock *block = &ir->blocks[index];
+    if (ir->values[block->entry[0]].kind != IR_PHI ||
+        !(index == 0 || hasBackEdge(ir, index)))
+      continue;
+    for (int slot = 0; slot < block->depth; slot++) {
+      IrValue *phi = &ir->values[block->entry[slot]];
+      for (int i = 0; i < block->predCount; i++)
+        phi->args[i] = ir->blocks[block->preds[i]].exit[slot];
+    }
+  }
+
+  // a phi whose arguments are all the same value, or itself, is that value
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int id = 0; id < ir->valueCount; id++) {
+      IrValue *phi = &ir->values[id];
+      if (phi->kind != IR_PHI || phi->forward != id)
+        continue;
+      int same = -1;
+      bool trivial = true;
+      for (int i = 0; i < argCount(ir, phi) && trivial; i++) {
+        int arg = resolve(ir, phi->args[i]);
+        if (arg == id || arg == same)
+          continue;
+        if (same != -1)
+          trivial = false;
+        same = arg;
+      }
+      if (trivial && same != -1) {
+        phi->forward = same;
+        changed = true;
+      }
+    }
+  }
+}
+
+// Constant propagation, the sparse conditional kind: a block only counts
+// once something can get to it, so constants that decide branches also
+// decide which phi arguments matter.
+
+static bool falsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// the same down to the bits, so that 0 and -0 stay apart
+static bool sameConstant(Value a, Value b) {
+  if (a.type == VAL_NUMBER && b.type == VAL_NUMBER)
+    return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+  return a.type == b.type && valuesEqual(a, b);
+}
+
+// what the instruction would leave, false if it would fail instead
+static bool fold(uint8_t op, Value a, Value b, Value *result) {
+  switch (op) {
+  case OP_NOT:
+    *result = BOOL_VAL(falsey(a));
+    return true;
+  case OP_EQUAL:
+    *result = BOOL_VAL(valuesEqual(a, b));
+    return true;
+  case OP_NEGATE:
+    if (!IS_NUMBER(a))
+      return false;
+    *result = negateNumber(a);
+    return true;
+  case OP_ADD:
+    if (IS_STRING(a) && IS_STRING(b)) {
+      ObjString *left = AS_STRING(a);
+      ObjString *right = AS_STRING(b);
+      int length = left->length + right->length;
+      char *chars = ALLOCATE(char, length + 1);
+      memcpy(chars, left->chars, left->length);
+      memcpy(chars + left->length, right->chars, right->length);
+      chars[length] = '\0';
+      *result = OBJ_VAL(takeString(chars, length));
+      return true;
+    }
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))
+      return false;
+    *result = addNumbers(a, b);
+    return true;
+  default:
+    break;
+  }
+
+  if (!IS_NUMBER(a) || !IS_NUMBER(b))
+    return false;
+  switch (op) {
+  case OP_SUBTRACT:
+    *result = subtractNumbers(a, b);
+    return true;
+  case OP_MULTIPLY:
+    *result = multiplyNumbers(a, b);
+    return true;
+  case OP_DIVIDE:
+    *result = divideNumbers(a, b);
+    return true;
+  case OP_GREATER:
+    *result = greaterNumbers(a, b);
+    return true;
+  case OP_LESS:
+    *result = lessNumbers(a, b);
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool edgeTaken(Ir *ir, int from, int to) {
+  IrBlock *block = &ir->blocks[from];
+  return block->executable && ((block->jump == to && block->jumpTaken) ||
+                               (block->fall == to && block->fallTaken));
+}
+
+// whether a phi's argument can get there, the way in from the call always can
+static bool argTaken(Ir *ir, IrValue *phi, int i) {
+  IrBlock *block = &ir->blocks[phi->block];
+  return i == block->predCount || edgeTaken(ir, block->preds[i], phi->block);
+}
+
+// move value down the lattice to meet lattice / constant, true if it moved
+static bool lower(IrValue *value, Lattice lattice, Value constant) {
+  if (lattice == LATTICE_TOP || value->lattice == LATTICE_BOTTOM)
+    return false;
+  if (value->lattice == LATTICE_CONSTANT) {
+    if (lattice == LATTICE_CONSTANT && sameConstant(value->constant, constant))
+      return false;
+    value->lattice = LATTICE_BOTTOM;
+    return true;
+  }
+  value->lattice = lattice;
+  value->constant = constant;
+  return true;
+}
+
+static bool evaluate(Ir *ir, int id) {
+  IrValue *value = &ir->values[id];
+  switch (value->kind) {
+  case IR_ENTRY:
+  case IR_OPAQUE:
+  case IR_GLOBAL:
+    return lower(value, LATTICE_BOTTOM, NIL_VAL);
+  case IR_CONSTANT:
+    return lower(value, LATTICE_CONSTANT, value->constant);
+  case IR_PHI: {
+    bool changed = false;
+    for (int i = 0; i < argCount(ir, value); i++) {
+      if (!argTaken(ir, value, i))
+        continue;
+      IrValue *arg = valueOf(ir, value->args[i]);
+      changed |= lower(value, arg->lattice, arg->constant);
+    }
+    return changed;
+  }
+  case IR_OP: {
+    IrValue *a = valueOf(ir, value->a);
+    IrValue *b = value->b != -1 ? valueOf(ir, value->b) : a;
+    if (a->lattice == LATTICE_BOTTOM || b->lattice == LATTICE_BOTTOM)
+      return lower(value, LATTICE_BOTTOM, NIL_VAL);
+    if (a->lattice == LATTICE_TOP || b->lattice == LATTICE_TOP)
+      return false;
+    Value result;
+    if (!fold(value->op, a->constant, b->constant, &result))
+      return lower(value, LATTICE_BOTTOM, NIL_VAL);
+    return lower(value, LATTICE_CONSTANT, result);
+  }
+  }
+  return false;
+}
+
+static bool take(Ir *ir, int to, bool *edge) {
+  if (*edge)
+    return false;
+  *edge = true;
+  ir->blocks[to].executable = true;
+  return true;
+}
+
+static bool propagateConstants(Ir *ir) {
+  ir->blocks[0].executable = true;
+  for (int round = 0;; round++) {
+    if (round == MAX_ROUNDS)
+      return false;
+    bool changed = false;
+    for (int index = 0; index < ir->blockCount; index++) {
+      IrBlock *block = &ir->blocks[index];
+      if (!block->executable)
+        continue;
+      for (int id = block->firstValue; id < block->endValue; id++) {
+        if (ir->values[id].forward == id)
+          changed |= evaluate(ir, id);
+      }
+
+      uint8_t last = ir->chunk->code[block->last];
+      bool jump = block->jump != -1, fall = block->fall != -1;
+      if (last == OP_JUMP_IF_FALSE) {
+        IrValue *test = valueOf(ir, ir->read[block->last]);
+        if (test->lattice == LATTICE_TOP) {
+          jump = fall = false;
+        } else if (test->lattice == LATTICE_CONSTANT) {
+          jump = falsey(test->constant);
+          fall = !jump;
+        }
+      }
+      if (jump)
+        changed |= take(ir, block->jump, &block->jumpTaken);
+      if (fall)
+        changed |= take(ir, block->fall, &block->fallTaken);
+    }
+    if (!changed)
+      return true;
+  }
+}
+
+// Which values are always numbers, assuming they all are to begin with so
+// that loops can prove their own counters.
+static void inferNumbers(Ir *ir) {
+  for (int id = 0; id < ir->valueCount; id++)
+    ir->values[id].number = true;
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int id = 0; id < ir->valueCount; id++) {
+      IrValue *value = &ir->values[id];
+      if (value->forward != id || !value->number)
+        continue;
+      bool number;
+      if (value->lattice == LATTICE_CONSTANT) {
+        number = IS_NUMBER(value->constant);
+      } else if (value->kind == IR_OP) {
+        switch (value->op) {
+        case OP_NEGATE:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+          number = true; // or they would have failed
+          break;
+        case OP_ADD:
+          number = valueOf(ir, value->a)->number && valueOf(ir, value->b)->number;
+          break;
+        default:
+          number = false;
+          break;
+        }
+      } else if (value->kind == IR_PHI) {
+        number = true;
+        for (int i = 0; i < argCount(ir, value) && number; i++) {
+          if (argTaken(ir, value, i))
+            number = valueOf(ir, value->args[i])->number;
+        }
+      } else {
+        number = false;
+      }
+      if (!number) {
+        value->number = false;
+        changed = true;
+      }
+    }
+  }
+}
+
+// Dominators, the iterative way, over the blocks in reverse postorder. That
+// isn't quite bytecode order: a for loop's increment comes before the body
+// that gets to it.
+
+static void orderBlocks(Ir *ir) {
+  int *stack = SCRATCH(int, ir->blockCount);
+  int *edge = SCRATCH(int, ir->blockCount); // successors already visited
+  bool *seen = SCRATCH(bool, ir->blockCount);
+  int *post = SCRATCH(int, ir->blockCount);
+  int postCount = 0, top = 0;
+  stack[top++] = 0;
+  seen[0] = true;
+  while (top > 0) {
+    int index = stack[top - 1];
+    IrBlock *block = &ir->blocks[index];
+    int to = -1;
+    if (edge[index] == 0) {
+      edge[index]++;
+      if (block->jumpTaken)
+        to = block->jump;
+    }
+    if (to == -1 && edge[index] == 1) {
+      edge[index]++;
+      if (block->fallTaken)
+        to = block->fall;
+    }
+    if (to == -1) {
+      if (edge[index] == 2) {
+        post[postCount++] = index;
+        top--;
+      }
+    } else if (!seen[to]) {
+      seen[to] = true;
+      stack[top++] = to;
+    }
+  }
+
+  ir->order = SCRATCH(int, postCount);
+  ir->orderCount = postCount;
+  for (int i = 0; i < postCount; i++) {
+    ir->order[i] = post[postCount - 1 - i];
+    ir->blocks[ir->order[i]].order = i;
+  }
+}
+
+static int intersect(Ir *ir, int a, int b) {
+  while (a != b) {
+    while (ir->blocks[a].order > ir->blocks[b].order)
+      a = ir->blocks[a].idom;
+    while (ir->blocks[b].order > ir->blocks[a].order)
+      b = ir->blocks[b].idom;
+  }
+  return a;
+}
+
+static void findDominators(Ir *ir) {
+  orderBlocks(ir);
+  ir->blocks[0].idom = 0;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 1; i < ir->orderCount; i++) {
+      int index = ir->order[i];
+      IrBlock *block = &ir->blocks[index];
+      int idom = -1;
+      for (int j = 0; j < block->predCount; j++) {
+        int pred = block->preds[j];
+        if (!edgeTaken(ir, pred, index) || ir->blocks[pred].idom == -1)
+          continue;
+        idom = idom == -1 ? pred : intersect(ir, pred, idom);
+      }
+      if (idom != block->idom) {
+        block->idom = idom;
+        changed = true;
+      }
+    }
+  }
+}
+
+static bool dominates(Ir *ir, int a, int b) {
+  while (b != a && b != 0)
+    b = ir->blocks[b].idom;
+  return b == a;
+}
+
+// Common subexpressions. A pure instruction whose operands are the same as
+// those of one that dominates it computes the same value, so it gets that
+// one as its leader.
+static void numberValues(Ir *ir) {
+  int buckets[VALUE_BUCKETS];
+  for (int i = 0; i < VALUE_BUCKETS; i++)
+    buckets[i] = -1;
+
+  for (int i = 0; i < ir->orderCount; i++) {
+    int index = ir->order[i];
+    IrBlock *block = &ir->blocks[index];
+    for (int id = block->firstValue; id < block->endValue; id++) {
+      IrValue *value = &ir->values[id];
+      if (value->kind != IR_OP || value->lattice == LATTICE_CONSTANT)
+        continue;
+      int a = leaderOf(ir, value->a);
+      int b = value->b != -1 ? leaderOf(ir, value->b) : -1;
+      unsigned hash = ((unsigned)value->op * 31u + (unsigned)a) * 31u + (unsigned)b;
+      int *bucket = &buckets[hash % VALUE_BUCKETS];
+      for (int other = *bucket; other != -1; other = ir->values[other].next) {
+        IrValue *candidate = &ir->values[other];
+        if (candidate->op == value->op && leaderOf(ir, candidate->a) == a &&
+            (candidate->b != -1 ? leaderOf(ir, candidate->b) : -1) == b &&
+            dominates(ir, candidate->block, index)) {
+          value->leader = other;
+          break;
+        }
+      }
+      if (value->leader == id) {
+        value->next = *bucket;
+        *bucket = id;
+      }
+    }
+  }
+}
+
+// Loops. Every back edge makes one, from its target to itself. Ones that
+// overlap without nesting, like a for loop's increment and body, or share a
+// header, are the same loop.
+
+static bool containsOffset(IrLoop *loop, int offset) {
+  return offset >= loop->header && offset < loop->end;
+}
+
+// A loop can only have code put in front of it if the way in is through the
+// header, and the one way out is to the pop after it, where the values can
+// be popped again. A frame already inside the loop has to be
+// where nothing of the loop's own is on the stack, so that the values can
+// be pushed for it before it goes on.
+static bool hoistable(Ir *ir, IrLoop *loop) {
+  for (int i = 0; i < ir->entryCount; i++) {
+    int entry = ir->entries[i];
+    if (entry > loop->header && entry < loop->end &&
+        ir->depth[entry] != loop->base)
+      return false;
+  }
+  int header = ir->blockOf[loop->header];
+  for (int index = header; index < ir->blockCount &&
+                           ir->blocks[index].start < loop->end;
+       index++) {
+    IrBlock *block = &ir->blocks[index];
+    if (!block->executable)
+      continue;
+    for (int i = 0; i < block->predCount; i++) {
+      int pred = block->preds[i];
+      if (edgeTaken(ir, pred, index) &&
+          !containsOffset(loop, ir->blocks[pred].start) && index != header)
+        return false;
+    }
+    int successors[2] = {block->jumpTaken ? block->jump : -1,
+                         block->fallTaken ? block->fall : -1};
+    for (int i = 0; i < 2; i++) {
+      int to = successors[i];
+      if (to == -1 || containsOffset(loop, ir->blocks[to].start))
+        continue;
+      IrBlock *exit = &ir->blocks[to];
+      if (exit->start != loop->end || opAt(ir, exit->start) != OP_POP ||
+          exit->depth != loop->base + 1)
+        return false;
+      for (int j = 0; j < exit->predCount; j++) {
+        int pred = exit->preds[j];
+        if (edgeTaken(ir, pred, to) &&
+            !containsOffset(loop, ir->blocks[pred].start))
+          return false;
+      }
+    }
+  }
+  return true;
+}
+
+static void findLoops(Ir *ir) {
+  ir->loops = SCRATCH(IrLoop, ir->blockCount);
+  for (int index = 0; index < ir->blockCount; index++) {
+    IrBlock *block = &ir->blocks[index];
+    if (!block->executable || opAt(ir, block->last) != OP_LOOP)
+      continue;
+    IrLoop *loop = &ir->loops[ir->loopCount++];
+    loop->header = jumpTarget(ir, block->last);
+    loop->end = block->end;
+  }
+
+  bool merged = true;
+  while (merged) {
+    merged = false;
+    for (int i = 0; i < ir->loopCount && !merged; i++) {
+      for (int j = 0; j < ir->loopCount && !merged; j++) {
+        IrLoop *a = &ir->loops[i], *b = &ir->loops[j];
+        if (i == j || !(a->header == b->header ||
+                        (a->header < b->header && b->header < a->end &&
+                         a->end < b->end)))
+          continue;
+        if (b->end > a->end)
+          a->end = b->end;
+        *b = ir->loops[--ir->loopCount];
+        merged = true;
+      }
+    }
+  }
+
+  for (int i = 0; i < ir->loopCount; i++) {
+    IrLoop *loop = &ir->loops[i];
+    loop->parent = -1;
+    for (int j = 0; j < ir->loopCount; j++) {
+      IrLoop *other = &ir->loops[j];
+      if (j != i && other->header <= loop->header &&
+          other->end >= loop->end &&
+          (loop->parent == -1 ||
+           other->end - other->header <
+               ir->loops[loop->parent].end - ir->loops[loop->parent].header))
+        loop->parent = j;
+    }
+    loop->base = ir->depth[loop->header];
+    loop->hoistable = hoistable(ir, loop);
+  }
+
+  for (int index = 0; index < ir->blockCount; index++) {
+    IrBlock *block = &ir->blocks[index];
+    for (int i = 0; i < ir->loopCount; i++) {
+      IrLoop *loop = &ir->loops[i];
+      if (containsOffset(loop, block->start) &&
+          (block->loop == -1 || loop->end - loop->header <
+                                    ir->loops[block->loop].end -
+                                        ir->loops[block->loop].header))
+        block->loop = i;
+    }
+  }
+}
+
+// Lowering decisions.
+
+// can't fail, given what we know about its operands
+static bool cannotFail(Ir *ir, int offset) {
+  uint8_t op = opAt(ir, offset);
+  switch (op) {
+  case OP_CONSTANT:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_LOCAL:
+  case OP_NOT:
+  case OP_EQUAL:
+    return true;
+  case OP_GET_GLOBAL:
+    return ir->known[offset];
+  default:
+    break;
+  }
+  if (!pure(op))
+    return false;
+  if (isUnchecked(ir->chunk->code[offset]))
+    return true;
+  IrValue *value = &ir->values[ir->out[offset]];
+  return valueOf(ir, value->a)->number &&
+         (value->b == -1 || valueOf(ir, value->b)->number);
+}
+
+static bool treeCannotFail(Ir *ir, int start, int end) {
+  for (int offset = start; offset <= end; offset = next(ir, offset)) {
+    if (!cannotFail(ir, offset))
+      return false;
+  }
+  return true;
+}
+
+// Whether the tree computes the same thing every time round the loop: it
+// can't fail, reads no globals, and every slot it reads holds a value from
+// before the loop, the one the slot had on the way in.
+static bool invariant(Ir *ir, int start, int end, IrLoop *loop) {
+  IrBlock *header = &ir->blocks[ir->blockOf[loop->header]];
+  for (int offset = start; offset <= end; offset = next(ir, offset)) {
+    uint8_t op = opAt(ir, offset);
+    if (op == OP_GET_GLOBAL || !cannotFail(ir, offset))
+      return false;
+    if (op == OP_GET_LOCAL) {
+      int slot = ir->chunk->code[offset + 1];
+      int value = resolve(ir, ir->out[offset]);
+      if (slot >= loop->base || resolve(ir, header->entry[slot]) != value ||
+          containsOffset(loop, ir->blocks[ir->values[value].block].start))
+        return false;
+    }
+  }
+  return true;
+}
+
+// the constant's index, adding it if need be, or -1 if there's no room
+static int constantIndex(Ir *ir, Value constant) {
+  ValueArray *constants = &ir->chunk->constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (sameConstant(constants->values[i], constant))
+      return i;
+  }
+  if (constants->count >= UINT8_COUNT)
+    return -1;
+  return addConstant(ir->chunk, constant);
+}
+
+static void decideTree(Ir *ir, int offset, int *slots) {
+  int start = ir->tree[offset];
+  if (start == -1)
+    return;
+  bool single = start == offset;
+  if (single && opAt(ir, offset) != OP_GET_GLOBAL)
+    return; // already as cheap as it gets
+  IrValue *value = valueOf(ir, ir->out[offset]);
+
+  // a tree whose value is known becomes that constant
+  if (!single && value->lattice == LATTICE_CONSTANT) {
+    Value constant = value->constant;
+    int index = IS_NIL(constant) || IS_BOOL(constant)
+                    ? 0
+                    : constantIndex(ir, constant);
+    if (index != -1) {
+      ir->action[offset] = AS_CONSTANT;
+      ir->operand[offset] = index;
+      return;
+    }
+  }
+
+  // one whose value is in a slot already becomes a read of that slot
+  for (int slot = ir->depth[start] - 1; slot >= 0; slot--) {
+    if (leaderOf(ir, slots[slot]) == value->leader) {
+      ir->action[offset] = AS_SLOT;
+      ir->operand[offset] = slot;
+      return;
+    }
+  }
+
+  // and one that is the same every time round its loop is worked out in
+  // front of the loop
+  int loop = ir->blocks[ir->blockOf[offset]].loop;
+  if (!single && loop != -1 && ir->loops[loop].hoistable &&
+      ir->maxDepth + ir->proposedHoists < UINT8_MAX &&
+      invariant(ir, start, offset, &ir->loops[loop])) {
+    ir->action[offset] = AS_HOISTED;
+    ir->operand[offset] = loop;
+    ir->proposedHoists++;
+  }
+}
+
+// what an instruction does to the slots, with the values lifting found
+static void replay(Ir *ir, int offset, int *slots) {
+  const uint8_t *code = ir->chunk->code + offset;
+  int depth = ir->depth[offset];
+  switch (genericInstruction(code[0])) {
+  case OP_GET_LOCAL:
+    slots[depth] = slots[code[1]];
+    break;
+  case OP_SET_LOCAL:
+    slots[code[1]] = slots[depth - 1];
+    break;
+  default: {
+    int pops, pushes;
+    stackUse(code, &pops, &pushes);
+    if (pushes > 0)
+      slots[depth - pops] = ir->out[offset];
+    break;
+  }
+  }
+}
+
+static void decide(Ir *ir) {
+  int *slots = SCRATCH(int, ir->maxDepth + 1);
+  for (int index = 0; index < ir->blockCount; index++) {
+    IrBlock *block = &ir->blocks[index];
+    if (!block->executable)
+      continue;
+    for (int slot = 0; slot < block->depth; slot++)
+      slots[slot] = block->entry[slot];
+
+    for (int offset = block->start; offset < block->end;
+         offset = next(ir, offset)) {
+      uint8_t op = opAt(ir, offset);
+      decideTree(ir, offset, slots);
+
+      int end = ir->popped[offset];
+      if (op == OP_POP && end != -1 && ir->tree[end] != -1 &&
+          treeCannotFail(ir, ir->tree[end], end)) {
+        // nobody wants the value and working it out does nothing else
+        ir->action[offset] = DROP_TREE;
+        ir->operand[offset] = end;
+      } else if (op == OP_JUMP_IF_FALSE &&
+                 valueOf(ir, ir->read[offset])->lattice == LATTICE_CONSTANT) {
+        bool taken = falsey(valueOf(ir, ir->read[offset])->constant);
+        ir->action[offset] = taken ? FOLD_FALSE : FOLD_TRUE;
+        ir->operand[offset] = -1;
+
+        // the test and the pop on the way we go can both go, if the pop
+        // is only ever reached from here
+        int to = taken ? block->jump : block->fall;
+        IrBlock *target = &ir->blocks[to];
+        int takers = 0;
+        for (int i = 0; i < target->predCount; i++)
+          takers += edgeTaken(ir, target->preds[i], to);
+        if (end != -1 && ir->tree[end] != -1 && takers == 1 &&
+            opAt(ir, target->start) == OP_POP &&
+            treeCannotFail(ir, ir->tree[end], end))
+          ir->operand[offset] = end;
+      }
+      replay(ir, offset, slots);
+    }
+  }
+}
+
+static void dropTree(Ir *ir, int start, int end) {
+  for (int offset = start; offset <= end; offset = next(ir, offset))
+    ir->dropped[offset] = true;
+}
+
+// Outer trees win over the ones inside them, so go backwards and drop what
+// each chosen tree covers. Then number the values each loop hoists, giving
+// the same value the same slot.
+static void choose(Ir *ir) {
+  int *offsets = SCRATCH(int, ir->chunk->count);
+  int count = 0;
+  for (int offset = 0; offset < ir->chunk->count; offset = next(ir, offset)) {
+    if (ir->depth[offset] != -1 &&
+        ir->blocks[ir->blockOf[offset]].executable)
+      offsets[count++] = offset;
+  }
+
+  for (int i = count - 1; i >= 0; i--) {
+    int offset = offsets[i];
+    if (ir->dropped[offset]) {
+      ir->action[offset] = KEEP;
+      continue;
+    }
+    switch (ir->action[offset]) {
+    case AS_CONSTANT:
+    case AS_SLOT:
+    case AS_HOISTED:
+      for (int inside = ir->tree[offset]; inside < offset;
+           inside = next(ir, inside))
+        ir->dropped[inside] = true;
+      break;
+    case DROP_TREE:
+      dropTree(ir, ir->tree[ir->operand[offset]], ir->operand[offset]);
+      ir->dropped[offset] = true;
+      break;
+    case FOLD_TRUE:
+    case FOLD_FALSE: {
+      int end = ir->operand[offset];
+      if (end != -1) {
+        dropTree(ir, ir->tree[end], end);
+        IrBlock *block = &ir->blocks[ir->blockOf[offset]];
+        int to = ir->action[offset] == FOLD_FALSE ? block->jump : block->fall;
+        ir->dropped[ir->blocks[to].start] = true;
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    int offset = offsets[i];
+    if (ir->action[offset] != AS_HOISTED || ir->dropped[offset])
+      continue;
+    IrLoop *loop = &ir->loops[ir->operand[offset]];
+    int leader = valueOf(ir, ir->out[offset])->leader;
+    ir->hoist[offset] = -1;
+    for (int j = 0; j < i; j++) {
+      int earlier = offsets[j];
+      if (ir->action[earlier] == AS_HOISTED && !ir->dropped[earlier] &&
+          ir->operand[earlier] == ir->operand[offset] &&
+          ir->hoist[earlier] >= 0 &&
+          valueOf(ir, ir->out[earlier])->leader == leader) {
+        ir->hoist[offset] = -2 - ir->hoist[earlier]; // shares its slot
+        break;
+      }
+    }
+    if (ir->hoist[offset] == -1)
+      ir->hoist[offset] = loop->hoisted++;
+  }
+}
+
+// Lowering.
+
+typedef struct {
+  uint8_t *code;
+  int *lines;
+  int count, capacity;
+} Lowered;
+
+static void lowerByte(Lowered *output, uint8_t byte, int line) {
+  if (output->count == output->capacity) {
+    int capacity = GROW_CAPACITY(output->capacity);
+    output->code = GROW_ARRAY_IN(&arena, uint8_t, output->code,
+                                 output->capacity, capacity);
+    output->lines =
+        GROW_ARRAY_IN(&arena, int, output->lines, output->capacity, capacity);
+    output->capacity = capacity;
+  }
+  output->code[output->count] = byte;
+  output->lines[output->count] = line;
+  output->count++;
+}
+
+// Where a slot ends up, with the hoisted values of the loops around offset
+// sitting underneath it. skip leaves out the loop whose preheader we're in.
+static int shiftSlot(Ir *ir, int slot, int offset, int skip) {
+  int shifted = slot;
+  for (int loop = ir->blocks[ir->blockOf[offset]].loop; loop != -1;
+       loop = ir->loops[loop].parent) {
+    IrLoop *around = &ir->loops[loop];
+    if (loop != skip && around->hoisted > 0 && slot >= around->base)
+      shifted += around->hoisted;
+  }
+  return shifted;
+}
+
+static int hoistedSlot(Ir *ir, int loop, int index) {
+  IrLoop *around = &ir->loops[loop];
+  return shiftSlot(ir, around->base, around->header, loop) + index;
+}
+
+// a forward jump in the new code, and the old offset it has to land on
+typedef struct {
+  int at;
+  int target;
+} Patch;
+
+// copy an instruction, moving its slot over and noting its jump for later
+static void copyInstruction(Ir *ir, Lowered *output, int offset, int skip,
+                            Patch *patches, int *patchCount) {
+  const uint8_t *code = ir->chunk->code + offset;
+  int line = ir->chunk->lines[offset];
+  uint8_t op = genericInstruction(code[0]);
+
+  if (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_GUARD_CALLEE)
+    patches[(*patchCount)++] = (Patch){output->count, jumpTarget(ir, offset)};
+  for (int i = 0; i < instructionLength(code[0]); i++) {
+    uint8_t byte = code[i];
+    if (i == 1 && (op == OP_GET_LOCAL || op == OP_SET_LOCAL))
+      byte = (uint8_t)shiftSlot(ir, code[1], offset, skip);
+    lowerByte(output, byte, line);
+  }
+}
+
+// whether anything between the two offsets makes it into the new code
+static bool emitsBetween(Ir *ir, int from, int to) {
+  for (int offset = next(ir, from); offset < to; offset = next(ir, offset)) {
+    if (ir->depth[offset] != -1 &&
+        ir->blocks[ir->blockOf[offset]].executable && !ir->dropped[offset])
+      return true;
+  }
+  return false;
+}
+
+// the trees a loop hoists, in the order of their slots
+static void emitHoisted(Ir *ir, Lowered *output, int index, Patch *patches,
+                        int *patchCount) {
+  IrLoop *loop = &ir->loops[index];
+  for (int end = loop->header; end < loop->end; end = next(ir, end)) {
+    if (ir->depth[end] == -1 || ir->action[end] != AS_HOISTED ||
+        ir->dropped[end] || ir->operand[end] != index || ir->hoist[end] < 0)
+      continue;
+    for (int inside = ir->tree[end]; inside <= end; inside = next(ir, inside))
+      copyInstruction(ir, output, inside, index, patches, patchCount);
+  }
+}
+
+// where code coming from outside lands in the new bytecode, which for a loop
+// that hoists values is its preheader
+static int landing(Ir *ir, int target) {
+  for (int l = 0; l < ir->loopCount; l++) {
+    if (ir->loops[l].header == target && ir->loops[l].hoisted > 0)
+      return ir->loops[l].preheader;
+  }
+  return ir->newOffset[target];
+}
+
+static bool emitLoop(Lowered *output, int target, int line) {
+  int back = output->count + 3 - target;
+  if (back > UINT16_MAX)
+    return false;
+  lowerByte(output, OP_LOOP, line);
+  lowerByte(output, (back >> 8) & 0xff, line);
+  lowerByte(output, back & 0xff, line);
+  return true;
+}
+
+// Where a frame at entry carries on. Going into a loop it goes through the
+// preheader. One that is inside loops that hoist values gets a landing pad
+// at the end of the code, which pushes them, outermost loop first, and jumps
+// back in.
+static bool moveEntry(Ir *ir, Lowered *output, int entry, int *moved,
+                      Patch *patches, int *patchCount) {
+  *moved = landing(ir, entry);
+
+  int around[UINT8_COUNT];
+  int count = 0;
+  for (int l = 0; l < ir->loopCount; l++) {
+    IrLoop *loop = &ir->loops[l];
+    if (loop->hoisted > 0 && entry > loop->header && entry < loop->end)
+      around[count++] = l;
+  }
+  if (count == 0)
+    return true;
+
+  int pad = output->count;
+  for (int i = 0; i < count; i++) {
+    // the next one out is the one that contains the rest
+    int outermost = i;
+    for (int j = i + 1; j < count; j++) {
+      if (ir->loops[around[j]].end - ir->loops[around[j]].header >
+          ir->loops[around[outermost]].end - ir->loops[around[outermost]].header)
+        outermost = j;
+    }
+    int swap = around[i];
+    around[i] = around[outermost];
+    around[outermost] = swap;
+    emitHoisted(ir, output, around[i], patches, patchCount);
+  }
+  if (!emitLoop(output, *moved, ir->chunk->lines[entry]))
+    return false;
+  *moved = pad;
+  return true;
+}
+
+static bool lowerCode(Ir *ir, Lowered *output) {
+  Chunk *chunk = ir->chunk;
+  Patch *patches = SCRATCH(Patch, chunk->count);
+  int patchCount = 0;
+
+  for (int offset = 0; offset < chunk->count; offset = next(ir, offset)) {
+    bool live = ir->depth[offset] != -1 &&
+                ir->blocks[ir->blockOf[offset]].executable;
+    const uint8_t *code = chunk->code + offset;
+    int line = chunk->lines[offset];
+
+    // a loop's invariant values go in front of its header
+    for (int l = 0; l < ir->loopCount && live; l++) {
+      if (ir->loops[l].header == offset && ir->loops[l].hoisted > 0) {
+        ir->loops[l].preheader = output->count;
+        emitHoisted(ir, output, l, patches, &patchCount);
+      }
+    }
+
+    ir->newOffset[offset] = output->count;
+    if (!live)
+      continue;
+
+    switch (ir->dropped[offset] ? DROP_TREE : ir->action[offset]) {
+    case DROP_TREE:
+    case FOLD_TRUE:
+      break;
+    case AS_CONSTANT: {
+      Value constant = valueOf(ir, ir->out[offset])->constant;
+      if (IS_NIL(constant)) {
+        lowerByte(output, OP_NIL, line);
+      } else if (IS_BOOL(constant)) {
+        lowerByte(output, AS_BOOL(constant) ? OP_TRUE : OP_FALSE, line);
+      } else {
+        lowerByte(output, OP_CONSTANT, line);
+        lowerByte(output, (uint8_t)ir->operand[offset], line);
+      }
+      break;
+    }
+    case AS_SLOT:
+      lowerByte(output, OP_GET_LOCAL, line);
+      lowerByte(output,
+                (uint8_t)shiftSlot(ir, ir->operand[offset], offset, -1), line);
+      break;
+    case AS_HOISTED: {
+      int index = ir->hoist[offset];
+      if (index < 0)
+        index = -2 - index;
+      lowerByte(output, OP_GET_LOCAL, line);
+      lowerByte(output, (uint8_t)hoistedSlot(ir, ir->operand[offset], index),
+                line);
+      break;
+    }
+    case FOLD_FALSE: {
+      int target = jumpTarget(ir, offset);
+      if (!emitsBetween(ir, offset, target))
+        break;
+      patches[patchCount++] = (Patch){output->count, target};
+      lowerByte(output, OP_JUMP, line);
+      lowerByte(output, 0xff, line);
+      lowerByte(output, 0xff, line);
+      break;
+    }
+    default:
+      if (code[0] == OP_JUMP && !emitsBetween(ir, offset, jumpTarget(ir, offset)))
+        break; // over code that went
+      if (code[0] == OP_LOOP) {
+        if (!emitLoop(output, ir->newOffset[jumpTarget(ir, offset)], line))
+          return false;
+      } else {
+        copyInstruction(ir, output, offset, -1, patches, &patchCount);
+      }
+      break;
+    }
+
+    // and they come off again on the way out, under the loop's last test
+    for (int l = 0; l < ir->loopCount; l++) {
+      IrLoop *loop = &ir->loops[l];
+      for (int i = 0; loop->end == offset && i < loop->hoisted; i++)
+        lowerByte(output, OP_POP, line);
+    }
+  }
+  ir->newOffset[chunk->count] = output->count;
+
+  for (int i = 0; i < ir->entryCount; i++) {
+    if (!moveEntry(ir, output, ir->entries[i], &ir->moved[i], patches,
+                   &patchCount))
+      return false;
+  }
+
+  for (int i = 0; i < patchCount; i++) {
+    int at = patches[i].at;
+    int length = output->code[at] == OP_GUARD_CALLEE ? 5 : 3;
+    int distance = landing(ir, patches[i].target) - (at + length);
+    if (distance < 0 || distance > UINT16_MAX)
+      return false;
+    output->code[at + length - 2] = (distance >> 8) & 0xff;
+    output->code[at + length - 1] = distance & 0xff;
+  }
+  return true;
+}
+
+static bool analyze(Ir *ir) {
+  if (!findDepths(ir))
+    return false;
+  for (int i = 0; i < ir->entryCount; i++) {
+    if (ir->depth[ir->entries[i]] == -1)
+      return false;
+  }
+  findBlocks(ir);
+  lift(ir);
+  if (!propagateConstants(ir))
+    return false;
+  inferNumbers(ir);
+  findDominators(ir);
+  numberValues(ir);
+  findLoops(ir);
+  return true;
+}
+
+bool optimizeFunction(ObjFunction *function, int *entries, int count) {
+  Chunk *chunk = &function->chunk;
+  if (chunk->count == 0 || chunk->count > OPTIMIZE_MAX_CODE ||
+      chunk->arena != NULL || function->jit != NULL || function->aot != NULL)
+    return false;
+
+  freeArena(&arena); // anything left from one that ran out of heap
+  Ir ir;
+  memset(&ir, 0, sizeof(Ir));
+  ir.function = function;
+  ir.chunk = chunk;
+  ir.entries = entries;
+  ir.entryCount = count;
+  ir.moved = SCRATCH(int, count);
+
+  int size = chunk->count + 1;
+  ir.starts = SCRATCH(bool, size);
+  ir.depth = SCRATCH(int, size);
+  ir.blockOf = SCRATCH(int, size);
+  ir.out = SCRATCH(int, size);
+  ir.read = SCRATCH(int, size);
+  ir.tree = SCRATCH(int, size);
+  ir.popped = SCRATCH(int, size);
+  ir.known = SCRATCH(bool, size);
+  ir.action = SCRATCH(Action, size);
+  ir.operand = SCRATCH(int, size);
+  ir.hoist = SCRATCH(int, size);
+  ir.dropped = SCRATCH(bool, size);
+  ir.newOffset = SCRATCH(int, size);
+
+  Lowered output = {NULL, NULL, 0, 0};
+  bool rewritten = false;
+  if (analyze(&ir)) {
+    decide(&ir);
+    choose(&ir);
+    // only worth swapping in if something changed
+    rewritten = lowerCode(&ir, &output) &&
+                (output.count != chunk->count ||
+                 memcmp(output.code, chunk->code, chunk->count) != 0);
+  }
+
+  if (rewritten) {
+    uint8_t *code = ALLOCATE(uint8_t, output.count);
+    int *lines = ALLOCATE(int, output.count);
+    for (int i = 0; i < count; i++)
+      entries[i] = ir.moved[i];
+    memcpy(code, output.code, output.count);
+    memcpy(lines, output.lines, sizeof(int) * output.count);
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    chunk->code = code;
+    chunk->lines = lines;
+    chunk->count = output.count;
+    chunk->capacity = output.count;
+
+#ifdef DEBUG_PRINT_CODE
+    char name[64];
+    snprintf(name, sizeof(name), "%s, optimized",
+             function->name != NULL ? function->name->chars : "<script>");
+    disassembleChunk(chunk, name);
+#endif
+  }
+  freeArena(&arena);
+  return rewritten;
+}
+
+#endif
@@ -4,19 +4,31 @@
 #include "../include/common.h"
 #include "../include/scanner.h"
 
-typedef struct {
-	const char* start; // start of the lexame
-	const char* current; // current character
-	int line; // line for error reporting
-} Scanner;
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+_Thread_local Scanner scanner; // global scanner so we don't have to pass
+                              // it around, one per thread
 
-Scanner scanner; // global scanner so we don't have to pass it around
 
+void initScanner(const char* source, const char* end) {
+	initScannerAt(source, end, 1);
+}
 
-void initScanner(const char* source) {
+void initScannerAt(const char* source, const char* end, int line) {
 	scanner.start = source;
 	scanner.current = source;
-	scanner.line = 1;
+	scanner.end = end;
+	scanner.line = line;
+}
+
+Scanner saveScanner() {
+	return scanner;
+}
+
+void restoreScanner(Scanner saved) {
+	scanner = saved;
 }
 
 // reached end of source file
@@ -70,6 +82,67 @@ static char peekNext() {
   return scanner.current[1];
 }
 
+#ifdef __SSE2__
+// Runs of whitespace, comments, strings and identifiers are skipped 16 bytes
+// at a time. Loads never reach past the end of the source: the last few bytes
+// are copied out and padded with '\0', which ends every kind of run.
+
+#define BYTES(c) _mm_set1_epi8(c)
+#define IS(x, c) _mm_cmpeq_epi8(x, BYTES(c))
+#define BITS(x) ((unsigned)_mm_movemask_epi8(x))
+
+// a bit for every byte that ends the run
+static inline unsigned spaceStops(__m128i x) {
+	return ~BITS(_mm_or_si128(_mm_or_si128(IS(x, ' '), IS(x, '\t')),
+			_mm_or_si128(IS(x, '\r'), IS(x, '\n')))) & 0xffff;
+}
+
+static inline unsigned lineEndStops(__m128i x) {
+	return BITS(_mm_or_si128(IS(x, '\n'), IS(x, '\0')));
+}
+
+static inline unsigned stringStops(__m128i x) {
+	return BITS(_mm_or_si128(IS(x, '"'), IS(x, '\0')));
+}
+
+// Anything but letters, digits and underscores. Setting bit 5 folds upper
+// case onto lower case, and bytes over 127 compare as negative.
+static inline unsigned identifierStops(__m128i x) {
+	__m128i lower = _mm_or_si128(x, BYTES(0x20));
+	__m128i letter = _mm_and_si128(_mm_cmpgt_epi8(lower, BYTES('a' - 1)),
+			_mm_cmplt_epi8(lower, BYTES('z' + 1)));
+	__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(x, BYTES('0' - 1)),
+			_mm_cmplt_epi8(x, BYTES('9' + 1)));
+	return ~BITS(_mm_or_si128(_mm_or_si128(letter, digit), IS(x, '_'))) &
+			0xffff;
+}
+
+// where the run starting at p ends, counting the newlines in it if asked
+static inline __attribute__((always_inline)) const char* skipRun(
+		const char* p, unsigned (*stops)(__m128i), bool countLines) {
+	for (;;) {
+		__m128i x;
+		if (scanner.end - p >= 16) {
+			x = _mm_loadu_si128((const __m128i*)p);
+		} else {
+			char tail[16] = {0};
+			memcpy(tail, p, scanner.end - p);
+			x = _mm_loadu_si128((const __m128i*)tail);
+		}
+		unsigned stop = stops(x);
+		unsigned newlines = countLines ? BITS(IS(x, '\n')) : 0;
+		if (stop != 0) {
+			int end = __builtin_ctz(stop);
+			if (countLines)
+				scanner.line += __builtin_popcount(newlines & ~(~0u << end));
+			return p + end;
+		}
+		if (countLines) scanner.line += __builtin_popcount(newlines);
+		p += 16;
+	}
+}
+#endif
+
 // skip over whitespace, as well as comments
 static void skipWhitespace() {
 	for (;;) {
@@ -90,6 +163,11 @@ static void skipWhitespace() {
 			case '\n':
 				scanner.line++;
 				advance();
+#ifdef __SSE2__
+				// the indentation after it in one go, newlines included
+				if (peek() == ' ' || peek() == '\t')
+					scanner.current = skipRun(scanner.current, spaceStops, true);
+#endif
 				break;
 
 			// remove comments
@@ -98,7 +176,11 @@ static void skipWhitespace() {
 					// A comment goes until the end of the line.
 					// Don't consume the newline, since we want SkipWhitespace
 					// to increment our line count
+#ifdef __SSE2__
+					scanner.current = skipRun(scanner.current, lineEndStops, false);
+#else
 					while (peek() != '\n' && !isAtEnd()) advance();
+#endif
 				} else {
 					return;
 				}
@@ -112,10 +194,14 @@ static void skipWhitespace() {
 }
 
 static Token string() {
+#ifdef __SSE2__
+	scanner.current = skipRun(scanner.current, stringStops, true);
+#else
 	while (peek() != '"' && !isAtEnd()) {
 		if (peek() == '\n') scanner.line++;
 		advance();
 	}
+#endif
 
 	if (isAtEnd()) return errorToken("Unterminated string.");
 
@@ -148,57 +234,61 @@ static bool isAlpha(char c) {
 }
 
 
-static TokenType checkKeyword(int start, int length, const char* rest,
-		TokenType type) {
-	if (scanner.current - scanner.start == start + length &&
-			memcmp(scanner.start + start, rest, length) == 0) {
-		return type;
-	}
+// Keywords are told apart by a perfect hash of their second letter and their
+// length: no two of them land in the same one of the 32 slots. Whatever is in
+// the slot still has to match in full.
+#define KEYWORD_SLOT(second, length) (((second) * 6 + (length)) & 31)
 
-	return TOKEN_IDENTIFIER;
-}
+typedef struct {
+	const char* name;
+	int length;
+	TokenType type;
+} Keyword;
+
+// the second letter is spelled out, a string's letters aren't constants
+#define KEYWORD(name, second, type) \
+	[KEYWORD_SLOT(second, sizeof(name) - 1)] = {name, sizeof(name) - 1, type}
+
+static const Keyword keywords[32] = {
+	KEYWORD("and", 'n', TOKEN_AND),
+	KEYWORD("class", 'l', TOKEN_CLASS),
+	KEYWORD("else", 'l', TOKEN_ELSE),
+	KEYWORD("false", 'a', TOKEN_FALSE),
+	KEYWORD("for", 'o', TOKEN_FOR),
+	KEYWORD("fun", 'u', TOKEN_FUN),
+	KEYWORD("if", 'f', TOKEN_IF),
+	KEYWORD("nil", 'i', TOKEN_NIL),
+	KEYWORD("or", 'r', TOKEN_OR),
+	KEYWORD("print", 'r', TOKEN_PRINT),
+	KEYWORD("return", 'e', TOKEN_RETURN),
+	KEYWORD("super", 'u', TOKEN_SUPER),
+	KEYWORD("this", 'h', TOKEN_THIS),
+	KEYWORD("true", 'r', TOKEN_TRUE),
+	KEYWORD("var", 'a', TOKEN_VAR),
+	KEYWORD("while", 'h', TOKEN_WHILE),
+};
 
-// match identifiers using a trie, i.e just go letter by letter, as soon as you 
-// can see that it isn't a built in identifier, you can tell the compiler that
-// it's a user defined identifier
 static TokenType identifierType() {
-	switch (scanner.start[0]) {
-		case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-		case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-		case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-		case 'f':
-			if (scanner.current - scanner.start > 1) {
-				switch (scanner.start[1]) {
-					case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-					case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-					case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
-				}
-			}
-			break;
-		case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-		case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-		case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-		case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-		case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-		case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-		case 't':
-			if (scanner.current - scanner.start > 1) {
-				switch (scanner.start[1]) {
-					case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-					case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-				}
-			}
-			break;
-		case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-		case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+	int length = (int)(scanner.current - scanner.start);
+	// every keyword is 2 to 6 letters long
+	if (length < 2 || length > 6) return TOKEN_IDENTIFIER;
+
+	const Keyword* keyword =
+			&keywords[KEYWORD_SLOT((unsigned char)scanner.start[1], length)];
+	if (keyword->length == length &&
+			memcmp(scanner.start, keyword->name, length) == 0) {
+		return keyword->type;
 	}
-
 	return TOKEN_IDENTIFIER;
 }
 
 
 static Token identifier() {
+#ifdef __SSE2__
+	scanner.current = skipRun(scanner.current, identifierStops, false);
+#else
 	while (isAlpha(peek()) || isDigit(peek())) advance();
+#endif
 	return makeToken(identifierType());
 }
 
@@ -227,6 +317,8 @@ Token scanToken() {
 		case ')': return makeToken(TOKEN_RIGHT_PAREN);
 		case '{': return makeToken(TOKEN_LEFT_BRACE);
 		case '}': return makeToken(TOKEN_RIGHT_BRACE);
+		case '[': return makeToken(TOKEN_LEFT_BRACKET);
+		case ']': return makeToken(TOKEN_RIGHT_BRACKET);
 		case ';': return makeToken(TOKEN_SEMICOLON);
 		case ',': return makeToken(TOKEN_COMMA);
 		case '.': return makeToken(TOKEN_DOT);
@@ -234,6 +326,7 @@ Token scanToken() {
 		case '+': return makeToken(TOKEN_PLUS);
 		case '/': return makeToken(TOKEN_SLASH);
 		case '*': return makeToken(TOKEN_STAR);
+		case '@': return makeToken(TOKEN_AT);
 
 
 		// 2 character tokens
@@ -0,0 +1,60 @@
+#include <string.h>
+
+#include "../include/memory.h"
+#include "../include/shape.h"
+
+// Shapes are only ever walked on a cache miss, so a field is found by going
+// back along the path that led to the shape, newest field first.
+int shapeSlot(ObjShape *shape, ObjString *name) {
+  for (; shape->name != NULL; shape = shape->parent) {
+    if (shape->name == name)
+      return shape->count - 1;
+  }
+  return -1;
+}
+
+ObjShape *shapeWith(ObjShape *shape, ObjString *name) {
+  for (int i = 0; i < shape->transitionCount; i++) {
+    if (shape->transitions[i]->name == name)
+      return shape->transitions[i];
+  }
+
+  ObjShape *next = newShape(shape, name);
+  if (shape->transitionCount == shape->transitionCapacity) {
+    int capacity = shape->transitionCapacity < 2 ? 2 : shape->transitionCapacity * 2;
+    shape->transitions = GROW_ARRAY(ObjShape *, shape->transitions,
+                                    shape->transitionCapacity, capacity);
+    trackObject(OBJ_SHAPE,
+                (long)(sizeof(ObjShape *) *
+                       (capacity - shape->transitionCapacity)),
+                0);
+    shape->transitionCapacity = capacity;
+  }
+  shape->transitions[shape->transitionCount++] = next;
+  return next;
+}
+
+void growFields(ObjInstance *instance, ObjShape *shape) {
+  if (shape->count <= instance->capacity)
+    return;
+  int capacity = GROW_CAPACITY(instance->capacity);
+  if (capacity < shape->count)
+    capacity = shape->count;
+  instance->fields =
+      GROW_ARRAY(Value, instance->fields, instance->capacity, capacity);
+  trackObject(OBJ_INSTANCE,
+              (long)(sizeof(Value) * (capacity - instance->capacity)), 0);
+  instance->capacity = capacity;
+}
+
+CacheEntry *cacheAdd(PropertyCache *cache, ObjShape *shape) {
+  memmove(&cache->entries[1], &cache->entries[0],
+          sizeof(CacheEntry) * (CACHE_WAYS - 1));
+  CacheEntry *entry = &cache->entries[0];
+  entry->shape = shape;
+  entry->after = shape;
+  entry->slot = -1;
+  entry->version = 0;
+  entry->method = NIL_VAL;
+  return entry;
+}
@@ -0,0 +1,322 @@
+/*
+ * The float64 array kernels, see simd.h. The vector versions go through the
+ * array in full registers and finish the leftovers one value at a time.
+ */
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/simd.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+typedef struct {
+  const char *name;
+  double (*sum)(const double *values, int count);
+  double (*dot)(const double *a, const double *b, int count);
+  void (*scale)(double *values, int count, double factor);
+  void (*add)(double *into, const double *from, int count);
+  void (*prefixSum)(double *values, int count);
+  double (*min)(const double *values, int count);
+  double (*max)(const double *values, int count);
+} Kernels;
+
+// the scalar versions, also used for whatever is left at the end of an array
+
+static double sumScalar(const double *values, int count) {
+  double sum = 0;
+  for (int i = 0; i < count; i++)
+    sum += values[i];
+  return sum;
+}
+
+static double dotScalar(const double *a, const double *b, int count) {
+  double sum = 0;
+  for (int i = 0; i < count; i++)
+    sum += a[i] * b[i];
+  return sum;
+}
+
+static void scaleScalar(double *values, int count, double factor) {
+  for (int i = 0; i < count; i++)
+    values[i] *= factor;
+}
+
+static void addScalar(double *into, const double *from, int count) {
+  for (int i = 0; i < count; i++)
+    into[i] += from[i];
+}
+
+static void prefixSumScalar(double *values, int count) {
+  for (int i = 1; i < count; i++)
+    values[i] += values[i - 1];
+}
+
+// written so a NaN only sticks when it is already in m, the way minpd works
+static double minScalar(const double *values, int count) {
+  double m = values[0];
+  for (int i = 1; i < count; i++)
+    m = values[i] < m ? values[i] : m;
+  return m;
+}
+
+static double maxScalar(const double *values, int count) {
+  double m = values[0];
+  for (int i = 1; i < count; i++)
+    m = values[i] > m ? values[i] : m;
+  return m;
+}
+
+static const Kernels scalarKernels = {
+    "scalar", sumScalar, dotScalar, scaleScalar,
+    addScalar, prefixSumScalar, minScalar, maxScalar,
+};
+
+#ifdef SIMD_X86
+
+// SSE2, which every x86-64 has
+
+static double sumSse2(const double *values, int count) {
+  __m128d a = _mm_setzero_pd(), b = _mm_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    a = _mm_add_pd(a, _mm_loadu_pd(values + i));
+    b = _mm_add_pd(b, _mm_loadu_pd(values + i + 2));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(a, b));
+  return lanes[0] + lanes[1] + sumScalar(values + i, count - i);
+}
+
+static double dotSse2(const double *x, const double *y, int count) {
+  __m128d a = _mm_setzero_pd(), b = _mm_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    a = _mm_add_pd(a, _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+    b = _mm_add_pd(b, _mm_mul_pd(_mm_loadu_pd(x + i + 2),
+                                 _mm_loadu_pd(y + i + 2)));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(a, b));
+  return lanes[0] + lanes[1] + dotScalar(x + i, y + i, count - i);
+}
+
+static void scaleSse2(double *values, int count, double factor) {
+  __m128d f = _mm_set1_pd(factor);
+  int i = 0;
+  for (; i + 2 <= count; i += 2)
+    _mm_storeu_pd(values + i, _mm_mul_pd(_mm_loadu_pd(values + i), f));
+  scaleScalar(values + i, count - i, factor);
+}
+
+static void addSse2(double *into, const double *from, int count) {
+  int i = 0;
+  for (; i + 2 <= count; i += 2)
+    _mm_storeu_pd(into + i, _mm_add_pd(_mm_loadu_pd(into + i),
+                                       _mm_loadu_pd(from + i)));
+  addScalar(into + i, from + i, count - i);
+}
+
+static void prefixSumSse2(double *values, int count) {
+  __m128d carry = _mm_setzero_pd();
+  int i = 0;
+  for (; i + 2 <= count; i += 2) {
+    __m128d x = _mm_loadu_pd(values + i);
+    x = _mm_add_pd(x, _mm_unpacklo_pd(_mm_setzero_pd(), x)); // [a, a + b]
+    x = _mm_add_pd(x, carry);
+    _mm_storeu_pd(values + i, x);
+    carry = _mm_unpackhi_pd(x, x);
+  }
+  if (i < count)
+    values[i] += _mm_cvtsd_f64(carry);
+  prefixSumScalar(values + i, count - i);
+}
+
+static double minSse2(const double *values, int count) {
+  __m128d m = _mm_set1_pd(values[0]);
+  int i = 0;
+  for (; i + 2 <= count; i += 2)
+    m = _mm_min_pd(_mm_loadu_pd(values + i), m);
+  double lanes[2];
+  _mm_storeu_pd(lanes, m);
+  double result = lanes[1] < lanes[0] ? lanes[1] : lanes[0];
+  for (; i < count; i++)
+    result = values[i] < result ? values[i] : result;
+  return result;
+}
+
+static double maxSse2(const double *values, int count) {
+  __m128d m = _mm_set1_pd(values[0]);
+  int i = 0;
+  for (; i + 2 <= count; i += 2)
+    m = _mm_max_pd(_mm_loadu_pd(values + i), m);
+  double lanes[2];
+  _mm_storeu_pd(lanes, m);
+  double result = lanes[1] > lanes[0] ? lanes[1] : lanes[0];
+  for (; i < count; i++)
+    result = values[i] > result ? values[i] : result;
+  return result;
+}
+
+static const Kernels sse2Kernels = {
+    "sse2", sumSse2, dotSse2, scaleSse2,
+    addSse2, prefixSumSse2, minSse2, maxSse2,
+};
+
+// AVX2, four doubles at a time
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static double reduceAdd(__m256d x) {
+  __m128d pair = _mm_add_pd(_mm256_castpd256_pd128(x),
+                            _mm256_extractf128_pd(x, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(pair, _mm_unpackhi_pd(pair, pair)));
+}
+
+AVX2 static double sumAvx2(const double *values, int count) {
+  __m256d a = _mm256_setzero_pd(), b = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    a = _mm256_add_pd(a, _mm256_loadu_pd(values + i));
+    b = _mm256_add_pd(b, _mm256_loadu_pd(values + i + 4));
+  }
+  return reduceAdd(_mm256_add_pd(a, b)) + sumScalar(values + i, count - i);
+}
+
+AVX2 static double dotAvx2(const double *x, const double *y, int count) {
+  __m256d a = _mm256_setzero_pd(), b = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    a = _mm256_add_pd(a, _mm256_mul_pd(_mm256_loadu_pd(x + i),
+                                       _mm256_loadu_pd(y + i)));
+    b = _mm256_add_pd(b, _mm256_mul_pd(_mm256_loadu_pd(x + i + 4),
+                                       _mm256_loadu_pd(y + i + 4)));
+  }
+  return reduceAdd(_mm256_add_pd(a, b)) + dotScalar(x + i, y + i, count - i);
+}
+
+AVX2 static void scaleAvx2(double *values, int count, double factor) {
+  __m256d f = _mm256_set1_pd(factor);
+  int i = 0;
+  for (; i + 4 <= count; i += 4)
+    _mm256_storeu_pd(values + i, _mm256_mul_pd(_mm256_loadu_pd(values + i), f));
+  scaleScalar(values + i, count - i, factor);
+}
+
+AVX2 static void addAvx2(double *into, const double *from, int count) {
+  int i = 0;
+  for (; i + 4 <= count; i += 4)
+    _mm256_storeu_pd(into + i, _mm256_add_pd(_mm256_loadu_pd(into + i),
+                                             _mm256_loadu_pd(from + i)));
+  addScalar(into + i, from + i, count - i);
+}
+
+AVX2 static void prefixSumAvx2(double *values, int count) {
+  __m256d zero = _mm256_setzero_pd();
+  __m256d carry = zero;
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m256d x = _mm256_loadu_pd(values + i);
+    // [a, b, c, d] + [0, a, b, c], then + [0, 0, a, a + b]
+    x = _mm256_add_pd(x, _mm256_blend_pd(_mm256_permute4x64_pd(x, 0x90),
+                                         zero, 0x1));
+    x = _mm256_add_pd(x, _mm256_blend_pd(_mm256_permute4x64_pd(x, 0x40),
+                                         zero, 0x3));
+    x = _mm256_add_pd(x, carry);
+    _mm256_storeu_pd(values + i, x);
+    carry = _mm256_permute4x64_pd(x, 0xff);
+  }
+  if (i < count)
+    values[i] += _mm256_cvtsd_f64(carry);
+  prefixSumScalar(values + i, count - i);
+}
+
+AVX2 static double minAvx2(const double *values, int count) {
+  __m256d m = _mm256_set1_pd(values[0]);
+  int i = 0;
+  for (; i + 4 <= count; i += 4)
+    m = _mm256_min_pd(_mm256_loadu_pd(values + i), m);
+  double lanes[4];
+  _mm256_storeu_pd(lanes, m);
+  double result = minScalar(lanes, 4);
+  for (; i < count; i++)
+    result = values[i] < result ? values[i] : result;
+  return result;
+}
+
+AVX2 static double maxAvx2(const double *values, int count) {
+  __m256d m = _mm256_set1_pd(values[0]);
+  int i = 0;
+  for (; i + 4 <= count; i += 4)
+    m = _mm256_max_pd(_mm256_loadu_pd(values + i), m);
+  double lanes[4];
+  _mm256_storeu_pd(lanes, m);
+  double result = maxScalar(lanes, 4);
+  for (; i < count; i++)
+    result = values[i] > result ? values[i] : result;
+  return result;
+}
+
+static const Kernels avx2Kernels = {
+    "avx2", sumAvx2, dotAvx2, scaleAvx2,
+    addAvx2, prefixSumAvx2, minAvx2, maxAvx2,
+};
+
+#endif
+
+// VMs on different threads may race to pick, they all pick the same thing
+static _Atomic(const Kernels *) active = NULL;
+
+static const Kernels *kernels() {
+  const Kernels *chosen = atomic_load_explicit(&active, memory_order_relaxed);
+  if (chosen != NULL)
+    return chosen;
+
+  const char *cap = getenv("LOX_SIMD");
+  chosen = &scalarKernels;
+#ifdef SIMD_X86
+  if (cap == NULL || strcmp(cap, "scalar") != 0) {
+    chosen = &sse2Kernels;
+    __builtin_cpu_init();
+    if ((cap == NULL || strcmp(cap, "sse2") != 0) &&
+        __builtin_cpu_supports("avx2"))
+      chosen = &avx2Kernels;
+  }
+#endif
+  atomic_store_explicit(&active, chosen, memory_order_relaxed);
+  return chosen;
+}
+
+double simdSum(const double *values, int count) {
+  return kernels()->sum(values, count);
+}
+
+double simdDot(const double *a, const double *b, int count) {
+  return kernels()->dot(a, b, count);
+}
+
+void simdScale(double *values, int count, double factor) {
+  kernels()->scale(values, count, factor);
+}
+
+void simdAdd(double *into, const double *from, int count) {
+  kernels()->add(into, from, count);
+}
+
+void simdPrefixSum(double *values, int count) {
+  kernels()->prefixSum(values, count);
+}
+
+double simdMin(const double *values, int count) {
+  return kernels()->min(values, count);
+}
+
+double simdMax(const double *values, int count) {
+  return kernels()->max(values, count);
+}
+
+const char *simdLevel() { return kernels()->name; }
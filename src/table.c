@@ -109,6 +109,29 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
   return true;
 }
 
+// the entry holding key, for callers that want to hang on to where it lives
+Entry* tableFindEntry(Table* table, ObjString* key) {
+  if (table->count == 0) return NULL;
+
+  Entry* entry = findEntry(table->entries, table->capacity, key);
+  return entry->key == NULL ? NULL : entry;
+}
+
+// same as tableFindEntry, but skips the probing when the cache is still good
+Entry* tableFindCached(Table* table, ObjString* key, EntryCache* cache) {
+  if (cache->entry != NULL && cache->entries == table->entries &&
+      cache->entry->key == key) {
+    return cache->entry;
+  }
+
+  Entry* entry = tableFindEntry(table, key);
+  if (entry != NULL) {
+    cache->entries = table->entries;
+    cache->entry = entry;
+  }
+  return entry;
+}
+
 bool tableDelete(Table* table, ObjString* key) {
   if (table->count == 0) return false;
 
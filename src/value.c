@@ -4,6 +4,7 @@
 
 #include "../include/value.h"
 #include "../include/memory.h"
+#include "../include/number.h"
 #include "../include/object.h"
 #include <stdio.h>
 #include <string.h>
@@ -12,46 +13,111 @@ void initValueArray(ValueArray *array) {
   array->values = NULL;
   array->capacity = 0;
   array->count = 0;
+  array->arena = NULL;
 }
 
 void writeValueArray(ValueArray *array, Value value) {
   if (array->capacity < array->count + 1) {
     int oldCapacity = array->capacity;
-    array->capacity = GROW_CAPACITY(oldCapacity);
-    array->values =
-        GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+    int capacity = GROW_CAPACITY(oldCapacity);
+    array->values = GROW_ARRAY_IN(array->arena, Value, array->values,
+                                  oldCapacity, capacity);
+    array->capacity = capacity;
   }
 
   array->values[array->count] = value;
   array->count++;
 }
 
+// move an arena backed array onto the heap, sized to exactly what it holds
+void compactValueArray(ValueArray *array) {
+  if (array->arena == NULL)
+    return;
+
+  Value *values = ALLOCATE(Value, array->count);
+  if (array->count > 0)
+    memcpy(values, array->values, sizeof(Value) * array->count);
+  array->values = values;
+  array->capacity = array->count;
+  array->arena = NULL;
+}
+
 void freeValueArray(ValueArray *array) {
-  FREE_ARRAY(Value, array->values, array->capacity);
+  // arena memory is released along with the arena
+  if (array->arena == NULL)
+    FREE_ARRAY(Value, array->values, array->capacity);
   initValueArray(array);
 }
 
-void printValue(Value value) {
+void flushOutput(Output *output) {
+  if (output->length > 0)
+    fwrite(output->bytes, 1, output->length, output->file);
+  output->length = 0;
+}
+
+void writeBytes(Output *output, const char *bytes, int length) {
+  if (output->length + length > OUTPUT_BUFFER_SIZE) {
+    flushOutput(output);
+    // too big to be worth copying in first
+    if (length > OUTPUT_BUFFER_SIZE) {
+      fwrite(bytes, 1, length, output->file);
+      return;
+    }
+  }
+  memcpy(output->bytes + output->length, bytes, length);
+  output->length += length;
+}
+
+// numbers are formatted straight into the buffer when there's room
+static void writeNumber(Output *output, Value value) {
+  if (OUTPUT_BUFFER_SIZE - output->length < NUMBER_TEXT_MAX)
+    flushOutput(output);
+  char *text = output->bytes + output->length;
+  output->length += IS_INT(value) ? formatInt(AS_INT(value), text)
+                                  : formatNumber(AS_NUMBER(value), text);
+}
+
+void writeValue(Output *output, Value value) {
   switch (value.type) {
   case VAL_BOOL:
-    printf(AS_BOOL(value) ? "true" : "false");
+    if (AS_BOOL(value))
+      writeBytes(output, "true", 4);
+    else
+      writeBytes(output, "false", 5);
     break;
   case VAL_NIL:
-    printf("nil");
+    writeBytes(output, "nil", 3);
     break;
   case VAL_NUMBER:
-    printf("%g", AS_NUMBER(value));
+  case VAL_INT:
+    writeNumber(output, value);
     break;
   case VAL_OBJ:
-    printObject(value);
+    writeObject(output, value);
     break;
   }
 }
 
+void printValue(Value value) { fprintValue(stdout, value); }
+
+// for the odd value printed outside of the VM's output, such as in traces
+void fprintValue(FILE *out, Value value) {
+  static _Thread_local Output output;
+  output.file = out;
+  writeValue(&output, value);
+  flushOutput(&output);
+}
+
 // Check if two values are equal, we must first check it's type, and then it's
 // contents. We can't compare the structs because there is potentially padding,
 // as well as a union.
 bool valuesEqual(Value a, Value b) {
+  // 1 and 1.0 are the same number, however they are stored
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    if (IS_INT(a) && IS_INT(b))
+      return AS_INT(a) == AS_INT(b);
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  }
   if (a.type != b.type)
     return false;
   switch (a.type) {
@@ -59,8 +125,6 @@ bool valuesEqual(Value a, Value b) {
     return AS_BOOL(a) == AS_BOOL(b);
   case VAL_NIL:
     return true;
-  case VAL_NUMBER:
-    return AS_NUMBER(a) == AS_NUMBER(b);
   case VAL_OBJ:
     return AS_OBJ(a) == AS_OBJ(b);
 
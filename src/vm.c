@@ -7,89 +7,730 @@
 #include "../include/common.h"
 #include "../include/compiler.h"
 #include "../include/debug.h"
+#include "../include/jit.h"
+#include "../include/map.h"
+#include "../include/memo.h"
 #include "../include/memory.h"
 #include "../include/object.h"
+#include "../include/optimize.h"
+#include "../include/shape.h"
+#include "../include/simd.h"
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
-// we use the do-while trick to ensure the statements end up in the same
-// scope and reduce the probability of getting a compiler error due to an
-// extra semi-colon
-#define BINARY_OP(valueType, op)                                               \
+// The arithmetic instructions, which run inside run() and work on its
+// locals. We use the do-while trick to ensure the statements end up in the
+// same scope and reduce the probability of getting a compiler error due to
+// an extra semi-colon
+#define BINARY_OP(numbersOp, quickened)                                        \
   do {                                                                         \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
-      runtimeError("Operands must be numbers.");                               \
-      return INTERPRET_RUNTIME_ERROR;                                          \
-    }                                                                          \
-    double b = AS_NUMBER(pop());                                               \
-    double a = AS_NUMBER(pop());                                               \
-    push(valueType(a op b));                                                   \
+    if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2]))                              \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    sp[-2] = numbersOp(sp[-2], sp[-1]);                                        \
+    sp--;                                                                      \
+    ip[-1] = quickened;                                                        \
+  } while (false)
+
+// The quickened forms of BINARY_OP. They only check the operands are still
+// numbers and work on the stack in place. When the guess turns out wrong
+// the instruction turns back into its generic form, which then runs again to
+// deal with whatever the operands are.
+#define NUMBERS_OR_REVERT(generic)                                             \
+  if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2])) {                              \
+    *--ip = generic;                                                           \
+    break;                                                                     \
+  }
+
+#define QUICK_OP(numbersOp, generic)                                           \
+  do {                                                                         \
+    NUMBERS_OR_REVERT(generic);                                                \
+    sp[-2] = numbersOp(sp[-2], sp[-1]);                                        \
+    sp--;                                                                      \
+  } while (false)
+
+// what the compiler emits once it has proven both operands are numbers
+#define UNCHECKED_OP(numbersOp)                                                \
+  do {                                                                         \
+    sp[-2] = numbersOp(sp[-2], sp[-1]);                                        \
+    sp--;                                                                      \
   } while (false)
 
-// global VM, makes it so that we don't have to pass it around all the time.
-VM vm;
+// the VM we are currently running, makes it so that we don't have to pass it
+// around all the time.
+_Thread_local VM *vm = NULL;
+
+// CPU time in seconds, of this thread only: in batch mode the other workers
+// would otherwise count towards a script timing itself
+static bool clockNative(void *userdata, int argCount, Value *args,
+                        Value *result) {
+  struct timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  *result = NUMBER_VAL((double)now.tv_sec + (double)now.tv_nsec / 1e9);
+  return true;
+}
+
+static void setStat(ObjMap *map, const char *key, Value value) {
+  mapSet(map, OBJ_VAL(copyString(key, (int)strlen(key))), value);
+}
+
+// What is alive on the heap, as a map from each object type to a map of its
+// live count and bytes, allocations so far and peak bytes, along with the
+// pools and the heap as a whole. The numbers are taken before any of the
+// maps are made.
+static bool memoryStatsNative(void *userdata, int argCount, Value *args,
+                              Value *result) {
+  ObjStats stats[OBJ_TYPE_COUNT];
+  memcpy(stats, vm->objStats, sizeof(stats));
+  int slabs = poolSlabs();
+  size_t inUse = vm->bytesAllocated;
+
+  ObjMap *report = newMap();
+  *result = OBJ_VAL(report);
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    ObjMap *type = newMap();
+    setStat(report, objTypeName(i), OBJ_VAL(type));
+    setStat(type, "live", INT_VAL((int64_t)stats[i].liveCount));
+    setStat(type, "bytes", INT_VAL((int64_t)stats[i].liveBytes));
+    setStat(type, "allocated", INT_VAL((int64_t)stats[i].allocations));
+    setStat(type, "peak", INT_VAL((int64_t)stats[i].peakBytes));
+  }
+
+  ObjMap *pools = newMap();
+  setStat(report, "pools", OBJ_VAL(pools));
+  setStat(pools, "slabs", INT_VAL(slabs));
+  setStat(pools, "bytes", INT_VAL((int64_t)slabs * SLAB_SIZE));
+
+  ObjMap *heap = newMap();
+  setStat(report, "heap", OBJ_VAL(heap));
+  setStat(heap, "bytes", INT_VAL((int64_t)inUse));
+  setStat(heap, "limit",
+          vm->heapLimit != 0 ? INT_VAL((int64_t)vm->heapLimit) : NIL_VAL);
+  return true;
+}
+
+// the number of items in a list, array or map, or characters in a string
+static bool lenNative(void *userdata, int argCount, Value *args,
+                      Value *result) {
+  if (IS_LIST(args[0])) {
+    *result = INT_VAL(AS_LIST(args[0])->count);
+  } else if (IS_STRING(args[0])) {
+    *result = INT_VAL(AS_STRING(args[0])->length);
+  } else if (IS_FLOAT_ARRAY(args[0])) {
+    *result = INT_VAL(AS_FLOAT_ARRAY(args[0])->count);
+  } else if (IS_MAP(args[0])) {
+    *result = INT_VAL(AS_MAP(args[0])->count);
+  } else {
+    nativeError("Can only take the length of a list, an array, a map or a "
+                "string.");
+    return false;
+  }
+  return true;
+}
+
+static bool appendNative(void *userdata, int argCount, Value *args,
+                         Value *result) {
+  if (!IS_LIST(args[0])) {
+    nativeError("Can only append to a list.");
+    return false;
+  }
+  ObjList *list = AS_LIST(args[0]);
+  if (list->count == LIST_MAX) {
+    nativeError("List can't grow past %d items.", LIST_MAX);
+    return false;
+  }
+  appendToList(list, args[1]);
+  *result = args[0];
+  return true;
+}
+
+// a whole number that fits in an int, however it is stored
+static bool toInt(Value value, int *result) {
+  if (IS_INT(value)) {
+    if (AS_INT(value) < INT32_MIN || AS_INT(value) > INT32_MAX)
+      return false;
+    *result = (int)AS_INT(value);
+    return true;
+  }
+  if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    if (!(number >= INT32_MIN && number <= INT32_MAX) ||
+        number != (int)number)
+      return false;
+    *result = (int)number;
+    return true;
+  }
+  return false;
+}
+
+// a new list with the items from start up to, but not including, end
+static bool sliceNative(void *userdata, int argCount, Value *args,
+                        Value *result) {
+  if (!IS_LIST(args[0])) {
+    nativeError("Can only slice a list.");
+    return false;
+  }
+  ObjList *list = AS_LIST(args[0]);
+  int start, end;
+  if (!toInt(args[1], &start) || !toInt(args[2], &end)) {
+    nativeError("Slice bounds must be whole numbers.");
+    return false;
+  }
+  if (start < 0 || end > list->count || start > end) {
+    nativeError("Slice [%d, %d) out of range for a list of %d items.", start,
+                end, list->count);
+    return false;
+  }
+
+  ObjList *slice = newList(end - start);
+  if (end > start)
+    memcpy(slice->items, list->items + start, sizeof(Value) * (end - start));
+  slice->count = end - start;
+  *result = OBJ_VAL(slice);
+  return true;
+}
+
+// NaN sorts after every other number, so the order is still total
+static int compareNumbers(const void *a, const void *b) {
+  double x = AS_NUMBER(*(const Value *)a);
+  double y = AS_NUMBER(*(const Value *)b);
+  if (x < y)
+    return -1;
+  if (x > y)
+    return 1;
+  return isnan(x) - isnan(y);
+}
+
+static int compareStrings(const void *a, const void *b) {
+  ObjString *x = AS_STRING(*(const Value *)a);
+  ObjString *y = AS_STRING(*(const Value *)b);
+  int length = x->length < y->length ? x->length : y->length;
+  int order = memcmp(x->chars, y->chars, length);
+  return order != 0 ? order : (x->length > y->length) - (x->length < y->length);
+}
+
+// sort a list of numbers or a list of strings in place
+static bool sortNative(void *userdata, int argCount, Value *args,
+                       Value *result) {
+  if (!IS_LIST(args[0])) {
+    nativeError("Can only sort a list.");
+    return false;
+  }
+  ObjList *list = AS_LIST(args[0]);
+  bool numbers = true, strings = true;
+  for (int i = 0; i < list->count; i++) {
+    numbers = numbers && IS_NUMBER(list->items[i]);
+    strings = strings && IS_STRING(list->items[i]);
+  }
+  if (!numbers && !strings) {
+    nativeError("Can only sort a list of numbers or a list of strings.");
+    return false;
+  }
+
+  qsort(list->items, list->count, sizeof(Value),
+        numbers ? compareNumbers : compareStrings);
+  *result = args[0];
+  return true;
+}
+
+// float64Array(n) is n zeros, float64Array(list) copies a list of numbers
+static bool float64ArrayNative(void *userdata, int argCount, Value *args,
+                               Value *result) {
+  if (IS_LIST(args[0])) {
+    ObjList *list = AS_LIST(args[0]);
+    for (int i = 0; i < list->count; i++) {
+      if (!IS_NUMBER(list->items[i])) {
+        nativeError("A float64 array can only hold numbers.");
+        return false;
+      }
+    }
+    ObjFloatArray *array = newFloatArray(list->count);
+    for (int i = 0; i < list->count; i++)
+      array->values[i] = AS_NUMBER(list->items[i]);
+    *result = OBJ_VAL(array);
+    return true;
+  }
+
+  int count;
+  if (!toInt(args[0], &count) || count < 0 || count > LIST_MAX) {
+    nativeError("Expected a list or a size between 0 and %d.", LIST_MAX);
+    return false;
+  }
+  *result = OBJ_VAL(newFloatArray(count));
+  return true;
+}
+
+static bool floatArrayArg(Value value, ObjFloatArray **array) {
+  if (!IS_FLOAT_ARRAY(value)) {
+    nativeError("Expected a float64 array.");
+    return false;
+  }
+  *array = AS_FLOAT_ARRAY(value);
+  return true;
+}
+
+// two arrays that can be combined item by item
+static bool floatArrayPair(Value *args, ObjFloatArray **a, ObjFloatArray **b) {
+  if (!floatArrayArg(args[0], a) || !floatArrayArg(args[1], b))
+    return false;
+  if ((*a)->count != (*b)->count) {
+    nativeError("Arrays have different lengths, %d and %d.", (*a)->count,
+                (*b)->count);
+    return false;
+  }
+  return true;
+}
+
+static bool sumNative(void *userdata, int argCount, Value *args,
+                      Value *result) {
+  ObjFloatArray *array;
+  if (!floatArrayArg(args[0], &array))
+    return false;
+  *result = NUMBER_VAL(simdSum(array->values, array->count));
+  return true;
+}
+
+static bool dotNative(void *userdata, int argCount, Value *args,
+                      Value *result) {
+  ObjFloatArray *a, *b;
+  if (!floatArrayPair(args, &a, &b))
+    return false;
+  *result = NUMBER_VAL(simdDot(a->values, b->values, a->count));
+  return true;
+}
+
+// the ones that change an array do it in place and return it
+
+static bool scaleNative(void *userdata, int argCount, Value *args,
+                        Value *result) {
+  ObjFloatArray *array;
+  if (!floatArrayArg(args[0], &array))
+    return false;
+  if (!IS_NUMBER(args[1])) {
+    nativeError("Can only scale by a number.");
+    return false;
+  }
+  simdScale(array->values, array->count, AS_NUMBER(args[1]));
+  *result = args[0];
+  return true;
+}
+
+static bool addNative(void *userdata, int argCount, Value *args,
+                      Value *result) {
+  ObjFloatArray *a, *b;
+  if (!floatArrayPair(args, &a, &b))
+    return false;
+  simdAdd(a->values, b->values, a->count);
+  *result = args[0];
+  return true;
+}
+
+static bool prefixSumNative(void *userdata, int argCount, Value *args,
+                            Value *result) {
+  ObjFloatArray *array;
+  if (!floatArrayArg(args[0], &array))
+    return false;
+  simdPrefixSum(array->values, array->count);
+  *result = args[0];
+  return true;
+}
+
+static bool minNative(void *userdata, int argCount, Value *args,
+                      Value *result) {
+  ObjFloatArray *array;
+  if (!floatArrayArg(args[0], &array))
+    return false;
+  if (array->count == 0) {
+    nativeError("Can't take the minimum of an empty array.");
+    return false;
+  }
+  *result = NUMBER_VAL(simdMin(array->values, array->count));
+  return true;
+}
+
+static bool maxNative(void *userdata, int argCount, Value *args,
+                      Value *result) {
+  ObjFloatArray *array;
+  if (!floatArrayArg(args[0], &array))
+    return false;
+  if (array->count == 0) {
+    nativeError("Can't take the maximum of an empty array.");
+    return false;
+  }
+  *result = NUMBER_VAL(simdMax(array->values, array->count));
+  return true;
+}
+
+static bool mapNative(void *userdata, int argCount, Value *args,
+                      Value *result) {
+  *result = OBJ_VAL(newMap());
+  return true;
+}
+
+static bool mapArg(Value value, ObjMap **map) {
+  if (!IS_MAP(value)) {
+    nativeError("Expected a map.");
+    return false;
+  }
+  *map = AS_MAP(value);
+  return true;
+}
+
+static bool hasNative(void *userdata, int argCount, Value *args,
+                      Value *result) {
+  ObjMap *map;
+  if (!mapArg(args[0], &map))
+    return false;
+  Value value;
+  *result = BOOL_VAL(mapGet(map, args[1], &value));
+  return true;
+}
+
+// true if the key was there
+static bool deleteNative(void *userdata, int argCount, Value *args,
+                         Value *result) {
+  ObjMap *map;
+  if (!mapArg(args[0], &map))
+    return false;
+  *result = BOOL_VAL(mapDelete(map, args[1]));
+  return true;
+}
+
+// the keys or the values as a list, in the order the keys were added
+static bool mapToList(Value arg, bool keys, Value *result) {
+  ObjMap *map;
+  if (!mapArg(arg, &map))
+    return false;
+  ObjList *list = newList(map->count);
+  for (int i = mapNext(map, -1); i != -1; i = mapNext(map, i))
+    list->items[list->count++] =
+        keys ? map->entries[i].key : map->entries[i].value;
+  *result = OBJ_VAL(list);
+  return true;
+}
 
-static Value clockNative(int argCount, Value *args) {
-  return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+static bool keysNative(void *userdata, int argCount, Value *args,
+                       Value *result) {
+  return mapToList(args[0], true, result);
+}
+
+static bool valuesNative(void *userdata, int argCount, Value *args,
+                         Value *result) {
+  return mapToList(args[0], false, result);
+}
+
+// how the cache of a @memo function is doing, as a map
+static bool memoStatsNative(void *userdata, int argCount, Value *args,
+                            Value *result) {
+  ObjFunction *function = NULL;
+  if (IS_FUNCTION(args[0]))
+    function = AS_FUNCTION(args[0]);
+  else if (IS_CLOSURE(args[0]))
+    function = AS_CLOSURE(args[0])->function;
+  if (function == NULL || function->memo == NULL) {
+    nativeError("Expected a function declared with @memo.");
+    return false;
+  }
+
+  Memo *memo = function->memo;
+  ObjMap *stats = newMap();
+  mapSet(stats, OBJ_VAL(copyString("hits", 4)), INT_VAL(memo->hits));
+  mapSet(stats, OBJ_VAL(copyString("misses", 6)), INT_VAL(memo->misses));
+  mapSet(stats, OBJ_VAL(copyString("evictions", 9)),
+         INT_VAL(memo->evictions));
+  mapSet(stats, OBJ_VAL(copyString("size", 4)), INT_VAL(memo->count));
+  mapSet(stats, OBJ_VAL(copyString("limit", 5)), INT_VAL(memo->limit));
+  *result = OBJ_VAL(stats);
+  return true;
+}
+
+// nextKey(map, nil) is the first key, nextKey(map, key) the one after key,
+// and nil means that was the last one
+static bool nextKeyNative(void *userdata, int argCount, Value *args,
+                          Value *result) {
+  ObjMap *map;
+  if (!mapArg(args[0], &map))
+    return false;
+  int position = -1;
+  if (!IS_NIL(args[1])) {
+    position = mapPosition(map, args[1]);
+    if (position == -1) {
+      nativeError("Key not in map.");
+      return false;
+    }
+  }
+  position = mapNext(map, position);
+  *result = position == -1 ? NIL_VAL : map->entries[position].key;
+  return true;
 }
 
 // just set the top of the stack to index 0.
 static void resetStack() {
 
-  vm.stackTop = vm.stack;
-  vm.frameCount = 0;
+  vm->stackTop = vm->stack;
+  vm->frameCount = 0;
+  vm->openUpvalues = NULL;
+}
+
+// Errors are appended to the VM's error buffer so embedders can fetch them
+// after the fact, and echoed to stderr unless the VM has been silenced.
+void reportError(const char *format, ...) {
+  size_t used = strlen(vm->error);
+  va_list args;
+  va_start(args, format);
+  if (used < ERROR_MAX - 1) {
+    vsnprintf(vm->error + used, ERROR_MAX - used, format, args);
+  }
+  va_end(args);
+
+  if (vm->printErrors) {
+    // whatever the script printed before the error comes first
+    flushOutput(&vm->output);
+    fflush(vm->output.file);
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+  }
 }
 
 // Runtime errors occur when actions require a specific type and that type is
 // not present. i.e multiplying true by a negative doesn't make much sense.
-static void runtimeError(const char *format, ...) {
+// Code the compiler copied in for a call sits between its OP_GUARD_CALLEE
+// and the ordinary call the guard jumps to, see inlineCall() in compile.c.
+// Returns the function that was inlined around instruction, if any, and the
+// line of the call.
+static ObjFunction *inlinedAt(ObjFunction *function, size_t instruction,
+                              int *callLine) {
+  Chunk *chunk = &function->chunk;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk->code[offset])) {
+    uint8_t *code = chunk->code + offset;
+    if (code[0] != OP_GUARD_CALLEE)
+      continue;
+    size_t fallback = offset + 5 + (uint16_t)(code[3] << 8 | code[4]);
+    if (instruction >= (size_t)offset + 5 && instruction < fallback) {
+      *callLine = chunk->lines[offset];
+      return AS_FUNCTION(chunk->constants.values[code[2]]);
+    }
+  }
+  return NULL;
+}
+
+static void reportFunction(ObjFunction *function) {
+  if (function->name == NULL) {
+    reportError("script\n");
+  } else {
+    reportError("%s()\n", function->name->chars);
+  }
+}
+
+// the instruction a frame is at, its first one if it hasn't started yet, as
+// when running out of heap compiling it for the JIT
+static size_t currentInstruction(CallFrame *frame) {
+  uint8_t *code = frame->function->chunk.code;
+  return frame->ip > code ? (size_t)(frame->ip - code - 1) : 0;
+}
+
+void runtimeError(const char *format, ...) {
+  char message[ERROR_MAX];
   va_list args;
   va_start(args, format);
-  vfprintf(stderr, format, args);
+  vsnprintf(message, sizeof(message), format, args);
   va_end(args);
-  fputs("\n", stderr);
-  CallFrame *frame = &vm.frames[vm.frameCount - 1];
-  size_t instruction = frame->ip - frame->function->chunk.code - 1;
-  int line = frame->function->chunk.lines[instruction];
-  fprintf(stderr, "[line %d] in script\n", line);
-
-  for (int i = vm.frameCount - 1; i >= 0; i--) {
-    CallFrame *frame = &vm.frames[i];
+  reportError("%s\n", message);
+
+  // the host can call a native directly, in which case there's no frame
+  if (vm->frameCount == 0)
+    return;
+
+  CallFrame *frame = &vm->frames[vm->frameCount - 1];
+  int line = frame->function->chunk.lines[currentInstruction(frame)];
+  reportError("[line %d] in script\n", line);
+
+  for (int i = vm->frameCount - 1; i >= 0; i--) {
+    CallFrame *frame = &vm->frames[i];
     ObjFunction *function = frame->function;
-    size_t instruction = frame->ip - function->chunk.code - 1;
-    fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
-    if (function->name == NULL) {
-      fprintf(stderr, "script\n");
-    } else {
-      fprintf(stderr, "%s()\n", function->name->chars);
+    size_t instruction = currentInstruction(frame);
+    reportError("[line %d] in ", function->chunk.lines[instruction]);
+    int callLine;
+    ObjFunction *inlined = inlinedAt(function, instruction, &callLine);
+    if (inlined != NULL) {
+      // the frame the call would have had
+      reportFunction(inlined);
+      reportError("[line %d] in ", callLine);
     }
+    reportFunction(function);
   }
+}
 
-  resetStack();
+// Out of heap, either past the VM's limit or out of memory altogether. This
+// can happen deep inside any allocation, so rather than returning we unwind
+// to the innermost call into the VM, which reports a runtime error.
+void heapExhausted(size_t requested) {
+  if (vm->errorHandler == NULL) {
+    flushOutput(&vm->output);
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+  }
+
+  // half the error buffer, leaving room for the frames after it
+  char report[ERROR_MAX / 2];
+  heapReport(report, sizeof(report));
+  if (vm->heapLimit != 0) {
+    runtimeError("Heap limit exceeded allocating %zu bytes.\n%s", requested,
+                 report);
+  } else {
+    runtimeError("Out of memory allocating %zu bytes.\n%s", requested, report);
+  }
+  longjmp(*vm->errorHandler, 1);
+}
+
+// natives can't raise the error themselves since they don't know where the
+// VM is, so they leave the message here and return false.
+static _Thread_local char nativeMessage[ERROR_MAX];
+
+void nativeError(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  vsnprintf(nativeMessage, sizeof(nativeMessage), format, args);
+  va_end(args);
 }
 
-static void defineNative(const char *name, NativeFn function) {
+void defineNative(const char *name, NativeFn function, int arity,
+                  void *userdata) {
   push(OBJ_VAL(copyString(name, (int)strlen(name))));
-  push(OBJ_VAL(newNative(function)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  push(OBJ_VAL(newNative(function, arity, userdata)));
+  tableSet(&vm->globals, AS_STRING(vm->stackTop[-2]), vm->stackTop[-1]);
   pop();
   pop();
 }
 
 void push(Value value) {
-  *vm.stackTop = value;
-  vm.stackTop++;
+  *vm->stackTop = value;
+  vm->stackTop++;
 }
 
 Value pop() {
-  vm.stackTop--;
-  return *vm.stackTop;
+  vm->stackTop--;
+  return *vm->stackTop;
+}
+
+static long long monotonicNanos() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (long long)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// Hand out the next slice of fuel, or stop the script if it has used up its
+// budget, run past its deadline, or been asked to stop. This is only reached
+// once every FUEL_SLICE loops and calls, so it can afford to look at the clock.
+bool refuel() {
+  vm->ticksUsed += vm->fuelGranted;
+
+  if (atomic_load(&vm->interruptRequested)) {
+    atomic_store(&vm->interruptRequested, false);
+    runtimeError("Script interrupted.");
+    return false;
+  }
+
+  if (vm->budget != 0 && vm->ticksUsed >= vm->budget) {
+    runtimeError("Instruction budget of %ld exhausted.", vm->budget);
+    return false;
+  }
+
+  if (vm->deadline != 0 && monotonicNanos() >= vm->deadline) {
+    runtimeError("Deadline of %ld ms exceeded.", vm->timeout);
+    return false;
+  }
+
+  long slice = FUEL_SLICE;
+  if (vm->budget != 0 && vm->budget - vm->ticksUsed < slice) {
+    slice = vm->budget - vm->ticksUsed;
+  }
+  vm->fuel = vm->fuelGranted = slice;
+  return true;
+}
+
+// Start counting afresh for a new call from the outside. An interrupt that
+// came in while nothing was running was meant for the call before.
+static void resetFuel() {
+  atomic_store(&vm->interruptRequested, false);
+  vm->ticksUsed = 0;
+  vm->fuelGranted = 0;
+  vm->fuel = 0; // the first loop or call picks up a proper slice
+  vm->deadline =
+      vm->timeout != 0 ? monotonicNanos() + vm->timeout * 1000000LL : 0;
 }
 
 // look down into the stack "distance" positions
-static Value peek(int distance) { return vm.stackTop[-1 - distance]; }
+static Value peek(int distance) { return vm->stackTop[-1 - distance]; }
+
+// Count a call or a loop iteration towards tiering up, true when the
+// function has just become hot enough to optimize. Without the JIT there is
+// no point counting past that.
+static inline bool warmUp(ObjFunction *function) {
+#if defined(LOX_JIT)
+  function->hotness++;
+#elif defined(LOX_OPTIMIZE)
+  if (!function->optimized)
+    function->hotness++;
+#endif
+#ifdef LOX_OPTIMIZE
+  return function->hotness == OPTIMIZE_THRESHOLD && !function->optimized;
+#else
+  (void)function;
+  return false;
+#endif
+}
+
+#ifdef LOX_OPTIMIZE
+// Have a go at rewriting the function's bytecode, just the once. Every frame
+// running it, recursion included, carries on from the same point in the new
+// code. The frames' ips have to be saved first.
+static void optimize(ObjFunction *function) {
+  function->optimized = true;
+  if (function->jit != NULL || function->aot != NULL ||
+      function->lazySource != NULL)
+    return;
+
+  int entries[FRAMES_MAX];
+  int count = 0;
+  for (int i = 0; i < vm->frameCount; i++) {
+    if (vm->frames[i].function == function)
+      entries[count++] = (int)(vm->frames[i].ip - function->chunk.code);
+  }
+  if (!optimizeFunction(function, entries, count))
+    return;
+  count = 0;
+  for (int i = 0; i < vm->frameCount; i++) {
+    if (vm->frames[i].function == function)
+      vm->frames[i].ip = function->chunk.code + entries[count++];
+  }
+}
+#endif
+
+// the part of a call that is left once the arguments are known to fit
+static bool pushFrame(ObjFunction *function, int argCount) {
+  if (vm->frameCount == FRAMES_MAX) {
+    runtimeError("Stack overflow.");
+    return false;
+  }
+
+  CallFrame *frame = &vm->frames[vm->frameCount++];
+  frame->function = function;
+  frame->ip = function->chunk.code;
+  frame->slots = vm->stackTop - argCount - 1;
+#ifdef LOX_OPTIMIZE
+  if (warmUp(function))
+    optimize(function);
+#else
+  warmUp(function);
+#endif
+  return true;
+}
 
 static bool call(ObjFunction *function, int argCount) {
 
@@ -99,15 +740,44 @@ static bool call(ObjFunction *function, int argCount) {
     return false;
   }
 
-  if (vm.frameCount == FRAMES_MAX) {
-    runtimeError("Stack overflow.");
+  if (function->lazySource != NULL && !compileLazily(function)) {
+    runtimeError("Could not compile %s().", function->name->chars);
     return false;
   }
 
-  CallFrame *frame = &vm.frames[vm.frameCount++];
-  frame->function = function;
-  frame->ip = function->chunk.code;
-  frame->slots = vm.stackTop - argCount - 1;
+  return pushFrame(function, argCount);
+}
+
+// only functions with upvalues look at frame->closure, so calls to the others
+// don't bother setting it
+static bool callClosure(ObjClosure *closure, int argCount) {
+  if (!call(closure->function, argCount))
+    return false;
+  vm->frames[vm->frameCount - 1].closure = closure;
+  return true;
+}
+
+// a method is a function, or a closure when it captured super or anything else
+static bool callMethod(Value method, int argCount) {
+  if (IS_CLOSURE(method))
+    return callClosure(AS_CLOSURE(method), argCount);
+  return call(AS_FUNCTION(method), argCount);
+}
+
+// the native's result takes the place of it and its arguments
+static bool callNative(ObjNative *native, int argCount) {
+  Value result = NIL_VAL;
+  nativeMessage[0] = '\0';
+  if (!native->function(native->userdata, argCount, vm->stackTop - argCount,
+                        &result)) {
+    runtimeError("%s", nativeMessage[0] != '\0' ? nativeMessage
+                                                : "Native call failed.");
+    // or a native further out that fails without a word would repeat it
+    nativeMessage[0] = '\0';
+    return false;
+  }
+  vm->stackTop -= argCount + 1;
+  push(result);
   return true;
 }
 
@@ -117,14 +787,39 @@ static bool callValue(Value callee, int argCount) {
     case OBJ_FUNCTION:
       return call(AS_FUNCTION(callee), argCount);
 
-    case OBJ_NATIVE: {
-      NativeFn native = AS_NATIVE(callee);
-      Value result = native(argCount, vm.stackTop - argCount);
-      vm.stackTop -= argCount + 1;
-      push(result);
+    case OBJ_CLOSURE:
+      return callClosure(AS_CLOSURE(callee), argCount);
+
+    case OBJ_CLASS: {
+      // the new instance takes the place of the class, as the initializer's
+      // receiver and then as the result
+      ObjClass *klass = AS_CLASS(callee);
+      vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+      if (!IS_NIL(klass->initializer))
+        return callMethod(klass->initializer, argCount);
+      if (argCount != 0) {
+        runtimeError("Expected 0 arguments but got %d.", argCount);
+        return false;
+      }
       return true;
     }
 
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
+      vm->stackTop[-argCount - 1] = bound->receiver;
+      return callMethod(bound->method, argCount);
+    }
+
+    case OBJ_NATIVE: {
+      ObjNative *native = AS_NATIVE(callee);
+      if (native->arity != -1 && argCount != native->arity) {
+        runtimeError("Expected %d arguments but got %d.", native->arity,
+                     argCount);
+        return false;
+      }
+      return callNative(native, argCount);
+    }
+
     default:
       break; // Non-callable object type.
     }
@@ -133,6 +828,100 @@ static bool callValue(Value callee, int argCount) {
   return false;
 }
 
+// OP_CALL. When the callee is the one the call site's cache remembers, the
+// type and the argument count are known to be fine, so it goes straight to
+// the frame or the native. Anything else goes through callValue() and is
+// remembered for next time if it worked, unless it is a class or a bound
+// method, which get made up afresh or need more than a frame.
+static bool callCached(int argCount, CallCache *cache) {
+  Value callee = peek(argCount);
+  if (IS_OBJ(callee) && AS_OBJ(callee) == cache->callee) {
+    switch (cache->kind) {
+    case CALL_FUNCTION:
+      return pushFrame((ObjFunction *)cache->callee, argCount);
+    case CALL_CLOSURE: {
+      ObjClosure *closure = (ObjClosure *)cache->callee;
+      if (!pushFrame(closure->function, argCount))
+        return false;
+      vm->frames[vm->frameCount - 1].closure = closure;
+      return true;
+    }
+    case CALL_NATIVE:
+      return callNative((ObjNative *)cache->callee, argCount);
+    case CALL_NONE:
+      break;
+    }
+  }
+
+  if (!callValue(callee, argCount))
+    return false;
+  if (IS_FUNCTION(callee)) {
+    cache->kind = CALL_FUNCTION;
+  } else if (IS_CLOSURE(callee)) {
+    cache->kind = CALL_CLOSURE;
+  } else if (IS_NATIVE(callee)) {
+    cache->kind = CALL_NATIVE;
+  } else {
+    return true;
+  }
+  cache->callee = AS_OBJ(callee);
+  return true;
+}
+
+// the open upvalue for a stack slot, shared by every closure capturing it
+static ObjUpvalue *captureUpvalue(Value *local) {
+  ObjUpvalue *previous = NULL;
+  ObjUpvalue *upvalue = vm->openUpvalues;
+  while (upvalue != NULL && upvalue->location > local) {
+    previous = upvalue;
+    upvalue = upvalue->next;
+  }
+  if (upvalue != NULL && upvalue->location == local)
+    return upvalue;
+
+  ObjUpvalue *created = newUpvalue(local);
+  created->next = upvalue;
+  if (previous == NULL) {
+    vm->openUpvalues = created;
+  } else {
+    previous->next = created;
+  }
+  return created;
+}
+
+// Move every open upvalue from last up off the stack, all at once when a
+// scope or a function ends.
+void closeUpvalues(Value *last) {
+  while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
+    ObjUpvalue *upvalue = vm->openUpvalues;
+    upvalue->closed = *upvalue->location;
+    upvalue->location = &upvalue->closed;
+    vm->openUpvalues = upvalue->next;
+  }
+}
+
+// Wrap a function in a closure, capturing what it needs from the frame
+// creating it, and push that.
+void pushClosure(CallFrame *frame, ObjFunction *function) {
+  ObjClosure *closure = newClosure(function);
+  for (int i = 0; i < function->upvalueCount; i++) {
+    Upvalue *upvalue = &function->upvalues[i];
+    Value *local = frame->slots + upvalue->index;
+    if (!upvalue->isLocal) {
+      closure->upvalues[i] =
+          frame->closure->upvalues[upvalue->index];
+    } else if (upvalue->boxed) {
+      closure->upvalues[i] = OBJ_VAL(captureUpvalue(local));
+    } else if (local >= vm->stackTop) {
+      // a local function naming itself, the closure is about to go there
+      closure->upvalues[i] = OBJ_VAL(closure);
+    } else {
+      closure->upvalues[i] = *local;
+    }
+  }
+  push(OBJ_VAL(closure));
+}
+
 // return if the value is false. In our language, false is either the literal
 // false, or nil.
 static bool isFalsey(Value value) {
@@ -140,7 +929,7 @@ static bool isFalsey(Value value) {
 }
 
 // TODO add more string operations
-static void concatenate() {
+void concatenate() {
   ObjString *b = AS_STRING(pop());
   ObjString *a = AS_STRING(pop());
 
@@ -154,26 +943,372 @@ static void concatenate() {
   push(OBJ_VAL(result));
 }
 
-// run our bytecode
-static InterpretResult run() {
-  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+// Turn the items on top of the stack into a list, which replaces them.
+void buildList(int itemCount) {
+  ObjList *list = newList(itemCount);
+  if (itemCount > 0) // [] has no items array to copy into
+    memcpy(list->items, vm->stackTop - itemCount, sizeof(Value) * itemCount);
+  list->count = itemCount;
+  vm->stackTop -= itemCount;
+  push(OBJ_VAL(list));
+}
+
+static bool validKey(Value key) {
+  if (IS_NUMBER(key) && isnan(AS_NUMBER(key))) {
+    runtimeError("NaN can't be a map key.");
+    return false;
+  }
+  return true;
+}
+
+// the index on top of the stack as a position in the list or array below it
+static bool checkIndex(int *index) {
+  int count;
+  if (IS_LIST(peek(1))) {
+    count = AS_LIST(peek(1))->count;
+  } else if (IS_FLOAT_ARRAY(peek(1))) {
+    count = AS_FLOAT_ARRAY(peek(1))->count;
+  } else {
+    runtimeError("Can only index into a list, a float64 array or a map.");
+    return false;
+  }
+  if (!toInt(peek(0), index)) {
+    runtimeError("Index must be a whole number.");
+    return false;
+  }
+  if (*index < 0 || *index >= count) {
+    runtimeError("Index %d out of range for %d items.", *index, count);
+    return false;
+  }
+  return true;
+}
+
+// The general cases of OP_GET_INDEX and OP_SET_INDEX. The interpreter and
+// compiled code handle a list and an integer index in range themselves.
+InterpretResult getIndex() {
+  if (IS_MAP(peek(1))) {
+    Value value;
+    if (!mapGet(AS_MAP(peek(1)), peek(0), &value)) {
+      runtimeError("Key not in map.");
+      return INTERPRET_RUNTIME_ERROR;
+    }
+    vm->stackTop -= 2;
+    push(value);
+    return INTERPRET_OK;
+  }
+
+  int index;
+  if (!checkIndex(&index))
+    return INTERPRET_RUNTIME_ERROR;
+  Value item = IS_LIST(peek(1))
+                   ? AS_LIST(peek(1))->items[index]
+                   : NUMBER_VAL(AS_FLOAT_ARRAY(peek(1))->values[index]);
+  vm->stackTop -= 2;
+  push(item);
+  return INTERPRET_OK;
+}
+
+InterpretResult setIndex() {
+  Value item = pop();
+  if (IS_MAP(peek(1))) {
+    if (!validKey(peek(0)))
+      return INTERPRET_RUNTIME_ERROR;
+    mapSet(AS_MAP(peek(1)), peek(0), item);
+    vm->stackTop -= 2;
+    push(item);
+    return INTERPRET_OK;
+  }
+
+  int index;
+  if (!checkIndex(&index))
+    return INTERPRET_RUNTIME_ERROR;
+  if (IS_LIST(peek(1))) {
+    AS_LIST(peek(1))->items[index] = item;
+  } else if (IS_NUMBER(item)) {
+    AS_FLOAT_ARRAY(peek(1))->values[index] = AS_NUMBER(item);
+  } else {
+    runtimeError("Can only store numbers in a float64 array.");
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  vm->stackTop -= 2;
+  push(item);
+  return INTERPRET_OK;
+}
+
+void pushClass(ObjString *name) { push(OBJ_VAL(newClass(name))); }
+
+// add the method on top of the stack to the class below it
+void defineMethod(ObjString *name) {
+  ObjClass *klass = AS_CLASS(peek(1));
+  tableSet(&klass->methods, name, peek(0));
+  if (name == vm->initString)
+    klass->initializer = peek(0);
+  klass->version++;
+  pop();
+}
+
+// Copy the superclass's methods down into the subclass, before the subclass
+// adds its own. Method lookups never have to walk up the hierarchy.
+InterpretResult inherit() {
+  if (!IS_CLASS(peek(1))) {
+    runtimeError("Superclass must be a class.");
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  ObjClass *superclass = AS_CLASS(peek(1));
+  ObjClass *subclass = AS_CLASS(peek(0));
+  tableAddAll(&superclass->methods, &subclass->methods);
+  subclass->initializer = superclass->initializer;
+  subclass->version++;
+  pop();
+  return INTERPRET_OK;
+}
+
+// replace the receiver on top of the stack with one of its class's methods
+static InterpretResult bindMethod(ObjClass *klass, ObjString *name) {
+  Value method;
+  if (!tableGet(&klass->methods, name, &method)) {
+    runtimeError("Undefined property '%s'.", name->chars);
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  vm->stackTop[-1] = OBJ_VAL(newBoundMethod(peek(0), method));
+  return INTERPRET_OK;
+}
+
+// What the property is for instances shaped like this one, from any way of
+// the cache, or looked up and put in a new way. NULL if there is no such
+// property. Fields shadow methods.
+static CacheEntry *lookupProperty(ObjInstance *instance, ObjString *name,
+                                  PropertyCache *cache) {
+  ObjClass *klass = instance->klass;
+  CacheEntry *entry = cacheFind(cache, instance->shape);
+  if (entry != NULL && (entry->slot >= 0 || entry->version == klass->version))
+    return entry;
+
+  int slot = shapeSlot(instance->shape, name);
+  Value method = NIL_VAL;
+  if (slot == -1 && !tableGet(&klass->methods, name, &method)) {
+    runtimeError("Undefined property '%s'.", name->chars);
+    return NULL;
+  }
+  if (entry == NULL)
+    entry = cacheAdd(cache, instance->shape);
+  entry->slot = slot;
+  entry->version = klass->version;
+  entry->method = method;
+  return entry;
+}
+
+// The general cases of OP_GET_PROPERTY and OP_SET_PROPERTY, which look in
+// every way of the cache and fill a new one in on a miss. The interpreter and
+// compiled code only check the first way themselves.
+InterpretResult getProperty(ObjString *name, PropertyCache *cache) {
+  if (!IS_INSTANCE(peek(0))) {
+    runtimeError("Only instances have properties.");
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  ObjInstance *instance = AS_INSTANCE(peek(0));
+  CacheEntry *entry = lookupProperty(instance, name, cache);
+  if (entry == NULL)
+    return INTERPRET_RUNTIME_ERROR;
+
+  if (entry->slot >= 0) {
+    vm->stackTop[-1] = instance->fields[entry->slot];
+  } else {
+    vm->stackTop[-1] = OBJ_VAL(newBoundMethod(peek(0), entry->method));
+  }
+  return INTERPRET_OK;
+}
 
-#define READ_BYTE() (*frame->ip++)
+InterpretResult setProperty(ObjString *name, PropertyCache *cache) {
+  if (!IS_INSTANCE(peek(1))) {
+    runtimeError("Only instances have fields.");
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  ObjInstance *instance = AS_INSTANCE(peek(1));
+  CacheEntry *entry = cacheFind(cache, instance->shape);
+  if (entry == NULL) {
+    ObjShape *after = instance->shape;
+    int slot = shapeSlot(after, name);
+    if (slot == -1) {
+      after = shapeWith(after, name);
+      slot = after->count - 1;
+    }
+    entry = cacheAdd(cache, instance->shape);
+    entry->after = after;
+    entry->slot = slot;
+  }
 
-#define READ_SHORT()                                                           \
-  (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+  if (entry->after != instance->shape) {
+    growFields(instance, entry->after);
+    instance->shape = entry->after;
+  }
+  instance->fields[entry->slot] = peek(0);
+  vm->stackTop[-2] = peek(0);
+  vm->stackTop--;
+  return INTERPRET_OK;
+}
+
+// the superclass on top of the stack, the receiver below it
+InterpretResult getSuper(ObjString *name) {
+  ObjClass *superclass = AS_CLASS(pop());
+  return bindMethod(superclass, name);
+}
+
+// Call a method on the receiver sitting below the arguments, which stays
+// where it is as the method's this. No bound method is made. A field holding
+// something callable is called instead, in the receiver's place.
+static bool invoke(ObjString *name, int argCount, PropertyCache *cache) {
+  Value receiver = peek(argCount);
+  if (!IS_INSTANCE(receiver)) {
+    runtimeError("Only instances have methods.");
+    return false;
+  }
+  ObjInstance *instance = AS_INSTANCE(receiver);
+  CacheEntry *entry = lookupProperty(instance, name, cache);
+  if (entry == NULL)
+    return false;
+
+  if (entry->slot >= 0) {
+    Value field = instance->fields[entry->slot];
+    vm->stackTop[-argCount - 1] = field;
+    return callValue(field, argCount);
+  }
+  return callMethod(entry->method, argCount);
+}
+
+// super.name(args), with the superclass on top of the arguments. The cache
+// only has to know one class, a method's superclass never changes.
+static bool superInvoke(ObjString *name, int argCount, PropertyCache *cache) {
+  ObjClass *superclass = AS_CLASS(pop());
+  CacheEntry *entry = &cache->entries[0];
+  if (entry->shape != superclass->shape ||
+      entry->version != superclass->version) {
+    Value method;
+    if (!tableGet(&superclass->methods, name, &method)) {
+      runtimeError("Undefined property '%s'.", name->chars);
+      return false;
+    }
+    entry->shape = superclass->shape;
+    entry->version = superclass->version;
+    entry->slot = -1;
+    entry->method = method;
+  }
+  return callMethod(entry->method, argCount);
+}
+
+#ifdef LOX_JIT
+// Carry on with the frame in machine code if its function is hot enough,
+// compiling it first if need be. JIT_DEOPT means the interpreter has to do it.
+static int tryJit(CallFrame *frame) {
+  ObjFunction *function = frame->function;
+  if (function->jitDisabled) {
+    function->hotness = 0; // keep it from ever overflowing
+    return JIT_DEOPT;
+  }
+  if (function->jit == NULL) {
+    if (function->hotness < JIT_THRESHOLD)
+      return JIT_DEOPT;
+    if (!jitCompile(function)) {
+      function->jitDisabled = true;
+      return JIT_DEOPT;
+    }
+  }
+  return jitExecute(frame);
+}
+#endif
+
+// run our bytecode until the frame count drops back to baseFrame, which lets
+// the host call into Lox while other frames are still on the stack
+static InterpretResult run(int baseFrame) {
+  // The current frame's ip, slots and the stack top live in locals, where
+  // the C compiler can keep them in registers. SAVE() writes them back before
+  // anything outside run() gets to look at the VM: calls, helpers and
+  // errors. LOAD() picks them up again afterwards, LOAD_FRAME() all but the
+  // stack top, for when we know better than vm->stackTop.
+  CallFrame *frame;
+  uint8_t *ip;
+  Value *slots;
+  Value *sp;
+
+#define SAVE() (frame->ip = ip, vm->stackTop = sp)
+
+#define LOAD_FRAME()                                                           \
+  (frame = &vm->frames[vm->frameCount - 1], ip = frame->ip,                    \
+   slots = frame->slots)
+
+#define LOAD() (LOAD_FRAME(), sp = vm->stackTop)
+
+#define READ_BYTE() (*ip++)
+
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
 
 #define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_CACHE() (&frame->function->caches[READ_SHORT()])
+#define READ_CALL_CACHE() (&frame->function->callCaches[READ_SHORT()])
+
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    SAVE();                                                                    \
+    runtimeError(__VA_ARGS__);                                                 \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
+
+// for the instructions that leave all the work to a helper, which fails by
+// returning an error
+#define HELPER(call)                                                           \
+  do {                                                                         \
+    SAVE();                                                                    \
+    if ((call) != INTERPRET_OK)                                                \
+      return INTERPRET_RUNTIME_ERROR;                                          \
+    sp = vm->stackTop;                                                         \
+  } while (false)
+
+#define CONSUME_FUEL()                                                         \
+  do {                                                                         \
+    if (--vm->fuel <= 0) {                                                     \
+      SAVE();                                                                  \
+      if (!refuel())                                                           \
+        return INTERPRET_INTERRUPTED;                                          \
+    }                                                                          \
+  } while (false)
+
+// hand the current frame over to compiled code, which runs it either until it
+// returns or until it hits something only the interpreter can do
+#ifdef LOX_JIT
+#define ENTER_JIT()                                                            \
+  do {                                                                         \
+    SAVE();                                                                    \
+    int status = tryJit(frame);                                                \
+    if (status == JIT_RETURNED) {                                              \
+      if (vm->frameCount == baseFrame)                                         \
+        return INTERPRET_OK;                                                   \
+    } else if (status != JIT_DEOPT) {                                          \
+      return (InterpretResult)status;                                          \
+    }                                                                          \
+    LOAD();                                                                    \
+  } while (false)
+#else
+#define ENTER_JIT()                                                            \
+  do {                                                                         \
+  } while (false)
+#endif
+
+  LOAD();
 
   for (;;) {
 
 // debug our VM
 #ifdef DEBUG_TRACE_EXECUTION
 
-    // print our stack contents
+    // print our stack contents, after anything the script printed so far
+    flushOutput(&vm->output);
     printf(" ");
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+    for (Value *slot = vm->stack; slot < sp; slot++) {
       printf("[ ");
       printValue(*slot);
       printf(" ]");
@@ -183,7 +1318,7 @@ static InterpretResult run() {
     // dissasemble instruction expects an integer offset into the
     // chunk in order to print it
     disassembleInstruction(&frame->function->chunk,
-                           (int)(frame->ip - frame->function->chunk.code));
+                           (int)(ip - frame->function->chunk.code));
 #endif
 
     // decode the instruction
@@ -191,194 +1326,608 @@ static InterpretResult run() {
     switch (instruction = READ_BYTE()) {
     case OP_CONSTANT:
       Value constant = READ_CONSTANT();
-      push(constant);
-      printf("\n");
+      PUSH(constant);
       break;
 
     case OP_NIL:
-      push(NIL_VAL);
+      PUSH(NIL_VAL);
       break;
     case OP_TRUE:
-      push(BOOL_VAL(true));
+      PUSH(BOOL_VAL(true));
       break;
     case OP_FALSE:
-      push(BOOL_VAL(false));
+      PUSH(BOOL_VAL(false));
       break;
 
-    case OP_EQUAL: {
-      Value b = pop();
-      Value a = pop();
-      push(BOOL_VAL(valuesEqual(a, b)));
+    case OP_EQUAL:
+      sp[-2] = BOOL_VAL(valuesEqual(sp[-2], sp[-1]));
+      sp--;
       break;
-    }
 
     case OP_GREATER:
-      BINARY_OP(BOOL_VAL, >);
+      BINARY_OP(greaterNumbers, OP_GREATER_NUM);
       break;
     case OP_LESS:
-      BINARY_OP(BOOL_VAL, <);
+      BINARY_OP(lessNumbers, OP_LESS_NUM);
       break;
 
     case OP_NEGATE:
-      if (!IS_NUMBER(peek(0))) {
-        runtimeError("Operand must be a number.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-
-      push(NUMBER_VAL(-AS_NUMBER(pop())));
+      if (!IS_NUMBER(PEEK(0)))
+        RUNTIME_ERROR("Operand must be a number.");
+      sp[-1] = negateNumber(sp[-1]);
       break;
 
     case OP_NOT:
-      push(BOOL_VAL(isFalsey(pop())));
+      sp[-1] = BOOL_VAL(isFalsey(sp[-1]));
       break;
 
+    case OP_RETURN_CLOSING:
+      closeUpvalues(slots);
+      // fall through
     case OP_RETURN: {
-      Value result = pop();
-      vm.frameCount--;
-      if (vm.frameCount == 0) {
-        pop();
+      Value result = POP();
+      vm->frameCount--;
+      sp = slots;
+      PUSH(result);
+      if (vm->frameCount == baseFrame) {
+        vm->stackTop = sp;
         return INTERPRET_OK;
       }
 
-      vm.stackTop = frame->slots;
-      push(result);
-      frame = &vm.frames[vm.frameCount - 1];
+      LOAD_FRAME();
       break;
     }
 
     case OP_ADD: {
-      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+      if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+        SAVE();
         concatenate();
-      } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-        double b = AS_NUMBER(pop());
-        double a = AS_NUMBER(pop());
-        push(NUMBER_VAL(a + b));
+        sp = vm->stackTop;
+      } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+        sp[-2] = addNumbers(sp[-2], sp[-1]);
+        sp--;
+        ip[-1] = OP_ADD_NUM;
       } else {
-        runtimeError("Operands must be two numbers or two strings.");
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
       }
       break;
     }
 
     case OP_SUBTRACT:
-      BINARY_OP(NUMBER_VAL, -);
+      BINARY_OP(subtractNumbers, OP_SUBTRACT_NUM);
       break;
     case OP_MULTIPLY:
-      BINARY_OP(NUMBER_VAL, *);
+      BINARY_OP(multiplyNumbers, OP_MULTIPLY_NUM);
       break;
     case OP_DIVIDE:
-      BINARY_OP(NUMBER_VAL, /);
+      BINARY_OP(divideNumbers, OP_DIVIDE_NUM);
+      break;
+
+    case OP_ADD_NUM:
+      QUICK_OP(addNumbers, OP_ADD);
+      break;
+    case OP_SUBTRACT_NUM:
+      QUICK_OP(subtractNumbers, OP_SUBTRACT);
+      break;
+    case OP_MULTIPLY_NUM:
+      QUICK_OP(multiplyNumbers, OP_MULTIPLY);
+      break;
+    case OP_DIVIDE_NUM:
+      QUICK_OP(divideNumbers, OP_DIVIDE);
+      break;
+    case OP_GREATER_NUM:
+      QUICK_OP(greaterNumbers, OP_GREATER);
+      break;
+    case OP_LESS_NUM:
+      QUICK_OP(lessNumbers, OP_LESS);
+      break;
+
+    case OP_NEGATE_UNCHECKED:
+      sp[-1] = negateNumber(sp[-1]);
+      break;
+    case OP_ADD_UNCHECKED:
+      UNCHECKED_OP(addNumbers);
+      break;
+    case OP_SUBTRACT_UNCHECKED:
+      UNCHECKED_OP(subtractNumbers);
+      break;
+    case OP_MULTIPLY_UNCHECKED:
+      UNCHECKED_OP(multiplyNumbers);
+      break;
+    case OP_DIVIDE_UNCHECKED:
+      UNCHECKED_OP(divideNumbers);
+      break;
+    case OP_GREATER_UNCHECKED:
+      UNCHECKED_OP(greaterNumbers);
+      break;
+    case OP_LESS_UNCHECKED:
+      UNCHECKED_OP(lessNumbers);
       break;
 
     case OP_PRINT: {
-      printValue(pop());
-      printf("\n");
+      writeValue(&vm->output, POP());
+      writeByte(&vm->output, '\n');
       break;
     }
 
     case OP_POP:
-      pop();
+      sp--;
       break;
 
     case OP_DEFINE_GLOBAL: {
       ObjString *name = READ_STRING();
-      tableSet(&vm.globals, name, peek(0));
-      pop();
+      tableSet(&vm->globals, name, PEEK(0));
+      sp--;
       break;
     }
 
     case OP_GET_GLOBAL: {
       ObjString *name = READ_STRING();
       Value value;
-      if (!tableGet(&vm.globals, name, &value)) {
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      push(value);
+      if (!tableGet(&vm->globals, name, &value))
+        RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+      PUSH(value);
       break;
     }
 
     case OP_SET_GLOBAL: {
       ObjString *name = READ_STRING();
-      if (tableSet(&vm.globals, name, peek(0))) {
-        tableDelete(&vm.globals, name);
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
+      if (tableSet(&vm->globals, name, PEEK(0))) {
+        tableDelete(&vm->globals, name);
+        RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
       }
       break;
     }
 
     case OP_GET_LOCAL: {
       uint8_t slot = READ_BYTE();
-      push(frame->slots[slot]);
+      PUSH(slots[slot]);
       break;
     }
 
     case OP_SET_LOCAL: {
       uint8_t slot = READ_BYTE();
-      frame->slots[slot] = peek(0);
+      slots[slot] = PEEK(0);
       break;
     }
 
     case OP_JUMP_IF_FALSE: {
       uint16_t offset = READ_SHORT();
-      if (isFalsey(peek(0)))
-        frame->ip += offset;
+      if (isFalsey(PEEK(0)))
+        ip += offset;
       break;
     }
 
     case OP_JUMP: {
       uint16_t offset = READ_SHORT();
-      frame->ip += offset;
+      ip += offset;
       break;
     }
 
     case OP_LOOP: {
       uint16_t offset = READ_SHORT();
-      frame->ip -= offset;
+      // before jumping back, an error out of fuel is the loop's
+      CONSUME_FUEL();
+      ip -= offset;
+#ifdef LOX_OPTIMIZE
+      if (warmUp(frame->function)) {
+        SAVE();
+        optimize(frame->function);
+        LOAD_FRAME();
+      }
+#else
+      warmUp(frame->function);
+#endif
+      ENTER_JIT();
       break;
     }
 
     case OP_CALL: {
       int argCount = READ_BYTE();
-      if (!callValue(peek(argCount), argCount)) {
+      CallCache *cache = READ_CALL_CACHE();
+      int depth = vm->frameCount;
+      CONSUME_FUEL();
+      SAVE();
+      if (!callCached(argCount, cache))
         return INTERPRET_RUNTIME_ERROR;
+      LOAD();
+      if (vm->frameCount > depth)
+        ENTER_JIT();
+      break;
+    }
+
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE: {
+      ObjString *name = READ_STRING();
+      int argCount = READ_BYTE();
+      PropertyCache *cache = READ_CACHE();
+      int depth = vm->frameCount;
+      CONSUME_FUEL();
+      SAVE();
+      if (instruction == OP_INVOKE ? !invoke(name, argCount, cache)
+                                   : !superInvoke(name, argCount, cache))
+        return INTERPRET_RUNTIME_ERROR;
+      LOAD();
+      if (vm->frameCount > depth)
+        ENTER_JIT();
+      break;
+    }
+
+    case OP_GUARD_CALLEE: {
+      int argCount = READ_BYTE();
+      Value function = READ_CONSTANT();
+      uint16_t offset = READ_SHORT();
+      Value callee = PEEK(argCount);
+      if (!IS_OBJ(callee) || AS_OBJ(callee) != AS_OBJ(function))
+        ip += offset;
+      break;
+    }
+
+    case OP_MEMO_LOOKUP: {
+      uint16_t offset = READ_SHORT();
+      Value result;
+      if (memoLookup(frame->function, slots + 1, &result))
+        PUSH(result);
+      else
+        ip += offset;
+      break;
+    }
+
+    case OP_MEMO_STORE:
+      SAVE(); // the cache can run out of heap growing
+      memoStore(frame->function, slots + 1 + frame->function->arity, PEEK(0));
+      break;
+
+    case OP_BUILD_LIST: {
+      int itemCount = READ_BYTE();
+      SAVE();
+      buildList(itemCount);
+      sp = vm->stackTop;
+      break;
+    }
+
+    case OP_CLOSURE: {
+      ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+      SAVE();
+      pushClosure(frame, function);
+      sp = vm->stackTop;
+      break;
+    }
+
+    case OP_GET_UPVALUE:
+      PUSH(frame->closure->upvalues[READ_BYTE()]);
+      break;
+
+    case OP_GET_BOXED: {
+      Value box = frame->closure->upvalues[READ_BYTE()];
+      PUSH(*AS_UPVALUE(box)->location);
+      break;
+    }
+
+    case OP_SET_BOXED: {
+      Value box = frame->closure->upvalues[READ_BYTE()];
+      *AS_UPVALUE(box)->location = PEEK(0);
+      break;
+    }
+
+    case OP_CLOSE_UPVALUES:
+      closeUpvalues(slots + READ_BYTE());
+      break;
+
+    case OP_GET_INDEX:
+      if (IS_LIST(sp[-2]) && IS_INT(sp[-1]) &&
+          (uint64_t)AS_INT(sp[-1]) < (uint64_t)AS_LIST(sp[-2])->count) {
+        sp[-2] = AS_LIST(sp[-2])->items[AS_INT(sp[-1])];
+        sp--;
+      } else {
+        HELPER(getIndex());
       }
-      frame = &vm.frames[vm.frameCount - 1];
+      break;
+
+    case OP_SET_INDEX:
+      if (IS_LIST(sp[-3]) && IS_INT(sp[-2]) &&
+          (uint64_t)AS_INT(sp[-2]) < (uint64_t)AS_LIST(sp[-3])->count) {
+        AS_LIST(sp[-3])->items[AS_INT(sp[-2])] = sp[-1];
+        sp[-3] = sp[-1];
+        sp -= 2;
+      } else {
+        HELPER(setIndex());
+      }
+      break;
+
+    case OP_CLASS: {
+      ObjString *name = READ_STRING();
+      SAVE();
+      pushClass(name);
+      sp = vm->stackTop;
+      break;
+    }
+
+    case OP_METHOD: {
+      ObjString *name = READ_STRING();
+      SAVE();
+      defineMethod(name);
+      sp = vm->stackTop;
+      break;
+    }
+
+    case OP_INHERIT:
+      HELPER(inherit());
+      break;
+
+    case OP_GET_PROPERTY: {
+      // a field of an instance shaped like the last one is a single load
+      ObjString *name = READ_STRING();
+      PropertyCache *cache = READ_CACHE();
+      if (IS_INSTANCE(sp[-1])) {
+        ObjInstance *instance = AS_INSTANCE(sp[-1]);
+        CacheEntry *entry = &cache->entries[0];
+        if (entry->shape == instance->shape && entry->slot >= 0) {
+          sp[-1] = instance->fields[entry->slot];
+          break;
+        }
+      }
+      HELPER(getProperty(name, cache));
+      break;
+    }
+
+    case OP_SET_PROPERTY: {
+      // so is storing one, or adding one there is already room for
+      ObjString *name = READ_STRING();
+      PropertyCache *cache = READ_CACHE();
+      if (IS_INSTANCE(sp[-2])) {
+        ObjInstance *instance = AS_INSTANCE(sp[-2]);
+        CacheEntry *entry = &cache->entries[0];
+        if (entry->shape == instance->shape &&
+            entry->after->count <= instance->capacity) {
+          instance->shape = entry->after;
+          instance->fields[entry->slot] = sp[-1];
+          sp[-2] = sp[-1];
+          sp--;
+          break;
+        }
+      }
+      HELPER(setProperty(name, cache));
+      break;
+    }
+
+    case OP_GET_SUPER: {
+      ObjString *name = READ_STRING();
+      HELPER(getSuper(name));
       break;
     }
 
     default:
+      SAVE();
       return INTERPRET_RUNTIME_ERROR;
     }
   }
 
+#undef SAVE
+#undef LOAD_FRAME
+#undef LOAD
 #undef READ_BYTE
+#undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_CACHE
+#undef READ_CALL_CACHE
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef RUNTIME_ERROR
+#undef HELPER
+#undef CONSUME_FUEL
+#undef ENTER_JIT
+}
+
+// run the frame that was just pushed until it returns, as native code if it
+// was translated ahead of time or has become hot enough
+static InterpretResult runFrame(int baseFrame) {
+  CallFrame *frame = &vm->frames[vm->frameCount - 1];
+  if (frame->function->aot != NULL)
+    return (InterpretResult)frame->function->aot(frame);
+#ifdef LOX_JIT
+  int status = tryJit(frame);
+  if (status == JIT_RETURNED)
+    return INTERPRET_OK;
+  if (status != JIT_DEOPT)
+    return (InterpretResult)status;
+#endif
+  return run(baseFrame);
+}
+
+// Compiled functions call each other directly, and if the callee bails out
+// half way the interpreter finishes it off here.
+InterpretResult finishCall() { return run(vm->frameCount - 1); }
+
+// Call the value sitting below the arguments on top of the stack and leave
+// its result there instead. Compiled code uses this for OP_CALL, so unlike
+// the interpreter it waits for the callee to return.
+InterpretResult runCall(int argCount, CallCache *cache) {
+  int depth = vm->frameCount;
+  if (--vm->fuel <= 0 && !refuel())
+    return INTERPRET_INTERRUPTED;
+  if (!callCached(argCount, cache))
+    return INTERPRET_RUNTIME_ERROR;
+  if (vm->frameCount > depth)
+    return runFrame(depth);
+  return INTERPRET_OK;
+}
+
+// the same for OP_INVOKE and OP_SUPER_INVOKE
+InterpretResult runInvoke(ObjString *name, int argCount, PropertyCache *cache) {
+  int depth = vm->frameCount;
+  if (--vm->fuel <= 0 && !refuel())
+    return INTERPRET_INTERRUPTED;
+  if (!invoke(name, argCount, cache))
+    return INTERPRET_RUNTIME_ERROR;
+  if (vm->frameCount > depth)
+    return runFrame(depth);
+  return INTERPRET_OK;
+}
+
+InterpretResult runSuperInvoke(ObjString *name, int argCount,
+                               PropertyCache *cache) {
+  int depth = vm->frameCount;
+  if (--vm->fuel <= 0 && !refuel())
+    return INTERPRET_INTERRUPTED;
+  if (!superInvoke(name, argCount, cache))
+    return INTERPRET_RUNTIME_ERROR;
+  if (vm->frameCount > depth)
+    return runFrame(depth);
+  return INTERPRET_OK;
+}
+
+// Throw away what a failed call into the VM left on the stack. A call made
+// from inside a native only owns the frames and slots above where it
+// started, the ones below are still running and the native may carry on.
+static void unwindTo(int baseFrame, Value *stackTop) {
+  if (baseFrame == 0) {
+    resetStack();
+    return;
+  }
+  closeUpvalues(stackTop);
+  vm->frameCount = baseFrame;
+  vm->stackTop = stackTop;
+}
+
+// Call any callable value with the given arguments and wait for its result.
+// This is the entry point embedders use to call back into the script.
+static InterpretResult enterFunction(Value callee, int argCount, Value *args,
+                                     Value *result) {
+  vm->error[0] = '\0';
+  if (vm->stackTop + argCount + 1 > vm->stack + STACK_MAX ||
+      vm->frameCount == FRAMES_MAX) {
+    reportError("Stack overflow.\n");
+    return INTERPRET_RUNTIME_ERROR;
+  }
+
+  int baseFrame = vm->frameCount;
+  Value *stackTop = vm->stackTop;
+
+  // anything that can't be returned normally ends up back here
+  jmp_buf handler;
+  jmp_buf *enclosing = vm->errorHandler;
+  vm->errorHandler = &handler;
+  if (setjmp(handler) != 0) {
+    vm->errorHandler = enclosing;
+    unwindTo(baseFrame, stackTop);
+    return INTERPRET_RUNTIME_ERROR;
+  }
+
+  if (baseFrame == 0) {
+    resetFuel();
+  }
+  push(callee);
+  for (int i = 0; i < argCount; i++) {
+    push(args[i]);
+  }
+
+  if (!callValue(callee, argCount)) {
+    vm->errorHandler = enclosing;
+    unwindTo(baseFrame, stackTop);
+    return INTERPRET_RUNTIME_ERROR;
+  }
+
+  // natives complete immediately, functions need the interpreter loop
+  if (vm->frameCount > baseFrame) {
+    InterpretResult status = runFrame(baseFrame);
+    if (status != INTERPRET_OK) {
+      vm->errorHandler = enclosing;
+      unwindTo(baseFrame, stackTop);
+      return status;
+    }
+  }
+  vm->errorHandler = enclosing;
+
+  Value value = pop();
+  if (result != NULL) {
+    *result = value;
+  }
+  return INTERPRET_OK;
+}
+
+InterpretResult callFunction(Value callee, int argCount, Value *args,
+                             Value *result) {
+  InterpretResult status = enterFunction(callee, argCount, args, result);
+  // natives calling back into the VM leave the flushing to the outermost call
+  if (vm->frameCount == 0)
+    flushOutput(&vm->output);
+  return status;
+}
+
+// run a compiled top level script
+InterpretResult runFunction(ObjFunction *function) {
+  return callFunction(OBJ_VAL(function), 0, NULL, NULL);
 }
 
 // driver function for our iinterpreter
 InterpretResult interpret(const char *source) {
+  vm->error[0] = '\0';
   ObjFunction *function = compile(source);
   if (function == NULL)
     return INTERPRET_COMPILE_ERROR;
 
-  push(OBJ_VAL(function));
-  call(function, 0);
-  return run();
+  return runFunction(function);
 }
 
-void initVM() {
+void initVM(VM *target) {
+  vm = target;
   resetStack();
-  vm.objects = NULL;
-  initTable(&vm.strings);
-  initTable(&vm.globals);
-  defineNative("clock", clockNative);
+  vm->objects = NULL;
+  vm->error[0] = '\0';
+  vm->printErrors = true;
+  vm->output.file = stdout;
+  vm->output.length = 0;
+  vm->lazyCompile = false;
+  vm->sources = NULL;
+  vm->releasing = false;
+  vm->bytesAllocated = 0;
+  vm->heapLimit = 0;
+  vm->errorHandler = NULL;
+  vm->budget = 0;
+  vm->timeout = 0;
+  atomic_init(&vm->interruptRequested, false);
+  resetFuel();
+  initPools(vm->pools);
+  memset(vm->objStats, 0, sizeof(vm->objStats));
+  initTable(&vm->strings);
+  initTable(&vm->globals);
+  vm->initString = NULL;
+  vm->initString = copyString("init", 4);
+  defineNative("clock", clockNative, 0, NULL);
+  defineNative("memoryStats", memoryStatsNative, 0, NULL);
+  defineNative("len", lenNative, 1, NULL);
+  defineNative("append", appendNative, 2, NULL);
+  defineNative("slice", sliceNative, 3, NULL);
+  defineNative("sort", sortNative, 1, NULL);
+  defineNative("float64Array", float64ArrayNative, 1, NULL);
+  defineNative("sum", sumNative, 1, NULL);
+  defineNative("dot", dotNative, 2, NULL);
+  defineNative("scale", scaleNative, 2, NULL);
+  defineNative("add", addNative, 2, NULL);
+  defineNative("prefixSum", prefixSumNative, 1, NULL);
+  defineNative("min", minNative, 1, NULL);
+  defineNative("max", maxNative, 1, NULL);
+  defineNative("map", mapNative, 0, NULL);
+  defineNative("has", hasNative, 2, NULL);
+  defineNative("delete", deleteNative, 2, NULL);
+  defineNative("keys", keysNative, 1, NULL);
+  defineNative("values", valuesNative, 1, NULL);
+  defineNative("nextKey", nextKeyNative, 2, NULL);
+  defineNative("memoStats", memoStatsNative, 1, NULL);
 }
 
-void freeVM() {
-  freeTable(&vm.strings);
+void freeVM(VM *target) {
+  vm = target;
+  flushOutput(&vm->output);
+  freeTable(&vm->strings);
+  freeTable(&vm->globals);
+  while (vm->sources != NULL) {
+    SourceCopy *next = vm->sources->next;
+    reallocate(vm->sources, sizeof(SourceCopy) + vm->sources->length + 1, 0);
+    vm->sources = next;
+  }
   freeObjects();
-  freeTable(&vm.globals);
 }
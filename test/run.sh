@@ -0,0 +1,44 @@
+#!/bin/bash
+# Runs the scripts in test/ and checks what they print: test/run.sh [interpreter]
+#
+# A script says what it expects in comments, the way the book's tests do:
+#   // expect: <line>                 the next line printed
+#   // expect runtime error: <text>   the error the script stops with, which
+#                                     only has to start with the text
+#   // args: <options>                extra options for the interpreter
+# The interpreter defaults to bin/bench, which make test builds.
+
+dir=$(dirname "$0")
+lox=${1:-$dir/../bin/bench}
+failed=0
+
+for script in "$dir"/*.lox; do
+	args=$(sed -n 's|.*// args: ||p' "$script")
+	expected=$(sed -n 's|.*// expect: ||p' "$script")
+	error=$(sed -n 's|.*// expect runtime error: ||p' "$script")
+
+	output=$("$lox" $args "$script" 2> /tmp/lox-test-stderr.$$)
+	status=$?
+	message=$(head -n 1 /tmp/lox-test-stderr.$$)
+
+	problem=
+	if [ "$output" != "$expected" ]; then
+		problem="printed:\n$output\nexpected:\n$expected"
+	elif [ -n "$error" ] && [ $status -ne 70 ]; then
+		problem="exited with $status instead of a runtime error"
+	elif [ -n "$error" ] && [[ "$message" != "$error"* ]]; then
+		problem="failed with: $message\nexpected: $error"
+	elif [ -z "$error" ] && [ $status -ne 0 ]; then
+		problem="exited with $status: $message"
+	fi
+
+	if [ -n "$problem" ]; then
+		echo -e "FAIL $(basename "$script")\n$problem"
+		failed=$((failed + 1))
+	else
+		echo "pass $(basename "$script")"
+	fi
+done
+rm -f /tmp/lox-test-stderr.$$
+
+exit $((failed > 0))